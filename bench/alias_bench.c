@@ -0,0 +1,120 @@
+#include "alias.h"
+#include "log.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Times the alias sampler behind weighted selection: building the table
+// over a whole catalog, drawing from it, and patching it after a batch
+// changes a few weights. Also checks that a small table draws in
+// proportion to its weights.
+//
+//   alias_bench [items] [draws]
+
+#define DEFAULT_ITEMS 2000000
+#define DEFAULT_DRAWS 20000000
+#define BATCH 10
+#define PATCHES 1000
+#define CHECK_ITEMS 50
+#define CHECK_DRAWS 10000000
+
+static uint64_t state = 1;
+
+static uint64_t next_random(void) {
+    uint64_t x = (state += 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Ratings of 0 to 5 stars, with a few boosted and a few disabled tracks
+static double random_weight(void) {
+    uint64_t r = next_random();
+    double weight = 1.0 + r % 6;
+    if ((r >> 8) % 100 == 0) {
+        weight *= 10;
+    } else if ((r >> 8) % 100 == 1) {
+        weight = 0;
+    }
+    return weight;
+}
+
+// Largest relative error of the drawn frequencies against the weights
+static double check_proportions(void) {
+    alias_t *alias = alias_create(CHECK_ITEMS);
+    long counts[CHECK_ITEMS] = {0};
+    for (int i = 0; i < CHECK_ITEMS; ++i) {
+        alias_set(alias, i, i % 7);
+    }
+    alias_build(alias);
+    for (long i = 0; i < CHECK_DRAWS; ++i) {
+        uint64_t r0 = next_random();
+        counts[alias_sample(alias, r0, next_random())]++;
+    }
+
+    double worst = 0;
+    for (int i = 0; i < CHECK_ITEMS; ++i) {
+        double expected = CHECK_DRAWS * alias_get(alias, i) /
+                          alias_total(alias);
+        if (expected == 0) {
+            worst = counts[i] > 0 ? INFINITY : worst;
+            continue;
+        }
+        double error = fabs(counts[i] - expected) / expected;
+        worst = error > worst ? error : worst;
+    }
+    alias_destroy(alias);
+    return worst;
+}
+
+int main(int argc, const char *argv[]) {
+    int num_items = argc > 1 ? atoi(argv[1]) : DEFAULT_ITEMS;
+    long num_draws = argc > 2 ? atol(argv[2]) : DEFAULT_DRAWS;
+    log_set_quiet(true);
+
+    alias_t *alias = alias_create(num_items);
+    for (int i = 0; i < num_items; ++i) {
+        alias_set(alias, i, random_weight());
+    }
+    double start = now();
+    int blocks = alias_build(alias);
+    double build = now() - start;
+
+    long sum = 0;
+    start = now();
+    for (long i = 0; i < num_draws; ++i) {
+        uint64_t r0 = next_random();
+        sum += alias_sample(alias, r0, next_random());
+    }
+    double draw = now() - start;
+
+    // What a weighted batch does: a handful of weights change, then the
+    // table is patched
+    long rebuilt = 0;
+    start = now();
+    for (int i = 0; i < PATCHES; ++i) {
+        for (int j = 0; j < BATCH; ++j) {
+            alias_set(alias, next_random() % num_items, random_weight());
+        }
+        rebuilt += alias_build(alias);
+    }
+    double patch = now() - start;
+
+    fprintf(stdout, "Alias: %d items in %d blocks\n", num_items, blocks);
+    fprintf(stdout, "Build: %.1f ms\n", build * 1000);
+    fprintf(stdout, "Draw: %.1f M draws per second (checksum %ld)\n",
+            num_draws / draw / 1000000, sum);
+    fprintf(stdout, "Patch: %.3f ms per batch of %d, %.1f blocks rebuilt\n",
+            patch * 1000 / PATCHES, BATCH, (double)rebuilt / PATCHES);
+    fprintf(stdout, "Accuracy: worst relative error %.4f over %d draws\n",
+            check_proportions(), CHECK_DRAWS);
+    alias_destroy(alias);
+    return 0;
+}
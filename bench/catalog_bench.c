@@ -0,0 +1,259 @@
+#include "catalog.h"
+#include "database.h"
+#include "log.h"
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Compares resolving a batch of random tracks row by row, the way
+// download_init() used to, with a single catalog_resolve() call, both
+// through SQL and from a snapshot.
+//
+//   catalog_bench <db> [tracks] [batch] [rounds]
+//
+// A synthetic catalog of `tracks` tracks (default 2000000) is generated at
+// <db> when it does not exist yet, and its snapshot at <db>.snap.
+
+#define DEFAULT_TRACKS 2000000
+#define DEFAULT_BATCH 100
+#define DEFAULT_ROUNDS 200
+#define TRACKS_PER_ALBUM 12
+
+static const char base58[] =
+    "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+static void exec(sqlite3 *db, const char *sql) {
+    char *error = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+        fprintf(stderr, "catalog_bench: %s: %s\n", sql, error);
+        exit(-1);
+    }
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "catalog_bench: %s: %s\n", sql, sqlite3_errmsg(db));
+        exit(-1);
+    }
+    return stmt;
+}
+
+static void insert(sqlite3_stmt *stmt) {
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "catalog_bench: insert failed\n");
+        exit(-1);
+    }
+    sqlite3_reset(stmt);
+}
+
+// Same shape as the real catalog: tracks, their album and 1 to 4 CIDs
+static void generate(const char *filename, int num_tracks) {
+    sqlite3 *db;
+    char text[64];
+
+    fprintf(stdout, "Generating %d tracks in %s\n", num_tracks, filename);
+    if (sqlite3_open(filename, &db) != SQLITE_OK) {
+        fprintf(stderr, "catalog_bench: Failed to create %s\n", filename);
+        exit(-1);
+    }
+    exec(db, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF;"
+             "CREATE TABLE albums (album_id INTEGER PRIMARY KEY, path TEXT);"
+             "CREATE TABLE tracks (track_id INTEGER PRIMARY KEY, "
+             "track_name TEXT, album_id INTEGER);"
+             "CREATE TABLE content (track_id INTEGER, cid TEXT, size INTEGER);"
+             "BEGIN");
+
+    sqlite3_stmt *album = prepare(db, "INSERT INTO albums VALUES (?, ?)");
+    sqlite3_stmt *track = prepare(db, "INSERT INTO tracks VALUES (?, ?, ?)");
+    sqlite3_stmt *content =
+        prepare(db, "INSERT INTO content VALUES (?, ?, ?)");
+    srand(1);
+    for (int id = 1; id <= num_tracks; ++id) {
+        int album_id = (id - 1) / TRACKS_PER_ALBUM + 1;
+        if ((id - 1) % TRACKS_PER_ALBUM == 0) {
+            snprintf(text, sizeof(text), "Artist %d/Album %d", album_id % 997,
+                     album_id);
+            sqlite3_bind_int(album, 1, album_id);
+            sqlite3_bind_text(album, 2, text, -1, SQLITE_TRANSIENT);
+            insert(album);
+        }
+
+        snprintf(text, sizeof(text), "%02d Track %d.opus",
+                 (id - 1) % TRACKS_PER_ALBUM + 1, id);
+        sqlite3_bind_int(track, 1, id);
+        sqlite3_bind_text(track, 2, text, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(track, 3, album_id);
+        insert(track);
+
+        for (int j = rand() % 4; j >= 0; --j) {
+            text[0] = 'Q';
+            text[1] = 'm';
+            for (int k = 2; k < 46; ++k) {
+                text[k] = base58[rand() % 58];
+            }
+            text[46] = '\0';
+            sqlite3_bind_int(content, 1, id);
+            sqlite3_bind_text(content, 2, text, -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(content, 3, 262144 + rand() % 4194304);
+            insert(content);
+        }
+    }
+    sqlite3_finalize(album);
+    sqlite3_finalize(track);
+    sqlite3_finalize(content);
+    exec(db, "COMMIT; CREATE INDEX content_track ON content (track_id)");
+    sqlite3_close(db);
+}
+
+// The size lookup download_init() made before catalog_resolve(), kept here
+// only to time it
+static int64_t *get_cid_sizes(sqlite3 *db, int track_id, int num_cids) {
+    const char *query = "SELECT size FROM content WHERE track_id = ?";
+    sqlite3_stmt *stmt;
+
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+
+    sqlite3_bind_int(stmt, 1, track_id);
+
+    int64_t *sizes = (int64_t *)malloc(num_cids * sizeof(int64_t));
+    if (sizes == NULL) {
+        fprintf(stderr, "catalog_bench: Memory allocation failed\n");
+        exit(-1);
+    }
+
+    int index = 0;
+    while (index < num_cids && sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) != SQLITE_INTEGER) {
+            break;
+        }
+        sizes[index++] = sqlite3_column_int64(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    if (index < num_cids) {
+        free(sizes);
+        return NULL;
+    }
+    return sizes;
+}
+
+// download_init() before catalog_resolve(): four statements prepared per
+// track, and the CIDs stepped through twice
+static void resolve_per_row(sqlite3 *db, const int *ids, int num_ids) {
+    for (int i = 0; i < num_ids; ++i) {
+        int num_cids;
+        char *track_name = database_get_track_name(db, ids[i]);
+        char *album_path = database_get_album(db, ids[i]);
+        char **cids = database_get_cids(db, ids[i], &num_cids);
+        int64_t *sizes = get_cid_sizes(db, ids[i], num_cids);
+        for (int j = 0; j < num_cids; ++j) {
+            free(cids[j]);
+        }
+        free(cids);
+        free(sizes);
+        free(track_name);
+        free(album_path);
+    }
+}
+
+static double per_batch_ms(apr_time_t elapsed, int rounds) {
+    return (double)elapsed / 1000.0 / rounds;
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <db> [tracks] [batch] [rounds]\n",
+                argv[0]);
+        return -1;
+    }
+    int num_tracks = argc > 2 ? atoi(argv[2]) : DEFAULT_TRACKS;
+    int batch_size = argc > 3 ? atoi(argv[3]) : DEFAULT_BATCH;
+    int rounds = argc > 4 ? atoi(argv[4]) : DEFAULT_ROUNDS;
+
+    apr_pool_t *pool;
+    if (apr_initialize() != APR_SUCCESS) {
+        return -1;
+    }
+    apr_pool_create(&pool, NULL);
+    log_set_quiet(true);
+
+    if (access(argv[1], F_OK) != 0) {
+        generate(argv[1], num_tracks);
+    }
+
+    sqlite3 *db;
+    database_open_readonly(argv[1], &db);
+    catalog_t *catalog = catalog_open(pool, argv[1], NULL);
+    num_tracks = catalog_count_tracks(catalog);
+
+    char *snapshot_path = apr_pstrcat(pool, argv[1], ".snap", NULL);
+    apr_time_t start = apr_time_now();
+    catalog_t *mapped = catalog_open(pool, argv[1], snapshot_path);
+    apr_time_t load = apr_time_now() - start;
+
+    int *ids = malloc(batch_size * sizeof(int));
+    if (!ids) {
+        fprintf(stderr, "catalog_bench: Memory allocation failed\n");
+        return -1;
+    }
+
+    // Both paths see the same batches, and the first round of each warms
+    // the page cache for the other
+    apr_time_t per_row = 0;
+    apr_time_t batched = 0;
+    apr_time_t snapshot = 0;
+    long resolved_cids = 0;
+    srand(2);
+    for (int round = 0; round < rounds; ++round) {
+        for (int i = 0; i < batch_size; ++i) {
+            ids[i] = rand() % num_tracks + 1;
+        }
+
+        start = apr_time_now();
+        resolve_per_row(db, ids, batch_size);
+        per_row += apr_time_now() - start;
+
+        apr_pool_t *subpool;
+        apr_pool_create(&subpool, pool);
+        start = apr_time_now();
+        catalog_batch_t *batch =
+            catalog_resolve(catalog, subpool, ids, batch_size);
+        batched += apr_time_now() - start;
+        resolved_cids += batch->num_cids;
+
+        start = apr_time_now();
+        catalog_resolve(mapped, subpool, ids, batch_size);
+        snapshot += apr_time_now() - start;
+        apr_pool_destroy(subpool);
+    }
+
+    fprintf(stdout, "Catalog: %d tracks, %d rounds of %d tracks, %.2f CIDs "
+                    "per track\n",
+            num_tracks, rounds, batch_size,
+            (double)resolved_cids / ((double)rounds * batch_size));
+    fprintf(stdout, "Per-row: %.3f ms per batch\n",
+            per_batch_ms(per_row, rounds));
+    fprintf(stdout, "Batched: %.3f ms per batch\n",
+            per_batch_ms(batched, rounds));
+    fprintf(stdout, "Snapshot: %.3f ms per batch, %.1f ms to open\n",
+            per_batch_ms(snapshot, rounds), (double)load / 1000.0);
+    fprintf(stdout, "Speedup: %.1fx batched, %.1fx snapshot\n",
+            batched > 0 ? (double)per_row / batched : 0.0,
+            snapshot > 0 ? (double)per_row / snapshot : 0.0);
+
+    free(ids);
+    catalog_close(catalog);
+    catalog_close(mapped);
+    database_close(db);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
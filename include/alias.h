@@ -0,0 +1,17 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include <apr_pools.h>
+#include <stdint.h>
+
+typedef struct alias alias_t;
+
+alias_t *alias_create(int num_items);
+apr_status_t alias_destroy(void *data);
+void alias_set(alias_t *alias, int item, double weight);
+double alias_get(alias_t *alias, int item);
+int alias_build(alias_t *alias);
+double alias_total(alias_t *alias);
+int alias_sample(alias_t *alias, uint64_t r0, uint64_t r1);
+
+#endif // ALIAS_H
@@ -0,0 +1,14 @@
+#ifndef ASSEMBLE_H
+#define ASSEMBLE_H
+
+#include "download.h"
+#include <apr_pools.h>
+
+typedef struct assembler assembler_t;
+
+assembler_t *assemble_create(apr_pool_t *pool, int num_threads);
+int assemble_submit(assembler_t *assembler, file_info_t *info);
+void assemble_wait(assembler_t *assembler);
+apr_status_t assemble_destroy(void *data);
+
+#endif // ASSEMBLE_H
@@ -0,0 +1,20 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "config.h"
+#include <apr_pools.h>
+#include <stdint.h>
+
+typedef struct cache cache_t;
+
+cache_t *cache_create(apr_pool_t *pool);
+apr_status_t cache_destroy(void *data);
+void cache_sync(cache_t *cache, config_t *config);
+int64_t cache_lookup(cache_t *cache, const char *cid, const char *dest_path);
+void cache_insert(cache_t *cache, const char *cid, const char *src_path);
+void cache_insert_range(cache_t *cache, const char *cid, int fd, int64_t offset,
+                        int64_t size);
+void cache_save(cache_t *cache);
+void cache_log_stats(cache_t *cache);
+
+#endif // CACHE_H
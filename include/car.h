@@ -0,0 +1,29 @@
+#ifndef CAR_H
+#define CAR_H
+
+#include "cid.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Called for every block in the CAR. Returning non-zero stops the reader.
+typedef int (*car_block_fn)(const cid_t *cid, const uint8_t *data, size_t len,
+                            void *userdata);
+
+typedef struct {
+    uint8_t *buffer;
+    size_t start;
+    size_t len;
+    size_t cap;
+    int header_done;
+    int failed;
+    car_block_fn on_block;
+    void *userdata;
+} car_reader_t;
+
+void car_reader_init(car_reader_t *reader, car_block_fn on_block,
+                     void *userdata);
+int car_reader_feed(car_reader_t *reader, const void *data, size_t len);
+int car_reader_finish(car_reader_t *reader);
+void car_reader_free(car_reader_t *reader);
+
+#endif // CAR_H
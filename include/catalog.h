@@ -0,0 +1,46 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <apr_pools.h>
+#include <stdint.h>
+
+typedef struct catalog catalog_t;
+
+typedef void (*catalog_weight_fn)(int track_id, int album_tracks,
+                                  double rating, double boost, void *data);
+
+// A resolved track. Everything points into the batch, which lives in the
+// pool it was resolved into, or into the catalog snapshot, which stays
+// mapped as long as that pool.
+typedef struct {
+    int track_id;
+    char *track_name;
+    char *album_path;
+    char **cids;
+    // NULL unless the catalog has a size for every CID of the track
+    int64_t *sizes;
+    int num_cids;
+} catalog_track_t;
+
+typedef struct {
+    catalog_track_t *tracks;
+    int num_tracks;
+    // Backing arrays for the CIDs and sizes of all tracks. Tracks resolved
+    // from a snapshot point their sizes into the snapshot instead.
+    char **cids;
+    int64_t *sizes;
+    int num_cids;
+} catalog_batch_t;
+
+catalog_t *catalog_open(apr_pool_t *pool, const char *filename,
+                        const char *snapshot_path);
+apr_status_t catalog_close(void *data);
+void catalog_refresh(catalog_t *catalog);
+long catalog_generation(catalog_t *catalog);
+int catalog_count_tracks(catalog_t *catalog);
+catalog_batch_t *catalog_resolve(catalog_t *catalog, apr_pool_t *pool,
+                                 const int *track_ids, int num_tracks);
+void catalog_scan_weights(catalog_t *catalog, catalog_weight_fn fn,
+                          void *data);
+
+#endif // CATALOG_H
@@ -0,0 +1,43 @@
+#ifndef CID_H
+#define CID_H
+
+#include "sha256.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define CID_MAX_DIGEST 64
+#define CID_MAX_BYTES 128
+#define CID_MAX_TEXT 256
+
+#define CID_CODEC_RAW 0x55
+#define CID_CODEC_DAG_PB 0x70
+
+// Binary CID. CIDv0 is stored as its bare sha2-256 multihash.
+typedef struct {
+    uint8_t bytes[CID_MAX_BYTES];
+    size_t len;
+} cid_t;
+
+int cid_decode(const char *text, cid_t *cid);
+int cid_encode(const cid_t *cid, char *text, size_t size);
+int cid_read(const uint8_t *bytes, size_t len, cid_t *cid);
+uint64_t cid_codec(const cid_t *cid);
+int cid_verify_block(const cid_t *cid, const void *data, size_t len);
+
+// Incremental check of a body against the multihash inside its CID
+typedef struct {
+    uint64_t hash;
+    uint8_t digest[CID_MAX_DIGEST];
+    size_t digest_len;
+    sha256_ctx_t sha256;
+    size_t identity_pos;
+    int mismatch;
+} cid_verifier_t;
+
+int cid_verifier_init(cid_verifier_t *verifier, const char *cid);
+void cid_verifier_reset(cid_verifier_t *verifier);
+void cid_verifier_update(cid_verifier_t *verifier, const void *data,
+                         size_t len);
+int cid_verifier_check(cid_verifier_t *verifier);
+
+#endif // CID_H
@@ -16,6 +16,37 @@ typedef struct {
     char *pipe_name;
     char *log;
     char *ffmpeg_log;
+    int max_connections;
+    int stream;
+    int stream_buffer;
+    char *gateway_state;
+    char *probe_cid;
+    int hedge_budget;
+    int hedge_min_speed;
+    int stall_speed;
+    char *cache_dir;
+    int cache_mb;
+    char *cache_policy;
+    int assemble_threads;
+    int max_bandwidth;
+    int gateway_max_connections;
+    int gateway_max_rps;
+    int prefetch;
+    int min_concurrency;
+    int max_concurrency;
+    int trustless;
+    char *local_gateway;
+    char *local_rpc;
+    int local_pins;
+    int split_min_size;
+    int gateway_affinity;
+    char *catalog_snapshot;
+    char *shuffle_state;
+    char *selection;
+    char *picker_state;
+    int weight_album;
+    int weight_recent;
+    int weight_recent_percent;
 } config_t;
 
 void config_read(const char *config_file, config_t *config);
@@ -0,0 +1,18 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <apr_pools.h>
+#include <curl/curl.h>
+
+typedef struct conn conn_t;
+
+conn_t *conn_create(apr_pool_t *pool);
+CURL *conn_acquire(conn_t *conn);
+void conn_release(conn_t *conn, CURL *curl);
+CURLM *conn_acquire_multi(conn_t *conn);
+void conn_release_multi(conn_t *conn, CURLM *multi);
+void conn_record(conn_t *conn, CURL *curl);
+void conn_log_stats(conn_t *conn);
+apr_status_t conn_destroy(void *data);
+
+#endif // CONN_H
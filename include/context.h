@@ -0,0 +1,27 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "cache.h"
+#include "catalog.h"
+#include "conn.h"
+#include "flight.h"
+#include "gateway.h"
+#include "picker.h"
+#include "pin.h"
+#include "sched.h"
+#include "shuffle.h"
+
+// State that outlives a single download cycle
+typedef struct {
+    conn_t *conn;
+    gateways_t *gateways;
+    cache_t *cache;
+    catalog_t *catalog;
+    pinner_t *pinner;
+    flight_t *flight;
+    sched_t *sched;
+    shuffle_t *shuffle;
+    picker_t *picker;
+} context_t;
+
+#endif // CONTEXT_H
@@ -0,0 +1,12 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <sys/types.h>
+
+enum copy_method { COPY_REFLINK, COPY_RANGE, COPY_BUFFERED, COPY_FAILED };
+
+const char *copy_method_name(enum copy_method method);
+enum copy_method copy_fd(int in, off_t in_offset, int out, off_t out_offset,
+                         off_t size, enum copy_method method);
+
+#endif // COPY_H
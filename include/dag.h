@@ -0,0 +1,32 @@
+#ifndef DAG_H
+#define DAG_H
+
+#include "config.h"
+#include "context.h"
+#include "engine.h"
+#include <apr_pools.h>
+#include <stdint.h>
+
+typedef struct dag dag_t;
+typedef struct dag_fetch dag_fetch_t;
+
+// Called on the engine thread once every block has been written, or the
+// fetch has given up. A fetch that gives up is counted as one the caller
+// fetches whole instead.
+typedef void (*dag_done_fn)(dag_fetch_t *fetch, int succeeded, void *data);
+
+// The scheduler rank of a fetch, from the data it was started with
+typedef int64_t (*dag_rank_fn)(void *data);
+
+dag_t *dag_create(apr_pool_t *pool, engine_t *engine, context_t *context,
+                  config_t *config, dag_rank_fn rank);
+apr_status_t dag_destroy(void *data);
+dag_fetch_t *dag_fetch_start(dag_t *dag, const char *cid, int fd,
+                             int64_t offset, int64_t size, dag_done_fn done,
+                             void *data);
+int64_t dag_fetch_size(dag_fetch_t *fetch);
+int64_t dag_pump(dag_t *dag);
+int64_t dag_throttled(dag_t *dag);
+void dag_log(dag_t *dag);
+
+#endif // DAG_H
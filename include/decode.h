@@ -2,7 +2,9 @@
 #define DECODE_H
 
 #include "config.h"
+#include "stream.h"
 
 void decode_audio(char *pipe_name, char *filename, char *file_path);
+void decode_audio_stream(char *pipe_name, char *filename, stream_t *stream);
 
 #endif // DECODE_H
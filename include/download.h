@@ -2,9 +2,13 @@
 #define DOWNLOAD_H
 
 #include "config.h"
-#include "database.h"
+#include "context.h"
+#include "catalog.h"
+#include "future.h"
+#include "stream.h"
 #include "util.h"
 #include <apr_pools.h>
+#include <apr_time.h>
 
 enum download_status { DOWNLOAD_PENDING, DOWNLOAD_SUCCEEDED, DOWNLOAD_FAILED };
 
@@ -14,11 +18,17 @@ typedef struct {
     char *track_name;
     char *extension;
     char **cids;
+    int64_t *sizes;
     int num_cids;
+    int num_pending;
+    int position;
     int track_id;
     config_t *config;
     enum download_status *cid_download_status;
     enum download_status file_download_status;
+    stream_t *stream;
+    int fd;
+    future_t *ready;
 } file_info_t;
 
 typedef struct {
@@ -26,20 +36,15 @@ typedef struct {
     int num_files;
 } file_infos_t;
 
-typedef struct {
-    char *filename;
-    char *extension;
-    char *album_path;
-    char *track_name;
-    int track_id;
-    enum download_status file_download_status;
-} file_downloaded_t;
+typedef struct download download_t;
 
 apr_status_t download_cleanup(void *data);
-void download_init(file_info_t *infos, config_t *config, sqlite3 *db);
-void download_files(apr_pool_t *pool, file_info_t *infos, config_t *config);
-void assemble_files(file_info_t *infos, config_t *config);
-file_downloaded_t *downloaded_files(apr_pool_t *pool, file_info_t *infos,
-                                    config_t *config);
+void download_init(apr_pool_t *pool, file_info_t *infos, config_t *config,
+                   context_t *context);
+download_t *download_start(apr_pool_t *pool, file_info_t *infos,
+                           config_t *config, context_t *context, int seq);
+void download_wait(download_t *download);
+void download_set_playing(download_t *download, int position);
+apr_time_t download_wait_track(file_info_t *info);
 
 #endif // DOWNLOAD_H
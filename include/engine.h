@@ -0,0 +1,35 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "conn.h"
+#include <apr_pools.h>
+#include <curl/curl.h>
+
+typedef struct engine engine_t;
+
+// Called on the engine thread once a transfer has left the multi handle.
+// The callback owns the easy handle again and may re-add it to retry.
+typedef void (*engine_done_fn)(engine_t *engine, CURL *curl, CURLcode result,
+                               void *data);
+
+// Called on the engine thread after another thread invoked engine_wakeup().
+typedef void (*engine_wakeup_fn)(engine_t *engine, void *data);
+
+// Called on the engine thread every interval while transfers are running.
+typedef void (*engine_tick_fn)(engine_t *engine, void *data);
+
+engine_t *engine_create(conn_t *conn, int max_connections);
+void engine_set_wakeup(engine_t *engine, engine_wakeup_fn on_wakeup,
+                       void *data);
+void engine_set_tick(engine_t *engine, long interval_ms, engine_tick_fn on_tick,
+                     void *data);
+void engine_wakeup(engine_t *engine);
+void engine_add(engine_t *engine, CURL *curl, engine_done_fn done, void *data);
+// Drops a running transfer without calling its done callback
+void engine_remove(engine_t *engine, CURL *curl);
+void engine_hold(engine_t *engine);
+void engine_unhold(engine_t *engine);
+void engine_run(engine_t *engine);
+apr_status_t engine_destroy(void *data);
+
+#endif // ENGINE_H
@@ -0,0 +1,26 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <apr_pools.h>
+
+typedef struct flight flight_t;
+typedef struct flight_waiter flight_waiter_t;
+
+// Called on the leader's thread once the CID has landed or failed, with
+// whatever the leader passed to flight_land()
+typedef void (*flight_land_fn)(flight_waiter_t *waiter, int succeeded,
+                               void *result);
+
+struct flight_waiter {
+    flight_land_fn land;
+    void *data;
+    flight_waiter_t *next;
+};
+
+flight_t *flight_create(apr_pool_t *pool);
+int flight_join(flight_t *flight, const char *cid, flight_waiter_t *waiter);
+void flight_land(flight_t *flight, const char *cid, int succeeded,
+                 void *result);
+void flight_log(flight_t *flight);
+
+#endif // FLIGHT_H
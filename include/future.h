@@ -0,0 +1,14 @@
+#ifndef FUTURE_H
+#define FUTURE_H
+
+#include <apr_pools.h>
+
+// One-shot completion flag that other threads can block on
+typedef struct future future_t;
+
+future_t *future_create(apr_pool_t *pool);
+void future_set(future_t *future);
+int future_is_set(future_t *future);
+void future_wait(future_t *future);
+
+#endif // FUTURE_H
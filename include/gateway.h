@@ -0,0 +1,25 @@
+#ifndef GATEWAY_H
+#define GATEWAY_H
+
+#include "config.h"
+#include <apr_pools.h>
+
+typedef struct gateways gateways_t;
+
+gateways_t *gateway_create(apr_pool_t *pool);
+void gateway_sync(gateways_t *gateways, config_t *config);
+int gateway_pick(gateways_t *gateways, int exclude,
+                 const unsigned char *blocked);
+int gateway_pick_for(gateways_t *gateways, const char *key, int exclude,
+                     const unsigned char *blocked);
+const char *gateway_host(gateways_t *gateways, int index);
+void gateway_record(gateways_t *gateways, int index, int succeeded,
+                    double ttfb, double throughput);
+int gateway_count_healthy(gateways_t *gateways, double max_error_rate);
+void gateway_record_rejection(gateways_t *gateways, int index);
+void gateway_record_cache(gateways_t *gateways, int index, int hit);
+double gateway_ttfb_percentile(gateways_t *gateways, double percentile);
+void gateway_save(gateways_t *gateways);
+void gateway_log(gateways_t *gateways);
+
+#endif // GATEWAY_H
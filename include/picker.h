@@ -0,0 +1,17 @@
+#ifndef PICKER_H
+#define PICKER_H
+
+#include "catalog.h"
+#include "config.h"
+#include <apr_pools.h>
+
+typedef struct picker picker_t;
+
+picker_t *picker_create(apr_pool_t *pool, catalog_t *catalog,
+                        const char *state_file);
+apr_status_t picker_destroy(void *data);
+void picker_draw(picker_t *picker, config_t *config, int *track_ids,
+                 int num_tracks);
+void picker_log(picker_t *picker);
+
+#endif // PICKER_H
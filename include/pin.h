@@ -0,0 +1,13 @@
+#ifndef PIN_H
+#define PIN_H
+
+#include <apr_pools.h>
+
+typedef struct pinner pinner_t;
+
+pinner_t *pin_create(apr_pool_t *pool, const char *rpc, int max_pins);
+apr_status_t pin_destroy(void *data);
+void pin_submit(pinner_t *pinner, const char *cid);
+void pin_log(pinner_t *pinner);
+
+#endif // PIN_H
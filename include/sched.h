@@ -0,0 +1,47 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "config.h"
+#include <apr_pools.h>
+#include <apr_time.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct sched sched_t;
+
+// The rank posted by a batch with nothing waiting
+#define SCHED_IDLE INT64_MAX
+
+sched_t *sched_create(apr_pool_t *pool);
+void sched_sync(sched_t *sched, config_t *config);
+apr_status_t sched_destroy(void *data);
+
+// Global bandwidth
+int sched_consume(sched_t *sched, int64_t rank, size_t bytes);
+int sched_bandwidth_available(sched_t *sched, int64_t rank);
+void sched_throttled(sched_t *sched, apr_time_t waited);
+
+// Per-gateway connection and request budgets
+void sched_blocked(sched_t *sched, unsigned char *blocked,
+                   int num_gateways);
+void sched_acquire(sched_t *sched, int gateway, apr_time_t waited);
+void sched_release(sched_t *sched, int gateway);
+
+// Adaptive concurrency
+int sched_admit(sched_t *sched, int64_t rank);
+void sched_congested(sched_t *sched, const char *reason);
+void sched_tick(sched_t *sched, apr_time_t now);
+int sched_window(sched_t *sched);
+
+// Priority across the batches in flight
+int sched_join(sched_t *sched);
+void sched_leave(sched_t *sched, int slot);
+void sched_wait_window(sched_t *sched, int slot, int64_t rank);
+void sched_wait_bandwidth(sched_t *sched, int slot, int64_t rank);
+int64_t sched_window_waiter(sched_t *sched);
+void sched_play(sched_t *sched, int batch);
+int sched_playing(sched_t *sched);
+
+void sched_log(sched_t *sched);
+
+#endif // SCHED_H
@@ -0,0 +1,13 @@
+#ifndef SHUFFLE_H
+#define SHUFFLE_H
+
+#include <apr_pools.h>
+
+typedef struct shuffle shuffle_t;
+
+shuffle_t *shuffle_create(apr_pool_t *pool, const char *state_file);
+void shuffle_draw(shuffle_t *shuffle, int min_value, int max_value,
+                  int *track_ids, int num_tracks);
+void shuffle_log(shuffle_t *shuffle);
+
+#endif // SHUFFLE_H
@@ -0,0 +1,18 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "catalog.h"
+#include <apr_pools.h>
+
+typedef struct snapshot snapshot_t;
+
+int snapshot_build(const char *db_filename, const char *filename);
+snapshot_t *snapshot_open(const char *filename, const char *db_filename);
+apr_status_t snapshot_close(void *data);
+int snapshot_is_current(snapshot_t *snapshot, const char *db_filename);
+int snapshot_count_tracks(snapshot_t *snapshot);
+int snapshot_count_cids(snapshot_t *snapshot, int track_id);
+void snapshot_lookup(snapshot_t *snapshot, int track_id,
+                     catalog_track_t *track, char **cids);
+
+#endif // SNAPSHOT_H
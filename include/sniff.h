@@ -0,0 +1,12 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <stddef.h>
+
+enum sniff_result { SNIFF_MATCH, SNIFF_MISMATCH, SNIFF_UNKNOWN };
+
+enum sniff_result sniff_html(const void *data, size_t len);
+enum sniff_result sniff_magic(const char *extension, const void *data,
+                              size_t len);
+
+#endif // SNIFF_H
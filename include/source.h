@@ -0,0 +1,29 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <apr_pools.h>
+#include <curl/curl.h>
+#include <stddef.h>
+
+typedef struct source source_t;
+
+// A place CIDs can be downloaded from. A download tries its sources in
+// order, skipping those that do not accept the CID.
+source_t *source_local_create(apr_pool_t *pool, const char *host);
+source_t *source_subdomain_create(apr_pool_t *pool, const char *domain);
+source_t *source_gateway_create(apr_pool_t *pool);
+apr_status_t source_destroy(void *data);
+
+const char *source_name(source_t *source);
+// Whether the host comes from the gateway scoreboard
+int source_uses_gateways(source_t *source);
+// Whether a failure hands the CID on to the next source without using up
+// a retry
+int source_falls_through(source_t *source);
+int source_accepts(source_t *source, const char *cid);
+void source_url(source_t *source, const char *cid, const char *host,
+                char *url, size_t size);
+long source_timeout(source_t *source, long timeout);
+void source_prepare(source_t *source, CURL *curl);
+
+#endif // SOURCE_H
@@ -0,0 +1,30 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <apr_pools.h>
+#include <apr_time.h>
+#include <stdint.h>
+
+typedef struct stream stream_t;
+typedef void (*stream_notify_fn)(void *data);
+
+stream_t *stream_create(apr_pool_t *pool, const char *dir, char **cids,
+                        int num_cids, int64_t max_ahead);
+void stream_set_notify(stream_t *stream, stream_notify_fn notify, void *data);
+
+// Download side
+void stream_write(stream_t *stream, int chunk, size_t size);
+void stream_reset(stream_t *stream, int chunk);
+void stream_replace(stream_t *stream, int chunk, int64_t size);
+void stream_finish(stream_t *stream, int chunk, int succeeded);
+int stream_should_pause(stream_t *stream, int chunk);
+
+// Playback side
+void stream_attach(stream_t *stream);
+void stream_detach(stream_t *stream);
+int stream_read(stream_t *stream, uint8_t *buf, int size);
+int64_t stream_seek(stream_t *stream, int64_t offset, int whence);
+int64_t stream_size(stream_t *stream);
+long stream_stalls(stream_t *stream, apr_time_t *stalled);
+
+#endif // STREAM_H
@@ -0,0 +1,23 @@
+#ifndef UNIXFS_H
+#define UNIXFS_H
+
+#include "cid.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A dag-pb node holding (part of) a UnixFS file. `data` points into the
+// decoded block, so the block has to outlive the node.
+typedef struct {
+    cid_t *links;
+    int num_links;
+    uint64_t *blocksizes;
+    int num_blocksizes;
+    const uint8_t *data;
+    size_t data_len;
+    uint64_t filesize;
+} unixfs_node_t;
+
+int unixfs_decode(const uint8_t *block, size_t len, unixfs_node_t *node);
+void unixfs_free(unixfs_node_t *node);
+
+#endif // UNIXFS_H
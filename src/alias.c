@@ -0,0 +1,213 @@
+#include "alias.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Weighted sampling with Vose's alias method. A single alias table has to
+// be rebuilt whole whenever a weight changes, so items are split into
+// blocks of ALIAS_BLOCK_SIZE with a table each, and a top-level table picks
+// the block by its total weight. A draw is two table lookups, and a
+// changed weight costs a rebuild of its own block plus the small top-level
+// table.
+
+#define ALIAS_BLOCK_BITS 12
+#define ALIAS_BLOCK_SIZE (1 << ALIAS_BLOCK_BITS)
+
+struct alias {
+    int num_items;
+    int num_blocks;
+    double *weights;
+    // Per item, relative to the start of its block
+    float *probs;
+    uint16_t *aliases;
+    // Per block
+    double *block_weights;
+    unsigned char *dirty;
+    float *top_probs;
+    uint32_t *top_aliases;
+    double total;
+    // Scratch for a build, sized for the larger of a block and the top
+    double *scaled;
+    uint32_t *small;
+    uint32_t *large;
+    uint32_t *built;
+};
+
+static void *alloc(size_t count, size_t size) {
+    void *data = calloc(count ? count : 1, size);
+    if (!data) {
+        log_trace("alias: Memory allocation failed");
+        exit(-1);
+    }
+    return data;
+}
+
+// Items start out with weight 0, and nothing is drawn until alias_build()
+alias_t *alias_create(int num_items) {
+    alias_t *alias = alloc(1, sizeof(alias_t));
+    alias->num_items = num_items;
+    alias->num_blocks = (num_items + ALIAS_BLOCK_SIZE - 1) / ALIAS_BLOCK_SIZE;
+    alias->weights = alloc(num_items, sizeof(double));
+    alias->probs = alloc(num_items, sizeof(float));
+    alias->aliases = alloc(num_items, sizeof(uint16_t));
+    alias->block_weights = alloc(alias->num_blocks, sizeof(double));
+    alias->dirty = alloc(alias->num_blocks, 1);
+    alias->top_probs = alloc(alias->num_blocks, sizeof(float));
+    alias->top_aliases = alloc(alias->num_blocks, sizeof(uint32_t));
+
+    int scratch = alias->num_blocks > ALIAS_BLOCK_SIZE ? alias->num_blocks
+                                                       : ALIAS_BLOCK_SIZE;
+    alias->scaled = alloc(scratch, sizeof(double));
+    alias->small = alloc(scratch, sizeof(uint32_t));
+    alias->large = alloc(scratch, sizeof(uint32_t));
+    alias->built = alloc(scratch, sizeof(uint32_t));
+    memset(alias->dirty, 1, alias->num_blocks);
+    return alias;
+}
+
+apr_status_t alias_destroy(void *data) {
+    alias_t *alias = (alias_t *)data;
+    free(alias->weights);
+    free(alias->probs);
+    free(alias->aliases);
+    free(alias->block_weights);
+    free(alias->dirty);
+    free(alias->top_probs);
+    free(alias->top_aliases);
+    free(alias->scaled);
+    free(alias->small);
+    free(alias->large);
+    free(alias->built);
+    free(alias);
+    return APR_SUCCESS;
+}
+
+// Negative weights count as 0
+void alias_set(alias_t *alias, int item, double weight) {
+    if (weight < 0) {
+        weight = 0;
+    }
+    if (alias->weights[item] != weight) {
+        alias->weights[item] = weight;
+        alias->dirty[item >> ALIAS_BLOCK_BITS] = 1;
+    }
+}
+
+double alias_get(alias_t *alias, int item) {
+    return alias->weights[item];
+}
+
+static void leftover(alias_t *alias, uint32_t i, const double *weights,
+                     int positive, float *probs) {
+    if (weights[i] <= 0 && positive >= 0) {
+        probs[i] = 0.0f;
+        alias->built[i] = positive;
+    } else {
+        probs[i] = 1.0f;
+        alias->built[i] = i;
+    }
+}
+
+// Vose's method over `count` weights. Leaves each column's probability of
+// keeping its own index in `probs` and the index it gives way to in
+// alias->built. A table with no weight at all is uniform.
+static double build_table(alias_t *alias, const double *weights, int count,
+                          float *probs) {
+    double sum = 0;
+    int positive = -1;
+    for (int i = 0; i < count; ++i) {
+        sum += weights[i];
+        if (weights[i] > 0) {
+            positive = i;
+        }
+    }
+
+    int num_small = 0;
+    int num_large = 0;
+    for (int i = 0; i < count; ++i) {
+        alias->scaled[i] = sum > 0 ? weights[i] * count / sum : 1.0;
+        if (alias->scaled[i] < 1.0) {
+            alias->small[num_small++] = i;
+        } else {
+            alias->large[num_large++] = i;
+        }
+    }
+    while (num_small > 0 && num_large > 0) {
+        uint32_t less = alias->small[--num_small];
+        uint32_t more = alias->large[num_large - 1];
+        probs[less] = (float)alias->scaled[less];
+        alias->built[less] = more;
+        alias->scaled[more] += alias->scaled[less] - 1.0;
+        if (alias->scaled[more] < 1.0) {
+            num_large--;
+            alias->small[num_small++] = more;
+        }
+    }
+    // Whatever is left is 1 up to rounding, except that an item with no
+    // weight must never be drawn, so its column goes to one that has some
+    while (num_large > 0) {
+        leftover(alias, alias->large[--num_large], weights, positive, probs);
+    }
+    while (num_small > 0) {
+        leftover(alias, alias->small[--num_small], weights, positive, probs);
+    }
+    return sum;
+}
+
+// Rebuilds the blocks whose weights changed since the last build, and
+// returns how many
+int alias_build(alias_t *alias) {
+    int rebuilt = 0;
+    for (int block = 0; block < alias->num_blocks; ++block) {
+        if (!alias->dirty[block]) {
+            continue;
+        }
+        int first = block << ALIAS_BLOCK_BITS;
+        int count = alias->num_items - first < ALIAS_BLOCK_SIZE
+                        ? alias->num_items - first
+                        : ALIAS_BLOCK_SIZE;
+        alias->block_weights[block] = build_table(
+            alias, alias->weights + first, count, alias->probs + first);
+        for (int i = 0; i < count; ++i) {
+            alias->aliases[first + i] = (uint16_t)alias->built[i];
+        }
+        alias->dirty[block] = 0;
+        rebuilt++;
+    }
+    if (rebuilt > 0) {
+        alias->total = build_table(alias, alias->block_weights,
+                                   alias->num_blocks, alias->top_probs);
+        memcpy(alias->top_aliases, alias->built,
+               alias->num_blocks * sizeof(uint32_t));
+    }
+    return rebuilt;
+}
+
+double alias_total(alias_t *alias) {
+    return alias->total;
+}
+
+// Column from the high half of a random word, coin from the low half. The
+// top-level table has wide aliases, blocks narrow ones.
+static uint32_t pick_column(uint64_t r, uint32_t count, const float *probs,
+                            const uint32_t *wide, const uint16_t *narrow) {
+    uint32_t column = (uint32_t)(((r >> 32) * count) >> 32);
+    float coin = (float)((uint32_t)r * 0x1.0p-32);
+    if (coin < probs[column]) {
+        return column;
+    }
+    return wide ? wide[column] : narrow[column];
+}
+
+// Draws an item in proportion to its weight from two random words. Needs
+// alias_build() after the last alias_set().
+int alias_sample(alias_t *alias, uint64_t r0, uint64_t r1) {
+    uint32_t block = pick_column(r0, alias->num_blocks, alias->top_probs,
+                                 alias->top_aliases, NULL);
+    int first = block << ALIAS_BLOCK_BITS;
+    uint32_t count = alias->num_items - first < ALIAS_BLOCK_SIZE
+                         ? alias->num_items - first
+                         : ALIAS_BLOCK_SIZE;
+    return first + pick_column(r1, count, alias->probs + first, NULL,
+                               alias->aliases + first);
+}
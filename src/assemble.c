@@ -0,0 +1,234 @@
+#include "assemble.h"
+#include "const.h"
+#include "copy.h"
+#include "log.h"
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_pool.h>
+#include <apr_time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tracks are assembled on a small thread pool as soon as all of their CIDs
+// are on disk. Chunks are concatenated with copy_fd(), so they stay inside
+// the kernel wherever the filesystem allows it.
+
+struct assembler {
+    apr_thread_pool_t *thread_pool;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int pending;
+};
+
+typedef struct {
+    assembler_t *assembler;
+    file_info_t *info;
+} assemble_task_t;
+
+assembler_t *assemble_create(apr_pool_t *pool, int num_threads) {
+    assembler_t *assembler = apr_pcalloc(pool, sizeof(assembler_t));
+    apr_thread_mutex_create(&assembler->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    apr_thread_cond_create(&assembler->cond, pool);
+
+    if (apr_thread_pool_create(&assembler->thread_pool, 0, num_threads,
+                               pool) != APR_SUCCESS) {
+        log_trace("assemble_create: Failed to create thread pool");
+        exit(-1);
+    }
+    return assembler;
+}
+
+apr_status_t assemble_destroy(void *data) {
+    assembler_t *assembler = (assembler_t *)data;
+    apr_thread_pool_destroy(assembler->thread_pool);
+    return APR_SUCCESS;
+}
+
+static int is_download_successful(file_info_t *info) {
+    for (int j = 0; j < info->num_cids; ++j) {
+        if (info->cid_download_status[j] != DOWNLOAD_SUCCEEDED) {
+            info->file_download_status = DOWNLOAD_FAILED;
+            return 0;
+        }
+    }
+    info->file_download_status = DOWNLOAD_SUCCEEDED;
+    return 1;
+}
+
+// Runs on the assembler threads while a track plays, so it only traces
+static void log_assembly(file_info_t *info, double elapsed_time,
+                         const char *method) {
+    log_trace("assemble: finish assembling %s", info->filename);
+    log_trace("assemble: track: %d / %d", info->track_id,
+              info->config->num_tracks);
+    log_trace("assemble: path: %s", info->album_path);
+    log_trace("assemble: filename: %s", info->track_name);
+    if (info->num_cids == 1) {
+        log_trace("assemble: info: %s -> %s", info->cids[0], info->filename);
+    } else {
+        log_trace("assemble: info: %d CIDs -> %s", info->num_cids,
+                  info->filename);
+    }
+    log_trace("assemble: took %.3f seconds (%s)", elapsed_time, method);
+}
+
+static enum copy_method append_cid_output(char *filename, char *cid, int out,
+                                          off_t *offset,
+                                          enum copy_method method,
+                                          config_t *config) {
+    char *cid_path = util_get_file_path(config->output, cid);
+
+    int in = open(cid_path, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        log_trace("assemble: Failed to open file %s", cid_path);
+        exit(-1);
+    }
+
+    method = copy_fd(in, 0, out, *offset, st.st_size, method);
+    if (method == COPY_FAILED) {
+        log_trace("assemble: Failed to copy %s", cid_path);
+        exit(-1);
+    }
+    *offset += st.st_size;
+
+    close(in);
+    log_trace("assemble: %s -> %s", cid, filename);
+
+    free(cid_path);
+    return method;
+}
+
+// CID files are left for the batch area cleanup rather than consumed here,
+// because another track of the same batch may share them
+static void link_single_file(file_info_t *info, char *file_path,
+                             config_t *config) {
+    char *cid_path = util_get_file_path(config->output, info->cids[0]);
+
+    if (link(cid_path, file_path) != 0) {
+        log_trace("assemble: Failed to move file %s to %s", info->cids[0],
+                  info->filename);
+        exit(-1);
+    }
+
+    log_trace("assemble: %s -> %s", info->cids[0], info->filename);
+    free(cid_path);
+    free(file_path);
+}
+
+static enum copy_method assemble_multiple_cids(file_info_t *info,
+                                               char *file_path,
+                                               config_t *config) {
+    int out = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        log_trace("assemble: Failed to open file %s", file_path);
+        exit(-1);
+    }
+
+    off_t offset = 0;
+    enum copy_method method = COPY_REFLINK;
+    for (int j = 0; j < info->num_cids; j++) {
+        method = append_cid_output(info->filename, info->cids[j], out, &offset,
+                                   method, config);
+    }
+
+    close(out);
+    free(file_path);
+    return method;
+}
+
+static void *APR_THREAD_FUNC assemble_track(apr_thread_t *thd, void *data) {
+    assemble_task_t *task = (assemble_task_t *)data;
+    assembler_t *assembler = task->assembler;
+    file_info_t *info = task->info;
+    config_t *config = info->config;
+    const char *method = "link";
+
+    log_trace("assemble: start assembling %s", info->filename);
+    apr_time_t start = apr_time_now();
+    char *file_path = util_get_file_path(config->output, info->filename);
+    if (info->num_cids == 1) {
+        link_single_file(info, file_path, config);
+    } else {
+        method = copy_method_name(
+            assemble_multiple_cids(info, file_path, config));
+    }
+    double elapsed_time = (double)(apr_time_now() - start) / APR_USEC_PER_SEC;
+
+    apr_thread_mutex_lock(assembler->mutex);
+    log_assembly(info, elapsed_time, method);
+    assembler->pending--;
+    apr_thread_cond_broadcast(assembler->cond);
+    apr_thread_mutex_unlock(assembler->mutex);
+    future_set(info->ready);
+
+    free(task);
+    return NULL;
+}
+
+// Chunks of a direct track were written in place, so only the file itself
+// needs closing, or removing when a chunk failed
+static int finish_direct(assembler_t *assembler, file_info_t *info) {
+    close(info->fd);
+    info->fd = -1;
+
+    char *file_path = util_get_file_path(info->config->output, info->filename);
+    int succeeded = is_download_successful(info);
+    if (!succeeded && remove(file_path) != 0) {
+        log_trace("assemble: Failed to delete file %s", file_path);
+    }
+    free(file_path);
+
+    if (succeeded) {
+        apr_thread_mutex_lock(assembler->mutex);
+        log_assembly(info, 0, "direct");
+        apr_thread_mutex_unlock(assembler->mutex);
+    }
+    future_set(info->ready);
+    return succeeded;
+}
+
+int assemble_submit(assembler_t *assembler, file_info_t *info) {
+    if (info->fd >= 0) {
+        return finish_direct(assembler, info);
+    }
+    if (!is_download_successful(info)) {
+        future_set(info->ready);
+        return 0;
+    }
+
+    assemble_task_t *task = (assemble_task_t *)malloc(sizeof(assemble_task_t));
+    if (!task) {
+        log_trace("assemble: Memory allocation failed");
+        exit(-1);
+    }
+    task->assembler = assembler;
+    task->info = info;
+
+    apr_thread_mutex_lock(assembler->mutex);
+    assembler->pending++;
+    apr_thread_mutex_unlock(assembler->mutex);
+
+    // Earlier tracks in play order jump ahead of later ones in the queue
+    int priority = APR_THREAD_TASK_PRIORITY_HIGHEST - info->position;
+    if (priority < APR_THREAD_TASK_PRIORITY_LOWEST) {
+        priority = APR_THREAD_TASK_PRIORITY_LOWEST;
+    }
+    if (apr_thread_pool_push(assembler->thread_pool, assemble_track, task,
+                             priority, NULL) != APR_SUCCESS) {
+        log_trace("assemble: Failed to push task for %s", info->filename);
+        exit(-1);
+    }
+    return 1;
+}
+
+void assemble_wait(assembler_t *assembler) {
+    apr_thread_mutex_lock(assembler->mutex);
+    while (assembler->pending > 0) {
+        apr_thread_cond_wait(assembler->cond, assembler->mutex);
+    }
+    apr_thread_mutex_unlock(assembler->mutex);
+}
@@ -0,0 +1,478 @@
+#include "cache.h"
+#include "copy.h"
+#include "log.h"
+#include <apr_file_io.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Content-addressed CID cache. Every downloaded CID is linked into the cache
+// directory under its own name, so later cycles can link it back into the
+// output directory instead of fetching it again. The index records size,
+// last use and hit count for eviction and is persisted between runs.
+//
+// Entries are also kept on a list, coldest first, so eviction takes the
+// head instead of scanning them all. Under LRU a used entry moves to the
+// tail. Under LFU the list is ordered by hits and then by last use, and
+// `buckets` maps a hit count to the last entry with that many, so a hit
+// moves its entry to the end of the next bucket without a scan either.
+
+#define INDEX_FILE "index.json"
+
+typedef struct cache_entry {
+    char *cid;
+    int64_t size;
+    apr_time_t last_used;
+    long hits;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+} cache_entry_t;
+
+struct cache {
+    apr_pool_t *pool;
+    apr_thread_mutex_t *mutex;
+    apr_hash_t *entries;
+    cache_entry_t *coldest;
+    cache_entry_t *hottest;
+    apr_hash_t *buckets;
+    char *dir;
+    char *index_file;
+    char *tmp_file;
+    int64_t budget;
+    int64_t used;
+    int lfu;
+    long hits;
+    long misses;
+    long evictions;
+};
+
+cache_t *cache_create(apr_pool_t *pool) {
+    cache_t *cache = apr_pcalloc(pool, sizeof(cache_t));
+    cache->pool = pool;
+    cache->entries = apr_hash_make(pool);
+    cache->buckets = apr_hash_make(pool);
+    apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    return cache;
+}
+
+static void free_entry(cache_entry_t *entry) {
+    free(entry->cid);
+    free(entry);
+}
+
+apr_status_t cache_destroy(void *data) {
+    cache_t *cache = (cache_t *)data;
+    for (apr_hash_index_t *hi = apr_hash_first(NULL, cache->entries); hi;
+         hi = apr_hash_next(hi)) {
+        free_entry((cache_entry_t *)apr_hash_this_val(hi));
+    }
+    apr_hash_clear(cache->entries);
+    return APR_SUCCESS;
+}
+
+static char *cache_path(cache_t *cache, apr_pool_t *pool, const char *cid) {
+    return apr_pstrcat(pool, cache->dir, "/", cid, NULL);
+}
+
+static cache_entry_t *bucket_tail(cache_t *cache, long hits) {
+    return (cache_entry_t *)apr_hash_get(cache->buckets, &hits, sizeof(long));
+}
+
+// The hash keeps the key pointer of an existing item, so a new tail is
+// keyed by its own hit count rather than its predecessor's
+static void set_bucket_tail(cache_t *cache, long hits, cache_entry_t *tail) {
+    apr_hash_set(cache->buckets, &hits, sizeof(long), NULL);
+    if (tail) {
+        apr_hash_set(cache->buckets, &tail->hits, sizeof(long), tail);
+    }
+}
+
+static void unlink_entry(cache_t *cache, cache_entry_t *entry) {
+    if (cache->lfu && bucket_tail(cache, entry->hits) == entry) {
+        set_bucket_tail(cache, entry->hits,
+                        entry->prev && entry->prev->hits == entry->hits
+                            ? entry->prev
+                            : NULL);
+    }
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->coldest = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->hottest = entry->prev;
+    }
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+// Links `entry` in after `after`, or at the head when that is NULL. Under
+// LFU, `after` has to be the last entry that stays colder than it.
+static void link_entry(cache_t *cache, cache_entry_t *after,
+                       cache_entry_t *entry) {
+    entry->prev = after;
+    entry->next = after ? after->next : cache->coldest;
+    if (entry->next) {
+        entry->next->prev = entry;
+    } else {
+        cache->hottest = entry;
+    }
+    if (after) {
+        after->next = entry;
+    } else {
+        cache->coldest = entry;
+    }
+    if (cache->lfu) {
+        set_bucket_tail(cache, entry->hits, entry);
+    }
+}
+
+static int compare_lru(const void *a, const void *b) {
+    const cache_entry_t *x = *(cache_entry_t *const *)a;
+    const cache_entry_t *y = *(cache_entry_t *const *)b;
+    return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+static int compare_lfu(const void *a, const void *b) {
+    const cache_entry_t *x = *(cache_entry_t *const *)a;
+    const cache_entry_t *y = *(cache_entry_t *const *)b;
+    if (x->hits != y->hits) {
+        return (x->hits > y->hits) - (x->hits < y->hits);
+    }
+    return compare_lru(a, b);
+}
+
+// Sorts the whole list for the current policy, after loading the index
+// or a change of policy
+static void reorder(cache_t *cache) {
+    int count = apr_hash_count(cache->entries);
+    cache_entry_t **sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    if (!sorted) {
+        log_trace("cache: Memory allocation failed");
+        exit(-1);
+    }
+    int i = 0;
+    for (apr_hash_index_t *hi = apr_hash_first(NULL, cache->entries); hi;
+         hi = apr_hash_next(hi)) {
+        sorted[i++] = (cache_entry_t *)apr_hash_this_val(hi);
+    }
+    qsort(sorted, count, sizeof(*sorted),
+          cache->lfu ? compare_lfu : compare_lru);
+
+    cache->coldest = NULL;
+    cache->hottest = NULL;
+    apr_hash_clear(cache->buckets);
+    for (i = 0; i < count; ++i) {
+        link_entry(cache, cache->hottest, sorted[i]);
+    }
+    free(sorted);
+}
+
+static cache_entry_t *add_entry(cache_t *cache, const char *cid, int64_t size,
+                                apr_time_t last_used, long hits) {
+    cache_entry_t *entry = (cache_entry_t *)malloc(sizeof(cache_entry_t));
+    if (!entry) {
+        log_trace("cache: Memory allocation failed");
+        exit(-1);
+    }
+    entry->cid = strdup(cid);
+    entry->size = size;
+    entry->last_used = last_used;
+    entry->hits = hits;
+    apr_hash_set(cache->entries, entry->cid, APR_HASH_KEY_STRING, entry);
+    // Entries loaded from the index are sorted once they all are; a new
+    // one has no hits and is the most recent
+    link_entry(cache,
+               cache->lfu ? bucket_tail(cache, hits) : cache->hottest, entry);
+    cache->used += size;
+    return entry;
+}
+
+static void remove_entry(cache_t *cache, cache_entry_t *entry) {
+    apr_pool_t *pool;
+    apr_pool_create(&pool, cache->pool);
+    if (unlink(cache_path(cache, pool, entry->cid)) != 0 && errno != ENOENT) {
+        log_trace("cache: Failed to remove %s", entry->cid);
+    }
+    apr_pool_destroy(pool);
+
+    apr_hash_set(cache->entries, entry->cid, APR_HASH_KEY_STRING, NULL);
+    unlink_entry(cache, entry);
+    cache->used -= entry->size;
+    free_entry(entry);
+}
+
+static void load_index(cache_t *cache) {
+    json_error_t error;
+    json_t *root = json_load_file(cache->index_file, 0, &error);
+    if (!root) {
+        log_trace("cache: No index loaded from %s", cache->index_file);
+        return;
+    }
+
+    apr_pool_t *pool;
+    apr_pool_create(&pool, cache->pool);
+    json_t *array = json_object_get(root, "entries");
+    for (size_t i = 0; json_is_array(array) && i < json_array_size(array);
+         ++i) {
+        json_t *obj = json_array_get(array, i);
+        json_t *cid = json_object_get(obj, "cid");
+        struct stat st;
+        // Entries whose file has gone missing are dropped from the index
+        if (!json_is_string(cid) ||
+            stat(cache_path(cache, pool, json_string_value(cid)), &st) != 0) {
+            continue;
+        }
+        add_entry(cache, json_string_value(cid), st.st_size,
+                  json_integer_value(json_object_get(obj, "last_used")),
+                  json_integer_value(json_object_get(obj, "hits")));
+    }
+    apr_pool_destroy(pool);
+    reorder(cache);
+
+    log_trace("cache: Loaded %u entries, %lld bytes from %s",
+              apr_hash_count(cache->entries), (long long)cache->used,
+              cache->index_file);
+    json_decref(root);
+}
+
+// Moves a hit to the end of the entries used as often as it is now
+static void use_entry(cache_t *cache, cache_entry_t *entry) {
+    cache_entry_t *after = entry->prev;
+    unlink_entry(cache, entry);
+    entry->last_used = apr_time_now();
+    entry->hits++;
+    if (!cache->lfu) {
+        after = cache->hottest;
+    } else if (bucket_tail(cache, entry->hits)) {
+        after = bucket_tail(cache, entry->hits);
+    } else if (bucket_tail(cache, entry->hits - 1)) {
+        after = bucket_tail(cache, entry->hits - 1);
+    }
+    link_entry(cache, after, entry);
+}
+
+static void evict(cache_t *cache, int64_t needed) {
+    while (cache->used + needed > cache->budget && cache->coldest) {
+        cache_entry_t *victim = cache->coldest;
+        log_trace("cache: evict %s (%lld bytes)", victim->cid,
+                  (long long)victim->size);
+        remove_entry(cache, victim);
+        cache->evictions++;
+    }
+}
+
+void cache_sync(cache_t *cache, config_t *config) {
+    apr_thread_mutex_lock(cache->mutex);
+
+    cache->budget = (int64_t)config->cache_mb * 1024 * 1024;
+    int lfu = strcmp(config->cache_policy, "lfu") == 0;
+    if (lfu != cache->lfu) {
+        cache->lfu = lfu;
+        reorder(cache);
+    }
+    if (!cache->dir && cache->budget > 0) {
+        cache->dir = apr_pstrdup(cache->pool, config->cache_dir);
+        cache->index_file =
+            apr_pstrcat(cache->pool, cache->dir, "/", INDEX_FILE, NULL);
+        cache->tmp_file =
+            apr_pstrcat(cache->pool, cache->index_file, ".tmp", NULL);
+        if (apr_dir_make_recursive(cache->dir, APR_OS_DEFAULT, cache->pool) !=
+            APR_SUCCESS) {
+            log_trace("cache_sync: Failed to create directory: %s",
+                      cache->dir);
+            exit(-1);
+        }
+        load_index(cache);
+    }
+    if (cache->dir) {
+        evict(cache, 0);
+    }
+
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+static int copy_file(const char *src_path, const char *dest_path) {
+    int in = open(src_path, O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) != 0) {
+        if (in >= 0) {
+            close(in);
+        }
+        return -1;
+    }
+    int out = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int rc = copy_fd(in, 0, out, 0, st.st_size, COPY_REFLINK) == COPY_FAILED
+                 ? -1
+                 : 0;
+    close(in);
+    if (close(out) != 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+// Hard link when both paths share a filesystem, otherwise reflink or copy
+static int link_file(const char *src_path, const char *dest_path) {
+    unlink(dest_path);
+    if (link(src_path, dest_path) == 0) {
+        return 0;
+    }
+    if (copy_file(src_path, dest_path) == 0) {
+        return 0;
+    }
+    unlink(dest_path);
+    return -1;
+}
+
+int64_t cache_lookup(cache_t *cache, const char *cid, const char *dest_path) {
+    apr_thread_mutex_lock(cache->mutex);
+    if (!cache->dir || cache->budget <= 0) {
+        apr_thread_mutex_unlock(cache->mutex);
+        return -1;
+    }
+
+    cache_entry_t *entry = (cache_entry_t *)apr_hash_get(
+        cache->entries, cid, APR_HASH_KEY_STRING);
+    if (!entry) {
+        cache->misses++;
+        apr_thread_mutex_unlock(cache->mutex);
+        return -1;
+    }
+
+    apr_pool_t *pool;
+    apr_pool_create(&pool, cache->pool);
+    int64_t size = entry->size;
+    if (link_file(cache_path(cache, pool, cid), dest_path) != 0) {
+        log_trace("cache_lookup: Failed to link %s, dropping it", cid);
+        remove_entry(cache, entry);
+        cache->misses++;
+        size = -1;
+    } else {
+        use_entry(cache, entry);
+        cache->hits++;
+    }
+    apr_pool_destroy(pool);
+
+    apr_thread_mutex_unlock(cache->mutex);
+    return size;
+}
+
+// Makes room for `size` bytes and returns the path the new entry should be
+// written to, or NULL when the entry cannot be cached
+static char *begin_insert(cache_t *cache, apr_pool_t *pool, const char *cid,
+                          int64_t size) {
+    if (!cache->dir || cache->budget <= 0 || size > cache->budget) {
+        return NULL;
+    }
+
+    cache_entry_t *entry = (cache_entry_t *)apr_hash_get(
+        cache->entries, cid, APR_HASH_KEY_STRING);
+    if (entry) {
+        remove_entry(cache, entry);
+    }
+    evict(cache, size);
+    return cache_path(cache, pool, cid);
+}
+
+void cache_insert(cache_t *cache, const char *cid, const char *src_path) {
+    struct stat st;
+    if (stat(src_path, &st) != 0) {
+        return;
+    }
+
+    apr_pool_t *pool;
+    apr_pool_create(&pool, cache->pool);
+    apr_thread_mutex_lock(cache->mutex);
+
+    char *path = begin_insert(cache, pool, cid, st.st_size);
+    if (path && link_file(src_path, path) == 0) {
+        add_entry(cache, cid, st.st_size, apr_time_now(), 0);
+    } else if (path) {
+        log_trace("cache_insert: Failed to add %s", cid);
+    }
+
+    apr_thread_mutex_unlock(cache->mutex);
+    apr_pool_destroy(pool);
+}
+
+// For CIDs that were written straight into a track file
+void cache_insert_range(cache_t *cache, const char *cid, int fd, int64_t offset,
+                        int64_t size) {
+    apr_pool_t *pool;
+    apr_pool_create(&pool, cache->pool);
+    apr_thread_mutex_lock(cache->mutex);
+
+    char *path = begin_insert(cache, pool, cid, size);
+    int out = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (out >= 0 && copy_fd(fd, offset, out, 0, size, COPY_REFLINK) !=
+                        COPY_FAILED) {
+        add_entry(cache, cid, size, apr_time_now(), 0);
+    } else if (path) {
+        log_trace("cache_insert_range: Failed to add %s", cid);
+        unlink(path);
+    }
+    if (out >= 0) {
+        close(out);
+    }
+
+    apr_thread_mutex_unlock(cache->mutex);
+    apr_pool_destroy(pool);
+}
+
+void cache_save(cache_t *cache) {
+    apr_thread_mutex_lock(cache->mutex);
+    if (!cache->dir) {
+        apr_thread_mutex_unlock(cache->mutex);
+        return;
+    }
+
+    json_t *array = json_array();
+    for (apr_hash_index_t *hi = apr_hash_first(NULL, cache->entries); hi;
+         hi = apr_hash_next(hi)) {
+        cache_entry_t *entry = (cache_entry_t *)apr_hash_this_val(hi);
+        json_t *obj = json_object();
+        json_object_set_new(obj, "cid", json_string(entry->cid));
+        json_object_set_new(obj, "size", json_integer(entry->size));
+        json_object_set_new(obj, "last_used", json_integer(entry->last_used));
+        json_object_set_new(obj, "hits", json_integer(entry->hits));
+        json_array_append_new(array, obj);
+    }
+    json_t *root = json_object();
+    json_object_set_new(root, "entries", array);
+
+    // Write then rename so a crash never leaves a truncated index
+    if (json_dump_file(root, cache->tmp_file, 0) != 0 ||
+        rename(cache->tmp_file, cache->index_file) != 0) {
+        log_trace("cache_save: Failed to write %s", cache->index_file);
+    }
+    json_decref(root);
+    apr_thread_mutex_unlock(cache->mutex);
+}
+
+void cache_log_stats(cache_t *cache) {
+    apr_thread_mutex_lock(cache->mutex);
+    log_trace("cache: %ld hits, %ld misses, %ld evictions, %u entries, "
+              "%.1f / %.1f MB",
+              cache->hits, cache->misses, cache->evictions,
+              apr_hash_count(cache->entries),
+              (double)cache->used / (1024 * 1024),
+              (double)cache->budget / (1024 * 1024));
+    apr_thread_mutex_unlock(cache->mutex);
+}
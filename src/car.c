@@ -0,0 +1,112 @@
+#include "car.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Streaming CARv1 reader. A CAR is a varint-prefixed dag-cbor header
+// followed by varint-prefixed sections of CID then block bytes. Sections
+// are handed out whole as soon as they have arrived; the header only
+// names the roots, which the caller already knows, so it is skipped.
+
+#define CAR_MAX_SECTION (4 * 1024 * 1024 + CID_MAX_BYTES)
+
+void car_reader_init(car_reader_t *reader, car_block_fn on_block,
+                     void *userdata) {
+    memset(reader, 0, sizeof(car_reader_t));
+    reader->on_block = on_block;
+    reader->userdata = userdata;
+}
+
+// Returns 1 once a whole varint is buffered, 0 while more bytes are needed
+static int peek_varint(car_reader_t *reader, uint64_t *value, size_t *size) {
+    const uint8_t *bytes = reader->buffer + reader->start;
+    *value = 0;
+    for (size_t i = 0; i < reader->len && i < 10; ++i) {
+        *value |= (uint64_t)(bytes[i] & 0x7f) << (7 * i);
+        if (!(bytes[i] & 0x80)) {
+            *size = i + 1;
+            return 1;
+        }
+    }
+    if (reader->len >= 10) {
+        reader->failed = 1;
+    }
+    return 0;
+}
+
+static void append(car_reader_t *reader, const void *data, size_t len) {
+    if (reader->start > 0 && reader->start + reader->len + len > reader->cap) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->len);
+        reader->start = 0;
+    }
+    if (reader->len + len > reader->cap) {
+        size_t cap = reader->cap ? reader->cap : 65536;
+        while (cap < reader->len + len) {
+            cap *= 2;
+        }
+        uint8_t *buffer = realloc(reader->buffer, cap);
+        if (!buffer) {
+            log_trace("car: Memory allocation failed");
+            exit(-1);
+        }
+        reader->buffer = buffer;
+        reader->cap = cap;
+    }
+    memcpy(reader->buffer + reader->start + reader->len, data, len);
+    reader->len += len;
+}
+
+static int read_section(car_reader_t *reader, const uint8_t *section,
+                        size_t len) {
+    if (!reader->header_done) {
+        reader->header_done = 1;
+        return 0;
+    }
+
+    cid_t cid;
+    int cid_len = cid_read(section, len, &cid);
+    if (cid_len < 0) {
+        return -1;
+    }
+    return reader->on_block(&cid, section + cid_len, len - cid_len,
+                            reader->userdata);
+}
+
+// Returns -1 on a malformed CAR or when the callback gave up
+int car_reader_feed(car_reader_t *reader, const void *data, size_t len) {
+    if (reader->failed) {
+        return -1;
+    }
+    append(reader, data, len);
+
+    uint64_t section_len;
+    size_t varint_len;
+    while (peek_varint(reader, &section_len, &varint_len)) {
+        if (section_len == 0 || section_len > CAR_MAX_SECTION) {
+            reader->failed = 1;
+            return -1;
+        }
+        if (reader->len < varint_len + section_len) {
+            return 0;
+        }
+
+        const uint8_t *section = reader->buffer + reader->start + varint_len;
+        reader->start += varint_len + section_len;
+        reader->len -= varint_len + section_len;
+        if (read_section(reader, section, section_len) != 0) {
+            reader->failed = 1;
+            return -1;
+        }
+    }
+    return reader->failed ? -1 : 0;
+}
+
+// A CAR that stops in the middle of a section was truncated
+int car_reader_finish(car_reader_t *reader) {
+    return reader->failed || reader->len > 0 || !reader->header_done ? -1 : 0;
+}
+
+void car_reader_free(car_reader_t *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
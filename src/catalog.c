@@ -0,0 +1,422 @@
+#include "catalog.h"
+#include "database.h"
+#include "log.h"
+#include "snapshot.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Resolves a whole batch of track IDs in one query. The IDs are bound as a
+// JSON array and expanded by json_each, so the statement is prepared once
+// for the life of the catalog no matter how many tracks a batch has. Rows
+// come back ordered by position in the batch, then by CID order within the
+// track, and are folded into tracks in a single pass.
+//
+// With a snapshot configured, tracks are looked up in the memory-mapped
+// snapshot instead and SQLite is only asked whether the catalog changed.
+// Once it did, a new snapshot is built on a thread of its own so playback
+// never waits for it, and tracks resolve with SQL until it is ready. Every
+// batch resolved from a snapshot holds a reference to it, and a replaced
+// snapshot is unmapped once the last of those batches is gone.
+
+#define RESOLVE_COLUMNS                                                        \
+    "SELECT ids.key, tracks.track_id, tracks.track_name, albums.path, "       \
+    "content.cid"
+#define RESOLVE_JOINS                                                          \
+    " FROM json_each(?1) AS ids "                                              \
+    "LEFT JOIN tracks ON tracks.track_id = ids.value "                         \
+    "LEFT JOIN albums ON albums.album_id = tracks.album_id "                   \
+    "LEFT JOIN content ON content.track_id = tracks.track_id "                 \
+    "ORDER BY ids.key, content.rowid"
+
+// How long to wait before building again after a build failed
+#define SNAPSHOT_RETRY apr_time_from_sec(300)
+
+typedef struct {
+    snapshot_t *snapshot;
+    volatile apr_uint32_t refs;
+} snapshot_ref_t;
+
+struct catalog {
+    apr_pool_t *pool;
+    const char *filename;
+    sqlite3 *db;
+    sqlite3_stmt *count;
+    sqlite3_stmt *resolve;
+    sqlite3_stmt *data_version;
+    int has_sizes;
+    const char *snapshot_path;
+    snapshot_ref_t *snapshot;
+    // The build running in the background, if any
+    apr_pool_t *build_pool;
+    apr_thread_t *builder;
+    volatile apr_uint32_t built;
+    int build_result;
+    apr_time_t retry_at;
+    int version;
+    long generation;
+};
+
+static sqlite3_stmt *prepare(catalog_t *catalog, const char *query,
+                             int required) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v3(catalog->db, query, -1, SQLITE_PREPARE_PERSISTENT,
+                           &stmt, NULL) != SQLITE_OK) {
+        if (required) {
+            log_trace("catalog_open: Failed to prepare statement: %s",
+                      sqlite3_errmsg(catalog->db));
+            exit(-1);
+        }
+        return NULL;
+    }
+    return stmt;
+}
+
+// Changes with every commit to the catalog, from any connection
+static int read_data_version(catalog_t *catalog) {
+    int version = 0;
+    if (sqlite3_step(catalog->data_version) == SQLITE_ROW) {
+        version = sqlite3_column_int(catalog->data_version, 0);
+    }
+    sqlite3_reset(catalog->data_version);
+    return version;
+}
+
+static snapshot_ref_t *acquire_snapshot(snapshot_ref_t *ref) {
+    apr_atomic_inc32(&ref->refs);
+    return ref;
+}
+
+static apr_status_t release_snapshot(void *data) {
+    snapshot_ref_t *ref = (snapshot_ref_t *)data;
+    if (apr_atomic_dec32(&ref->refs) == 0) {
+        snapshot_close(ref->snapshot);
+        free(ref);
+    }
+    return APR_SUCCESS;
+}
+
+// The catalog holds the first reference
+static void use_snapshot(catalog_t *catalog, snapshot_t *snapshot) {
+    if (catalog->snapshot) {
+        release_snapshot(catalog->snapshot);
+        catalog->snapshot = NULL;
+    }
+    if (!snapshot) {
+        return;
+    }
+    snapshot_ref_t *ref = (snapshot_ref_t *)calloc(1, sizeof(snapshot_ref_t));
+    if (!ref) {
+        log_trace("catalog: Memory allocation failed");
+        exit(-1);
+    }
+    ref->snapshot = snapshot;
+    ref->refs = 1;
+    catalog->snapshot = ref;
+}
+
+// Without a snapshot, further builds wait until SNAPSHOT_RETRY has passed
+static void snapshot_built(catalog_t *catalog, int result) {
+    snapshot_t *snapshot =
+        result == 0 ? snapshot_open(catalog->snapshot_path, NULL) : NULL;
+    if (!snapshot) {
+        log_trace("catalog: No snapshot, resolving tracks with SQL");
+        catalog->retry_at = apr_time_now() + SNAPSHOT_RETRY;
+        return;
+    }
+    log_trace("catalog: Snapshot %s ready", catalog->snapshot_path);
+    use_snapshot(catalog, snapshot);
+}
+
+static void *APR_THREAD_FUNC build_thread(apr_thread_t *thd, void *data) {
+    catalog_t *catalog = (catalog_t *)data;
+    catalog->build_result =
+        snapshot_build(catalog->filename, catalog->snapshot_path);
+    apr_atomic_set32(&catalog->built, 1);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+static void start_build(catalog_t *catalog) {
+    log_trace("catalog: Building snapshot %s", catalog->snapshot_path);
+    apr_pool_create(&catalog->build_pool, catalog->pool);
+    apr_atomic_set32(&catalog->built, 0);
+    if (apr_thread_create(&catalog->builder, NULL, build_thread, catalog,
+                          catalog->build_pool) != APR_SUCCESS) {
+        log_trace("catalog: Failed to create snapshot thread");
+        apr_pool_destroy(catalog->build_pool);
+        catalog->builder = NULL;
+        snapshot_built(catalog, -1);
+    }
+}
+
+static void join_build(catalog_t *catalog) {
+    apr_status_t rv;
+    apr_thread_join(&rv, catalog->builder);
+    apr_pool_destroy(catalog->build_pool);
+    catalog->builder = NULL;
+}
+
+// Catalogs without a size column resolve without sizes. `snapshot_path`
+// may be NULL to always query the catalog.
+catalog_t *catalog_open(apr_pool_t *pool, const char *filename,
+                        const char *snapshot_path) {
+    catalog_t *catalog = apr_pcalloc(pool, sizeof(catalog_t));
+    catalog->pool = pool;
+    catalog->filename = apr_pstrdup(pool, filename);
+    database_open_readonly(filename, &catalog->db);
+
+    catalog->count = prepare(catalog, "SELECT count(*) FROM tracks", 1);
+    catalog->resolve = prepare(
+        catalog, RESOLVE_COLUMNS ", content.size" RESOLVE_JOINS, 0);
+    catalog->has_sizes = catalog->resolve != NULL;
+    if (!catalog->resolve) {
+        catalog->resolve = prepare(catalog, RESOLVE_COLUMNS RESOLVE_JOINS, 1);
+    }
+    catalog->data_version = prepare(catalog, "PRAGMA data_version", 1);
+    catalog->version = read_data_version(catalog);
+
+    // Nothing plays yet, so a missing snapshot is built right away
+    if (snapshot_path) {
+        catalog->snapshot_path = apr_pstrdup(pool, snapshot_path);
+        snapshot_t *snapshot = snapshot_open(snapshot_path, filename);
+        if (snapshot) {
+            use_snapshot(catalog, snapshot);
+        } else {
+            log_trace("catalog: Building snapshot %s", snapshot_path);
+            snapshot_built(catalog, snapshot_build(filename, snapshot_path));
+        }
+    }
+    return catalog;
+}
+
+// Notes catalog writes made since the last refresh, either through SQLite
+// or by replacing the file. After one, the snapshot is dropped and rebuilt
+// in the background. A commit seen through data_version always rebuilds,
+// as the file may look unchanged.
+void catalog_refresh(catalog_t *catalog) {
+    int version = read_data_version(catalog);
+    int committed = version != catalog->version;
+    catalog->version = version;
+    if (!catalog->snapshot_path) {
+        catalog->generation += committed;
+        return;
+    }
+
+    if (catalog->builder && apr_atomic_read32(&catalog->built)) {
+        join_build(catalog);
+        // A commit during the build makes the new snapshot stale already
+        if (!committed) {
+            snapshot_built(catalog, catalog->build_result);
+            return;
+        }
+    }
+    if (catalog->snapshot && !committed &&
+        snapshot_is_current(catalog->snapshot->snapshot, catalog->filename)) {
+        return;
+    }
+    if (catalog->snapshot || committed) {
+        log_trace("catalog: Catalog changed, rebuilding snapshot");
+        catalog->generation++;
+        use_snapshot(catalog, NULL);
+    }
+    if (!catalog->builder && apr_time_now() >= catalog->retry_at) {
+        start_build(catalog);
+    }
+}
+
+// Bumped by catalog_refresh() whenever the catalog changed
+long catalog_generation(catalog_t *catalog) {
+    return catalog->generation;
+}
+
+apr_status_t catalog_close(void *data) {
+    catalog_t *catalog = (catalog_t *)data;
+    if (catalog->builder) {
+        join_build(catalog);
+    }
+    use_snapshot(catalog, NULL);
+    sqlite3_finalize(catalog->count);
+    sqlite3_finalize(catalog->resolve);
+    sqlite3_finalize(catalog->data_version);
+    return database_close(catalog->db);
+}
+
+int catalog_count_tracks(catalog_t *catalog) {
+    if (catalog->snapshot) {
+        return snapshot_count_tracks(catalog->snapshot->snapshot);
+    }
+    int count = 0;
+    if (sqlite3_step(catalog->count) == SQLITE_ROW) {
+        count = sqlite3_column_int(catalog->count, 0);
+    }
+    sqlite3_reset(catalog->count);
+    return count;
+}
+
+static char *bind_ids(apr_pool_t *pool, const int *track_ids,
+                      int num_tracks) {
+    // Up to 11 characters and a comma per ID, plus brackets
+    size_t size = (size_t)num_tracks * 12 + 3;
+    char *json = apr_palloc(pool, size);
+    size_t len = 0;
+
+    json[len++] = '[';
+    for (int i = 0; i < num_tracks; ++i) {
+        len += snprintf(json + len, size - len, i ? ",%d" : "%d",
+                        track_ids[i]);
+    }
+    json[len++] = ']';
+    json[len] = '\0';
+    return json;
+}
+
+static char *column_text(apr_pool_t *pool, sqlite3_stmt *stmt, int column) {
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    return text ? apr_pstrdup(pool, (const char *)text) : NULL;
+}
+
+// Tracks point into the CID and size arrays by index while those still
+// grow, and get their pointers once the last row is in
+static void link_tracks(catalog_batch_t *batch, apr_array_header_t *cids,
+                        apr_array_header_t *sizes, int *first_cid,
+                        int *sized) {
+    batch->cids = (char **)cids->elts;
+    batch->sizes = (int64_t *)sizes->elts;
+    batch->num_cids = cids->nelts;
+    for (int i = 0; i < batch->num_tracks; ++i) {
+        catalog_track_t *track = &batch->tracks[i];
+        track->cids = batch->cids + first_cid[i];
+        track->sizes = sized[i] ? batch->sizes + first_cid[i] : NULL;
+    }
+}
+
+// Names, CIDs and sizes point into the snapshot; only the CID pointer
+// array of the batch is allocated. The snapshot stays mapped until the
+// batch pool is gone.
+static void resolve_snapshot(catalog_t *catalog, apr_pool_t *pool,
+                             catalog_batch_t *batch, const int *track_ids) {
+    snapshot_t *snapshot = catalog->snapshot->snapshot;
+    apr_pool_cleanup_register(pool, acquire_snapshot(catalog->snapshot),
+                              release_snapshot, apr_pool_cleanup_null);
+    for (int i = 0; i < batch->num_tracks; ++i) {
+        batch->num_cids += snapshot_count_cids(snapshot, track_ids[i]);
+    }
+    batch->cids = apr_palloc(pool, (batch->num_cids + 1) * sizeof(char *));
+
+    char **cids = batch->cids;
+    for (int i = 0; i < batch->num_tracks; ++i) {
+        snapshot_lookup(snapshot, track_ids[i], &batch->tracks[i], cids);
+        cids += batch->tracks[i].num_cids;
+    }
+}
+
+// Track IDs missing from the catalog come back with a NULL name
+catalog_batch_t *catalog_resolve(catalog_t *catalog, apr_pool_t *pool,
+                                 const int *track_ids, int num_tracks) {
+    catalog_batch_t *batch = apr_pcalloc(pool, sizeof(catalog_batch_t));
+    batch->tracks = apr_pcalloc(pool, num_tracks * sizeof(catalog_track_t));
+    batch->num_tracks = num_tracks;
+    if (catalog->snapshot) {
+        resolve_snapshot(catalog, pool, batch, track_ids);
+        return batch;
+    }
+
+    int *first_cid = apr_pcalloc(pool, num_tracks * sizeof(int));
+    int *sized = apr_pcalloc(pool, num_tracks * sizeof(int));
+    apr_array_header_t *cids =
+        apr_array_make(pool, num_tracks * 2, sizeof(char *));
+    apr_array_header_t *sizes =
+        apr_array_make(pool, num_tracks * 2, sizeof(int64_t));
+
+    sqlite3_stmt *stmt = catalog->resolve;
+    sqlite3_bind_text(stmt, 1, bind_ids(pool, track_ids, num_tracks), -1,
+                      SQLITE_STATIC);
+
+    int current = -1;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        int position = sqlite3_column_int(stmt, 0);
+        if (position < 0 || position >= num_tracks) {
+            continue;
+        }
+        catalog_track_t *track = &batch->tracks[position];
+        if (position != current) {
+            current = position;
+            track->track_id = track_ids[position];
+            track->track_name = column_text(pool, stmt, 2);
+            track->album_path = column_text(pool, stmt, 3);
+            first_cid[position] = cids->nelts;
+            sized[position] = catalog->has_sizes;
+        }
+        if (sqlite3_column_type(stmt, 4) == SQLITE_NULL) {
+            continue;
+        }
+
+        *(char **)apr_array_push(cids) = column_text(pool, stmt, 4);
+        int64_t *size = (int64_t *)apr_array_push(sizes);
+        *size = 0;
+        if (catalog->has_sizes &&
+            sqlite3_column_type(stmt, 5) == SQLITE_INTEGER) {
+            *size = sqlite3_column_int64(stmt, 5);
+        } else {
+            sized[position] = 0;
+        }
+        track->num_cids++;
+    }
+    if (rc != SQLITE_DONE) {
+        log_trace("catalog_resolve: Failed to resolve tracks: %s",
+                  sqlite3_errmsg(catalog->db));
+        exit(-1);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+
+    link_tracks(batch, cids, sizes, first_cid, sized);
+    return batch;
+}
+
+static int has_column(catalog_t *catalog, const char *column) {
+    char *query = sqlite3_mprintf("SELECT %s FROM tracks LIMIT 0", column);
+    sqlite3_stmt *stmt = prepare(catalog, query, 0);
+    sqlite3_free(query);
+    sqlite3_finalize(stmt);
+    return stmt != NULL;
+}
+
+// Streams what weighted selection needs to know about every track. Ratings
+// and boosts are optional columns of the tracks table and come back as -1
+// when missing.
+void catalog_scan_weights(catalog_t *catalog, catalog_weight_fn fn,
+                          void *data) {
+    char *query = sqlite3_mprintf(
+        "SELECT tracks.track_id, albums.size, %s, %s FROM tracks "
+        "LEFT JOIN (SELECT album_id, count(*) AS size FROM tracks "
+        "GROUP BY album_id) AS albums ON albums.album_id = tracks.album_id",
+        has_column(catalog, "rating") ? "tracks.rating" : "NULL",
+        has_column(catalog, "boost") ? "tracks.boost" : "NULL");
+    sqlite3_stmt *stmt = prepare(catalog, query, 1);
+    sqlite3_free(query);
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        double rating = sqlite3_column_type(stmt, 2) == SQLITE_NULL
+                            ? -1
+                            : sqlite3_column_double(stmt, 2);
+        double boost = sqlite3_column_type(stmt, 3) == SQLITE_NULL
+                           ? -1
+                           : sqlite3_column_double(stmt, 3);
+        fn(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), rating,
+           boost, data);
+    }
+    if (rc != SQLITE_DONE) {
+        log_trace("catalog_scan_weights: Failed to read tracks: %s",
+                  sqlite3_errmsg(catalog->db));
+        exit(-1);
+    }
+    sqlite3_finalize(stmt);
+}
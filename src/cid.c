@@ -0,0 +1,335 @@
+#include "cid.h"
+#include <string.h>
+
+// A gateway answering /ipfs/<cid> returns the file, not the block, so only
+// CIDs whose block is the file itself can be checked in a single pass:
+// CIDv1 raw leaves hashed with sha2-256, or inlined with the identity hash.
+// dag-pb CIDs (all of CIDv0) hash the protobuf node and are left unchecked
+// unless they are fetched block by block, see dag.c.
+
+#define MULTIHASH_IDENTITY 0x00
+#define MULTIHASH_SHA2_256 0x12
+#define CIDV0_LENGTH 34
+#define CIDV0_TEXT_LENGTH 46
+
+static const char base32_alphabet[] = "abcdefghijklmnopqrstuvwxyz234567";
+static const char base58_alphabet[] =
+    "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+static int base32_value(char c) {
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a';
+    }
+    if (c >= '2' && c <= '7') {
+        return c - '2' + 26;
+    }
+    return -1;
+}
+
+// RFC 4648 lowercase base32 without padding, multibase prefix 'b'
+static int base32_decode(const char *text, uint8_t *out, size_t max_len) {
+    uint32_t buffer = 0;
+    int bits = 0;
+    size_t len = 0;
+
+    for (; *text; ++text) {
+        int value = base32_value(*text);
+        if (value < 0) {
+            return -1;
+        }
+        buffer = (buffer << 5) | value;
+        bits += 5;
+        if (bits >= 8) {
+            if (len == max_len) {
+                return -1;
+            }
+            bits -= 8;
+            out[len++] = (uint8_t)(buffer >> bits);
+        }
+    }
+    return (int)len;
+}
+
+static int base32_encode(const uint8_t *bytes, size_t len, char *text,
+                         size_t size) {
+    uint32_t buffer = 0;
+    int bits = 0;
+    size_t pos = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        buffer = (buffer << 8) | bytes[i];
+        bits += 8;
+        while (bits >= 5) {
+            if (pos + 1 >= size) {
+                return -1;
+            }
+            bits -= 5;
+            text[pos++] = base32_alphabet[(buffer >> bits) & 0x1f];
+        }
+    }
+    if (bits > 0) {
+        if (pos + 1 >= size) {
+            return -1;
+        }
+        text[pos++] = base32_alphabet[(buffer << (5 - bits)) & 0x1f];
+    }
+    text[pos] = '\0';
+    return 0;
+}
+
+// Big-number base conversion; only ever used on 34 byte CIDv0 multihashes
+static int base58_decode(const char *text, uint8_t *out, size_t len) {
+    memset(out, 0, len);
+    for (; *text; ++text) {
+        const char *digit = strchr(base58_alphabet, *text);
+        if (!digit) {
+            return -1;
+        }
+        int carry = (int)(digit - base58_alphabet);
+        for (size_t i = len; i-- > 0;) {
+            carry += 58 * out[i];
+            out[i] = (uint8_t)carry;
+            carry >>= 8;
+        }
+        if (carry) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int base58_encode(const uint8_t *bytes, size_t len, char *text,
+                         size_t size) {
+    uint8_t digits[CID_MAX_TEXT];
+    size_t num_digits = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        int carry = bytes[i];
+        for (size_t j = 0; j < num_digits; ++j) {
+            carry += digits[j] << 8;
+            digits[j] = carry % 58;
+            carry /= 58;
+        }
+        while (carry) {
+            if (num_digits == sizeof(digits)) {
+                return -1;
+            }
+            digits[num_digits++] = carry % 58;
+            carry /= 58;
+        }
+    }
+
+    size_t zeros = 0;
+    while (zeros < len && bytes[zeros] == 0) {
+        zeros++;
+    }
+    if (zeros + num_digits + 1 > size) {
+        return -1;
+    }
+    size_t pos = 0;
+    for (; pos < zeros; ++pos) {
+        text[pos] = base58_alphabet[0];
+    }
+    while (num_digits > 0) {
+        text[pos++] = base58_alphabet[digits[--num_digits]];
+    }
+    text[pos] = '\0';
+    return 0;
+}
+
+static int read_varint(const uint8_t *bytes, int len, int *pos,
+                       uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *pos < len && shift < 64; shift += 7) {
+        uint8_t byte = bytes[(*pos)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int is_cidv0(const uint8_t *bytes, size_t len) {
+    return len >= CIDV0_LENGTH && bytes[0] == MULTIHASH_SHA2_256 &&
+           bytes[1] == SHA256_DIGEST_LENGTH;
+}
+
+typedef struct {
+    uint64_t version;
+    uint64_t codec;
+    uint64_t hash;
+    const uint8_t *digest;
+    size_t digest_len;
+} cid_header_t;
+
+// Returns the number of bytes the CID takes up at the start of `bytes`
+static int parse_cid(const uint8_t *bytes, size_t len, cid_header_t *header) {
+    uint64_t length;
+    int pos = 0;
+
+    if (is_cidv0(bytes, len)) {
+        header->version = 0;
+        header->codec = CID_CODEC_DAG_PB;
+        header->hash = MULTIHASH_SHA2_256;
+        header->digest = bytes + 2;
+        header->digest_len = SHA256_DIGEST_LENGTH;
+        return CIDV0_LENGTH;
+    }
+
+    if (len > CID_MAX_BYTES) {
+        len = CID_MAX_BYTES;
+    }
+    if (read_varint(bytes, (int)len, &pos, &header->version) != 0 ||
+        read_varint(bytes, (int)len, &pos, &header->codec) != 0 ||
+        read_varint(bytes, (int)len, &pos, &header->hash) != 0 ||
+        read_varint(bytes, (int)len, &pos, &length) != 0) {
+        return -1;
+    }
+    if (header->version != 1 || length > CID_MAX_DIGEST ||
+        pos + length > len) {
+        return -1;
+    }
+    header->digest = bytes + pos;
+    header->digest_len = length;
+    return pos + (int)length;
+}
+
+int cid_decode(const char *text, cid_t *cid) {
+    cid_header_t header;
+    int len;
+
+    if (strlen(text) == CIDV0_TEXT_LENGTH && text[0] == 'Q') {
+        if (base58_decode(text, cid->bytes, CIDV0_LENGTH) != 0) {
+            return -1;
+        }
+        len = CIDV0_LENGTH;
+    } else if (text[0] == 'b') {
+        len = base32_decode(text + 1, cid->bytes, sizeof(cid->bytes));
+    } else {
+        return -1;
+    }
+
+    if (len < 0 || parse_cid(cid->bytes, len, &header) != len) {
+        return -1;
+    }
+    cid->len = len;
+    return 0;
+}
+
+int cid_encode(const cid_t *cid, char *text, size_t size) {
+    if (is_cidv0(cid->bytes, cid->len)) {
+        return base58_encode(cid->bytes, cid->len, text, size);
+    }
+    if (size < 2) {
+        return -1;
+    }
+    text[0] = 'b';
+    return base32_encode(cid->bytes, cid->len, text + 1, size - 1);
+}
+
+// Reads a binary CID from the start of a link or CAR section and returns
+// its length
+int cid_read(const uint8_t *bytes, size_t len, cid_t *cid) {
+    cid_header_t header;
+    int cid_len = parse_cid(bytes, len, &header);
+    if (cid_len < 0) {
+        return -1;
+    }
+    memcpy(cid->bytes, bytes, cid_len);
+    cid->len = cid_len;
+    return cid_len;
+}
+
+uint64_t cid_codec(const cid_t *cid) {
+    cid_header_t header;
+    if (parse_cid(cid->bytes, cid->len, &header) < 0) {
+        return 0;
+    }
+    return header.codec;
+}
+
+// Returns 1 when the block hashes to the digest inside `cid`
+int cid_verify_block(const cid_t *cid, const void *data, size_t len) {
+    cid_header_t header;
+    if (parse_cid(cid->bytes, cid->len, &header) < 0) {
+        return 0;
+    }
+
+    if (header.hash == MULTIHASH_SHA2_256) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        sha256_ctx_t ctx;
+        if (header.digest_len != SHA256_DIGEST_LENGTH) {
+            return 0;
+        }
+        sha256_init(&ctx);
+        sha256_update(&ctx, data, len);
+        sha256_final(&ctx, digest);
+        return memcmp(digest, header.digest, SHA256_DIGEST_LENGTH) == 0;
+    }
+    if (header.hash == MULTIHASH_IDENTITY) {
+        return header.digest_len == len &&
+               memcmp(header.digest, data, len) == 0;
+    }
+    return 0;
+}
+
+// Returns 1 when the body of `cid` can be verified
+int cid_verifier_init(cid_verifier_t *verifier, const char *cid) {
+    cid_t binary;
+    cid_header_t header;
+
+    memset(verifier, 0, sizeof(cid_verifier_t));
+    if (cid_decode(cid, &binary) != 0 ||
+        parse_cid(binary.bytes, binary.len, &header) < 0) {
+        return 0;
+    }
+    if (header.version != 1 || header.codec != CID_CODEC_RAW) {
+        return 0;
+    }
+    if (header.hash == MULTIHASH_SHA2_256 &&
+        header.digest_len != SHA256_DIGEST_LENGTH) {
+        return 0;
+    }
+    if (header.hash != MULTIHASH_SHA2_256 &&
+        header.hash != MULTIHASH_IDENTITY) {
+        return 0;
+    }
+
+    verifier->hash = header.hash;
+    memcpy(verifier->digest, header.digest, header.digest_len);
+    verifier->digest_len = header.digest_len;
+    cid_verifier_reset(verifier);
+    return 1;
+}
+
+void cid_verifier_reset(cid_verifier_t *verifier) {
+    sha256_init(&verifier->sha256);
+    verifier->identity_pos = 0;
+    verifier->mismatch = 0;
+}
+
+void cid_verifier_update(cid_verifier_t *verifier, const void *data,
+                         size_t len) {
+    if (verifier->hash == MULTIHASH_SHA2_256) {
+        sha256_update(&verifier->sha256, data, len);
+        return;
+    }
+
+    // The identity digest is the content itself
+    if (verifier->identity_pos + len > verifier->digest_len ||
+        memcmp(verifier->digest + verifier->identity_pos, data, len) != 0) {
+        verifier->mismatch = 1;
+    }
+    verifier->identity_pos += len;
+}
+
+int cid_verifier_check(cid_verifier_t *verifier) {
+    if (verifier->hash == MULTIHASH_SHA2_256) {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        sha256_final(&verifier->sha256, digest);
+        return memcmp(digest, verifier->digest, SHA256_DIGEST_LENGTH) == 0;
+    }
+    return !verifier->mismatch &&
+           verifier->identity_pos == verifier->digest_len;
+}
@@ -1,6 +1,7 @@
 #include "config.h"
 #include "log.h"
 #include <jansson.h>
+#include <stdlib.h>
 #include <string.h>
 
 apr_status_t config_free(void *data) {
@@ -10,6 +11,16 @@ apr_status_t config_free(void *data) {
     free(config->output);
     free(config->log);
     free(config->pipe_name);
+    free(config->gateway_state);
+    free(config->probe_cid);
+    free(config->cache_dir);
+    free(config->cache_policy);
+    free(config->local_gateway);
+    free(config->local_rpc);
+    free(config->catalog_snapshot);
+    free(config->shuffle_state);
+    free(config->selection);
+    free(config->picker_state);
     for (int i = 0; i < config->num_gateways; ++i) {
         free(config->gateways[i]);
     }
@@ -18,6 +29,43 @@ apr_status_t config_free(void *data) {
     return APR_SUCCESS;
 }
 
+static int config_get_int(json_t *root, const char *key, int default_value) {
+    json_t *obj = json_object_get(root, key);
+    if (!obj) {
+        return default_value;
+    }
+    if (!json_is_integer(obj)) {
+        log_trace("config_read: Invalid %s", key);
+        exit(-1);
+    }
+    return json_integer_value(obj);
+}
+
+static char *config_get_string(json_t *root, const char *key,
+                               const char *default_value) {
+    json_t *obj = json_object_get(root, key);
+    if (!obj) {
+        return default_value ? strdup(default_value) : NULL;
+    }
+    if (!json_is_string(obj)) {
+        log_trace("config_read: Invalid %s", key);
+        exit(-1);
+    }
+    return strdup(json_string_value(obj));
+}
+
+static int config_get_bool(json_t *root, const char *key, int default_value) {
+    json_t *obj = json_object_get(root, key);
+    if (!obj) {
+        return default_value;
+    }
+    if (!json_is_boolean(obj)) {
+        log_trace("config_read: Invalid %s", key);
+        exit(-1);
+    }
+    return json_is_true(obj);
+}
+
 void config_read(const char *config_file, config_t *config) {
     json_error_t error;
     json_t *root = json_load_file(config_file, 0, &error);
@@ -55,6 +103,50 @@ void config_read(const char *config_file, config_t *config) {
     config->pipe_name = strdup(json_string_value(pipe_name_obj));
     config->log = strdup(json_string_value(log_obj));
     config->min_value = json_integer_value(min_value_obj);
+    config->max_connections = config_get_int(root, "max_connections", 0);
+    config->stream = config_get_bool(root, "stream", 0);
+    config->stream_buffer =
+        config_get_int(root, "stream_buffer", 4 * 1024 * 1024);
+    config->gateway_state =
+        config_get_string(root, "gateway_state", "gateways.json");
+    config->probe_cid = config_get_string(root, "probe_cid", NULL);
+    config->hedge_budget = config_get_int(root, "hedge_budget", 10);
+    config->hedge_min_speed = config_get_int(root, "hedge_min_speed", 65536);
+    config->stall_speed = config_get_int(root, "stall_speed", 1024);
+    config->cache_dir = config_get_string(root, "cache_dir", "cache");
+    config->cache_mb = config_get_int(root, "cache_mb", 1024);
+    config->cache_policy = config_get_string(root, "cache_policy", "lru");
+    config->assemble_threads = config_get_int(root, "assemble_threads", 4);
+    config->max_bandwidth = config_get_int(root, "max_bandwidth", 0);
+    config->gateway_max_connections =
+        config_get_int(root, "gateway_max_connections", 0);
+    config->gateway_max_rps = config_get_int(root, "gateway_max_rps", 0);
+    config->prefetch = config_get_int(root, "prefetch", 1);
+    config->min_concurrency = config_get_int(root, "min_concurrency", 2);
+    config->max_concurrency = config_get_int(root, "max_concurrency", 256);
+    config->trustless = config_get_bool(root, "trustless", 0);
+    config->local_gateway = config_get_string(root, "local_gateway", NULL);
+    config->local_rpc = config_get_string(root, "local_rpc", NULL);
+    config->local_pins = config_get_int(root, "local_pins", 256);
+    config->split_min_size =
+        config_get_int(root, "split_min_size", 16 * 1024 * 1024);
+    config->gateway_affinity = config_get_bool(root, "gateway_affinity", 1);
+    config->catalog_snapshot =
+        config_get_string(root, "catalog_snapshot", NULL);
+    config->shuffle_state =
+        config_get_string(root, "shuffle_state", "shuffle.json");
+    config->selection = config_get_string(root, "selection", "shuffle");
+    if (strcmp(config->selection, "shuffle") != 0 &&
+        strcmp(config->selection, "weighted") != 0) {
+        log_trace("config_read: Invalid %s", "selection");
+        exit(-1);
+    }
+    config->picker_state =
+        config_get_string(root, "picker_state", "picker.json");
+    config->weight_album = config_get_bool(root, "weight_album", 0);
+    config->weight_recent = config_get_int(root, "weight_recent", 1000);
+    config->weight_recent_percent =
+        config_get_int(root, "weight_recent_percent", 10);
 
     config->num_gateways = json_array_size(gateways_array);
     config->gateways = malloc(config->num_gateways * sizeof(char *));
@@ -0,0 +1,197 @@
+#include "conn.h"
+#include "log.h"
+#include <apr_thread_mutex.h>
+#include <stdlib.h>
+
+// Long-lived connection layer. Lives for the whole process so that DNS
+// entries, TLS sessions and open (HTTP/2) connections to the gateways are
+// reused across CIDs and across process_files cycles.
+//
+// DNS and TLS sessions are shared between threads. Open connections are
+// not: libcurl does not support one connection cache in concurrent multi
+// handles, so every engine keeps the cache of its own multi handle, and a
+// finished engine hands its multi handle, connections and all, to the
+// next one through conn_acquire_multi(). The reuse counters therefore
+// count reuse within a multi handle.
+
+struct conn {
+    CURLSH *share;
+    apr_thread_mutex_t *share_locks[CURL_LOCK_DATA_LAST];
+    apr_thread_mutex_t *mutex;
+    CURL **idle;
+    int num_idle;
+    int max_idle;
+    CURLM **idle_multis;
+    int num_idle_multis;
+    unsigned long new_connections;
+    unsigned long reused_connections;
+};
+
+static void share_lock(CURL *curl, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+    conn_t *conn = (conn_t *)userptr;
+    apr_thread_mutex_lock(conn->share_locks[data]);
+}
+
+static void share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+    conn_t *conn = (conn_t *)userptr;
+    apr_thread_mutex_unlock(conn->share_locks[data]);
+}
+
+conn_t *conn_create(apr_pool_t *pool) {
+    conn_t *conn = apr_pcalloc(pool, sizeof(conn_t));
+
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        log_trace("conn_create: Failed to initialize curl");
+        exit(-1);
+    }
+
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+        apr_thread_mutex_create(&conn->share_locks[i],
+                                APR_THREAD_MUTEX_DEFAULT, pool);
+    }
+    apr_thread_mutex_create(&conn->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+
+    conn->share = curl_share_init();
+    if (!conn->share) {
+        log_trace("conn_create: Failed to create curl share handle");
+        exit(-1);
+    }
+    curl_share_setopt(conn->share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(conn->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(conn->share, CURLSHOPT_USERDATA, conn);
+    curl_share_setopt(conn->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(conn->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    conn->max_idle = 16;
+    conn->idle = (CURL **)malloc(conn->max_idle * sizeof(CURL *));
+    conn->idle_multis = (CURLM **)malloc(conn->max_idle * sizeof(CURLM *));
+    if (!conn->idle || !conn->idle_multis) {
+        log_trace("conn_create: Memory allocation failed");
+        exit(-1);
+    }
+
+    return conn;
+}
+
+apr_status_t conn_destroy(void *data) {
+    log_trace("conn_destroy: start");
+    conn_t *conn = (conn_t *)data;
+    for (int i = 0; i < conn->num_idle; ++i) {
+        curl_easy_cleanup(conn->idle[i]);
+    }
+    free(conn->idle);
+    for (int i = 0; i < conn->num_idle_multis; ++i) {
+        curl_multi_cleanup(conn->idle_multis[i]);
+    }
+    free(conn->idle_multis);
+    curl_share_cleanup(conn->share);
+    curl_global_cleanup();
+    log_trace("conn_destroy: finish");
+    return APR_SUCCESS;
+}
+
+static void set_default_opts(conn_t *conn, CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, conn->share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+}
+
+CURL *conn_acquire(conn_t *conn) {
+    CURL *curl = NULL;
+
+    apr_thread_mutex_lock(conn->mutex);
+    if (conn->num_idle > 0) {
+        curl = conn->idle[--conn->num_idle];
+    }
+    apr_thread_mutex_unlock(conn->mutex);
+
+    if (!curl) {
+        curl = curl_easy_init();
+        if (!curl) {
+            log_trace("conn_acquire: Failed to create curl handle");
+            exit(-1);
+        }
+    }
+
+    set_default_opts(conn, curl);
+    return curl;
+}
+
+void conn_release(conn_t *conn, CURL *curl) {
+    // curl_easy_reset keeps the handle's caches but drops per-transfer options
+    curl_easy_reset(curl);
+
+    apr_thread_mutex_lock(conn->mutex);
+    if (conn->num_idle < conn->max_idle) {
+        conn->idle[conn->num_idle++] = curl;
+        curl = NULL;
+    }
+    apr_thread_mutex_unlock(conn->mutex);
+
+    if (curl) {
+        curl_easy_cleanup(curl);
+    }
+}
+
+// A multi handle belongs to one engine thread at a time
+CURLM *conn_acquire_multi(conn_t *conn) {
+    CURLM *multi = NULL;
+
+    apr_thread_mutex_lock(conn->mutex);
+    if (conn->num_idle_multis > 0) {
+        multi = conn->idle_multis[--conn->num_idle_multis];
+    }
+    apr_thread_mutex_unlock(conn->mutex);
+
+    if (!multi) {
+        multi = curl_multi_init();
+        if (!multi) {
+            log_trace("conn_acquire_multi: Failed to create multi handle");
+            exit(-1);
+        }
+    }
+    return multi;
+}
+
+// Takes back a multi handle with no transfers left in it
+void conn_release_multi(conn_t *conn, CURLM *multi) {
+    apr_thread_mutex_lock(conn->mutex);
+    if (conn->num_idle_multis < conn->max_idle) {
+        conn->idle_multis[conn->num_idle_multis++] = multi;
+        multi = NULL;
+    }
+    apr_thread_mutex_unlock(conn->mutex);
+
+    if (multi) {
+        curl_multi_cleanup(multi);
+    }
+}
+
+void conn_record(conn_t *conn, CURL *curl) {
+    long num_connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+
+    apr_thread_mutex_lock(conn->mutex);
+    if (num_connects > 0) {
+        conn->new_connections += num_connects;
+    } else {
+        conn->reused_connections++;
+    }
+    apr_thread_mutex_unlock(conn->mutex);
+}
+
+void conn_log_stats(conn_t *conn) {
+    apr_thread_mutex_lock(conn->mutex);
+    unsigned long new_connections = conn->new_connections;
+    unsigned long reused_connections = conn->reused_connections;
+    apr_thread_mutex_unlock(conn->mutex);
+
+    log_trace("Connections: %lu new, %lu reused", new_connections,
+              reused_connections);
+    fprintf(stdout, "Connections: %lu new, %lu reused\n", new_connections,
+            reused_connections);
+}
@@ -0,0 +1,94 @@
+#define _GNU_SOURCE
+#include "copy.h"
+#include "log.h"
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// File to file copies that stay inside the kernel where possible: reflinks
+// share extents on filesystems that support them, copy_file_range avoids
+// the trip through user space, and a buffered loop covers everything else.
+
+#define COPY_BUFSIZE 65536
+
+static const char *copy_method_names[] = {"reflink", "copy_file_range",
+                                          "buffered", "failed"};
+
+const char *copy_method_name(enum copy_method method) {
+    return copy_method_names[method];
+}
+
+static int copy_reflink(int in, off_t in_offset, int out, off_t out_offset,
+                        off_t size) {
+    struct file_clone_range range = {.src_fd = in,
+                                     .src_offset = in_offset,
+                                     .src_length = size,
+                                     .dest_offset = out_offset};
+    return ioctl(out, FICLONERANGE, &range);
+}
+
+static int copy_range(int in, off_t in_offset, int out, off_t out_offset,
+                      off_t size) {
+    loff_t off_in = in_offset;
+    loff_t off_out = out_offset;
+    while (size > 0) {
+        ssize_t copied = copy_file_range(in, &off_in, out, &off_out, size, 0);
+        if (copied <= 0) {
+            return -1;
+        }
+        size -= copied;
+    }
+    return 0;
+}
+
+static int copy_buffered(int in, off_t in_offset, int out, off_t out_offset,
+                         off_t size) {
+    char *buffer = (char *)malloc(COPY_BUFSIZE);
+    if (!buffer) {
+        log_trace("copy: Memory allocation failed");
+        exit(-1);
+    }
+
+    int rc = 0;
+    while (size > 0) {
+        ssize_t bytes_read = pread(in, buffer,
+                                   size < COPY_BUFSIZE ? size : COPY_BUFSIZE,
+                                   in_offset);
+        if (bytes_read <= 0 ||
+            pwrite(out, buffer, bytes_read, out_offset) != bytes_read) {
+            rc = -1;
+            break;
+        }
+        in_offset += bytes_read;
+        out_offset += bytes_read;
+        size -= bytes_read;
+    }
+
+    free(buffer);
+    return rc;
+}
+
+// Copies `size` bytes starting with `method` and falling back to the next
+// one on failure. Returns the method that succeeded so callers can skip the
+// ones that already failed, e.g. reflinks once offsets are no longer block
+// aligned.
+enum copy_method copy_fd(int in, off_t in_offset, int out, off_t out_offset,
+                         off_t size, enum copy_method method) {
+    if (method == COPY_REFLINK) {
+        if (copy_reflink(in, in_offset, out, out_offset, size) == 0) {
+            return COPY_REFLINK;
+        }
+        method = COPY_RANGE;
+    }
+    if (method == COPY_RANGE) {
+        if (copy_range(in, in_offset, out, out_offset, size) == 0) {
+            return COPY_RANGE;
+        }
+        method = COPY_BUFFERED;
+    }
+    if (copy_buffered(in, in_offset, out, out_offset, size) == 0) {
+        return COPY_BUFFERED;
+    }
+    return COPY_FAILED;
+}
@@ -0,0 +1,583 @@
+#include "dag.h"
+#include "car.h"
+#include "cid.h"
+#include "log.h"
+#include "unixfs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Trustless retrieval. Instead of asking a gateway for the file behind a
+// CID, the UnixFS DAG is walked block by block: the root comes from
+// ?format=raw, raw leaves are fetched one block per request and sub-DAGs
+// as CAR streams, spread over all gateways in parallel. Every block is
+// checked against its CID before it is used, so a poisoned response is
+// dropped at its first bad block and only the blocks it still owed are
+// fetched again elsewhere. All calls happen on the engine thread.
+
+#define DAG_MAX_BLOCK (4 * 1024 * 1024)
+#define RAW_ACCEPT "Accept: application/vnd.ipld.raw"
+#define CAR_ACCEPT                                                             \
+    "Accept: application/vnd.ipld.car; version=1; order=dfs; dups=n"
+
+enum block_state { BLOCK_WAITING, BLOCK_COVERED, BLOCK_DONE };
+
+typedef struct dag_request dag_request_t;
+
+typedef struct {
+    cid_t cid;
+    int64_t offset;
+    int64_t size;
+    enum block_state state;
+    int retries;
+    int gateway;
+    int next_same;
+    dag_request_t *request;
+} dag_block_t;
+
+struct dag_request {
+    dag_fetch_t *fetch;
+    CURL *curl;
+    int block;
+    int car;
+    int gateway;
+    int checked;
+    int rejected;
+    int throttled;
+    uint8_t *body;
+    size_t body_len;
+    car_reader_t reader;
+    dag_request_t *next;
+    char url[512];
+};
+
+struct dag_fetch {
+    dag_t *dag;
+    char *cid;
+    int fd;
+    int64_t base;
+    int64_t size;
+    dag_block_t *blocks;
+    int num_blocks;
+    int remaining;
+    dag_request_t *requests;
+    dag_done_fn done;
+    void *data;
+    dag_fetch_t *next;
+};
+
+struct dag {
+    engine_t *engine;
+    sched_t *sched;
+    unsigned char *blocked;
+    conn_t *conn;
+    gateways_t *gateways;
+    config_t *config;
+    dag_rank_fn rank;
+    // The most urgent fetch with requests paused for tokens at the last pump
+    int64_t throttled;
+    struct curl_slist *raw_headers;
+    struct curl_slist *car_headers;
+    dag_fetch_t *fetches;
+    long blocks;
+    long rejected;
+    long requests;
+    long car_requests;
+    long fallbacks;
+};
+
+dag_t *dag_create(apr_pool_t *pool, engine_t *engine, context_t *context,
+                  config_t *config, dag_rank_fn rank) {
+    dag_t *dag = apr_pcalloc(pool, sizeof(dag_t));
+    dag->engine = engine;
+    dag->sched = context->sched;
+    dag->blocked = apr_pcalloc(pool, config->num_gateways + 1);
+    dag->conn = context->conn;
+    dag->gateways = context->gateways;
+    dag->config = config;
+    dag->rank = rank;
+    dag->throttled = SCHED_IDLE;
+    dag->raw_headers = curl_slist_append(NULL, RAW_ACCEPT);
+    dag->car_headers = curl_slist_append(NULL, CAR_ACCEPT);
+    return dag;
+}
+
+apr_status_t dag_destroy(void *data) {
+    dag_t *dag = (dag_t *)data;
+    curl_slist_free_all(dag->raw_headers);
+    curl_slist_free_all(dag->car_headers);
+    return APR_SUCCESS;
+}
+
+static int find_block(dag_fetch_t *fetch, const cid_t *cid) {
+    for (int i = 0; i < fetch->num_blocks; ++i) {
+        if (fetch->blocks[i].cid.len == cid->len &&
+            memcmp(fetch->blocks[i].cid.bytes, cid->bytes, cid->len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The same block can sit at several offsets, e.g. repeated silence, so
+// blocks with equal CIDs are chained and filled by a single response
+static int add_block(dag_fetch_t *fetch, const cid_t *cid, int64_t offset,
+                     int64_t size, dag_request_t *request) {
+    dag_block_t *blocks = (dag_block_t *)realloc(
+        fetch->blocks, (fetch->num_blocks + 1) * sizeof(dag_block_t));
+    if (!blocks) {
+        log_trace("dag: Memory allocation failed");
+        exit(-1);
+    }
+    fetch->blocks = blocks;
+
+    int index = fetch->num_blocks++;
+    dag_block_t *block = &fetch->blocks[index];
+    memset(block, 0, sizeof(dag_block_t));
+    block->cid = *cid;
+    block->offset = offset;
+    block->size = size;
+    block->gateway = -1;
+    block->next_same = -1;
+    block->state = request ? BLOCK_COVERED : BLOCK_WAITING;
+    block->request = request;
+
+    int same = find_block(fetch, cid);
+    if (same >= 0 && same != index) {
+        while (fetch->blocks[same].next_same >= 0) {
+            same = fetch->blocks[same].next_same;
+        }
+        fetch->blocks[same].next_same = index;
+    }
+    fetch->remaining++;
+    return index;
+}
+
+static int write_data(dag_fetch_t *fetch, int64_t offset, const uint8_t *data,
+                      size_t len) {
+    if (fetch->size >= 0 && offset + (int64_t)len > fetch->size) {
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t written = pwrite(fetch->fd, data, len, fetch->base + offset);
+        if (written < 0) {
+            log_trace("dag: Failed to write %s", fetch->cid);
+            return -1;
+        }
+        data += written;
+        offset += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Places one verified block. Children of a dag-pb node are covered by the
+// CAR request that is streaming them, or wait for requests of their own.
+static int place_block(dag_fetch_t *fetch, int index, const uint8_t *data,
+                       size_t len, dag_request_t *request) {
+    dag_block_t *block = &fetch->blocks[index];
+    int64_t offset = block->offset;
+
+    if (cid_codec(&block->cid) == CID_CODEC_RAW) {
+        if (block->size >= 0 && (int64_t)len != block->size) {
+            return -1;
+        }
+        if (index == 0 && fetch->size < 0) {
+            fetch->size = len;
+        }
+        return write_data(fetch, offset, data, len);
+    }
+
+    unixfs_node_t node;
+    if (unixfs_decode(data, len, &node) != 0) {
+        return -1;
+    }
+
+    // The children have to add up to the size the parent promised
+    int64_t total = node.data_len;
+    for (int i = 0; i < node.num_links; ++i) {
+        total += node.blocksizes[i];
+    }
+    if (node.num_links == 0 && node.filesize == 0) {
+        node.filesize = node.data_len;
+    }
+    if (total != (int64_t)node.filesize ||
+        (block->size >= 0 && total != block->size)) {
+        unixfs_free(&node);
+        return -1;
+    }
+    if (index == 0 && fetch->size < 0) {
+        fetch->size = total;
+    }
+    if (write_data(fetch, offset, node.data, node.data_len) != 0) {
+        unixfs_free(&node);
+        return -1;
+    }
+
+    int64_t child_offset = offset + node.data_len;
+    for (int i = 0; i < node.num_links; ++i) {
+        add_block(fetch, &node.links[i], child_offset, node.blocksizes[i],
+                  request);
+        child_offset += node.blocksizes[i];
+    }
+    unixfs_free(&node);
+    return 0;
+}
+
+// Verifies a block and fills every pending copy of it. Blocks that nobody
+// asked for mean the response is not the DAG we walked.
+static int receive_block(dag_fetch_t *fetch, const cid_t *cid,
+                         const uint8_t *data, size_t len,
+                         dag_request_t *request) {
+    int index = find_block(fetch, cid);
+    if (index < 0) {
+        return -1;
+    }
+    if (!cid_verify_block(cid, data, len)) {
+        log_trace("dag: block of %s from %s does not match its hash",
+                  fetch->cid, request->url);
+        fetch->dag->rejected++;
+        return -1;
+    }
+
+    dag_request_t *owner = request->car ? request : NULL;
+    for (; index >= 0; index = fetch->blocks[index].next_same) {
+        if (fetch->blocks[index].state == BLOCK_DONE) {
+            continue;
+        }
+        if (place_block(fetch, index, data, len, owner) != 0) {
+            log_trace("dag: malformed block in %s from %s", fetch->cid,
+                      request->url);
+            return -1;
+        }
+        fetch->blocks[index].state = BLOCK_DONE;
+        fetch->blocks[index].request = NULL;
+        fetch->remaining--;
+        fetch->dag->blocks++;
+    }
+    return 0;
+}
+
+static int car_block(const cid_t *cid, const uint8_t *data, size_t len,
+                     void *userdata) {
+    dag_request_t *request = (dag_request_t *)userdata;
+    return receive_block(request->fetch, cid, data, len, request);
+}
+
+static size_t dag_write(void *ptr, size_t size, size_t nmemb,
+                        void *userdata) {
+    dag_request_t *request = (dag_request_t *)userdata;
+    size_t len = size * nmemb;
+
+    if (!request->checked) {
+        long response_code = 0;
+        curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE,
+                          &response_code);
+        request->checked = 1;
+        request->rejected = response_code != 200;
+    }
+    if (request->rejected) {
+        return 0;
+    }
+    dag_t *dag = request->fetch->dag;
+    if (!sched_consume(dag->sched, dag->rank(request->fetch->data), len)) {
+        request->throttled = 1;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    if (request->car) {
+        if (car_reader_feed(&request->reader, ptr, len) != 0) {
+            request->rejected = 1;
+            return 0;
+        }
+        return len;
+    }
+
+    if (request->body_len + len > DAG_MAX_BLOCK) {
+        request->rejected = 1;
+        return 0;
+    }
+    uint8_t *body = (uint8_t *)realloc(request->body, request->body_len + len);
+    if (!body) {
+        log_trace("dag: Memory allocation failed");
+        exit(-1);
+    }
+    request->body = body;
+    memcpy(request->body + request->body_len, ptr, len);
+    request->body_len += len;
+    return len;
+}
+
+static void record_gateway(dag_t *dag, dag_request_t *request,
+                           int succeeded) {
+    curl_off_t ttfb_us = 0;
+    curl_off_t speed = 0;
+
+    curl_easy_getinfo(request->curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    curl_easy_getinfo(request->curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    gateway_record(dag->gateways, request->gateway, succeeded,
+                   (double)ttfb_us / APR_USEC_PER_SEC, (double)speed);
+}
+
+static void unlink_request(dag_fetch_t *fetch, dag_request_t *request) {
+    dag_request_t **link = &fetch->requests;
+    while (*link && *link != request) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = request->next;
+    }
+}
+
+static void free_request(dag_request_t *request) {
+    dag_t *dag = request->fetch->dag;
+
+    unlink_request(request->fetch, request);
+    sched_release(dag->sched, request->gateway);
+    conn_release(dag->conn, request->curl);
+    car_reader_free(&request->reader);
+    free(request->body);
+    free(request);
+}
+
+static void finish_fetch(dag_fetch_t *fetch, int succeeded) {
+    dag_t *dag = fetch->dag;
+
+    while (fetch->requests) {
+        dag_request_t *request = fetch->requests;
+        engine_remove(dag->engine, request->curl);
+        free_request(request);
+    }
+
+    dag_fetch_t **link = &dag->fetches;
+    while (*link != fetch) {
+        link = &(*link)->next;
+    }
+    *link = fetch->next;
+
+    if (!succeeded) {
+        dag->fallbacks++;
+    }
+    fetch->done(fetch, succeeded, fetch->data);
+    engine_unhold(dag->engine);
+    free(fetch->blocks);
+    free(fetch->cid);
+    free(fetch);
+}
+
+// Blocks a failed request still owed go back to waiting. Only its own
+// block counts the retry, the rest were never asked for on their own.
+static int release_blocks(dag_fetch_t *fetch, dag_request_t *request) {
+    for (int i = 0; i < fetch->num_blocks; ++i) {
+        dag_block_t *block = &fetch->blocks[i];
+        if (block->state != BLOCK_COVERED || block->request != request) {
+            continue;
+        }
+        block->state = BLOCK_WAITING;
+        block->request = NULL;
+        if (i == request->block) {
+            block->gateway = request->gateway;
+            if (++block->retries >= fetch->dag->config->max_retries) {
+                log_trace("dag: block of %s failed after %d tries",
+                          fetch->cid, block->retries);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int complete_request(dag_request_t *request, CURLcode res) {
+    dag_fetch_t *fetch = request->fetch;
+    dag_block_t *block = &fetch->blocks[request->block];
+    long response_code = 0;
+
+    curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (res != CURLE_OK || request->rejected || response_code != 200) {
+        log_trace("dag: %s: %s", request->url,
+                  res != CURLE_OK ? curl_easy_strerror(res) : "rejected");
+        return 0;
+    }
+    if (request->car) {
+        return car_reader_finish(&request->reader) == 0 &&
+               block->state == BLOCK_DONE;
+    }
+
+    cid_t cid = block->cid;
+    return receive_block(fetch, &cid, request->body, request->body_len,
+                         request) == 0;
+}
+
+static void dag_request_done(engine_t *engine, CURL *curl, CURLcode res,
+                             void *data) {
+    dag_request_t *request = (dag_request_t *)data;
+    dag_fetch_t *fetch = request->fetch;
+    dag_t *dag = fetch->dag;
+
+    conn_record(dag->conn, curl);
+    int succeeded = complete_request(request, res);
+    record_gateway(dag, request, succeeded);
+
+    // A CAR cut short still counts for the blocks it delivered
+    int failed = release_blocks(fetch, request) != 0;
+    free_request(request);
+
+    if (failed || fetch->remaining == 0) {
+        finish_fetch(fetch, !failed);
+        return;
+    }
+    dag_pump(dag);
+}
+
+static int start_request(dag_fetch_t *fetch, int index) {
+    dag_t *dag = fetch->dag;
+    dag_block_t *block = &fetch->blocks[index];
+
+    if (!sched_admit(dag->sched, dag->rank(fetch->data))) {
+        return 0;
+    }
+    unsigned char *blocked = dag->blocked;
+    sched_blocked(dag->sched, blocked, dag->config->num_gateways);
+    int gateway = gateway_pick(dag->gateways, block->gateway, blocked);
+    if (gateway < 0 && block->gateway >= 0) {
+        gateway = gateway_pick(dag->gateways, -1, blocked);
+    }
+    if (gateway < 0) {
+        return 0;
+    }
+
+    dag_request_t *request =
+        (dag_request_t *)calloc(1, sizeof(dag_request_t));
+    char cid[CID_MAX_TEXT];
+    if (!request) {
+        log_trace("dag: Memory allocation failed");
+        exit(-1);
+    }
+    request->fetch = fetch;
+    request->block = index;
+    request->gateway = gateway;
+    // The root is fetched alone so that its children spread over gateways
+    request->car = index > 0 && cid_codec(&block->cid) == CID_CODEC_DAG_PB;
+    car_reader_init(&request->reader, car_block, request);
+    cid_encode(&block->cid, cid, sizeof(cid));
+    snprintf(request->url, sizeof(request->url), "https://%s/%s?format=%s",
+             gateway_host(dag->gateways, gateway), cid,
+             request->car ? "car" : "raw");
+
+    CURL *curl = conn_acquire(dag->conn);
+    request->curl = curl;
+    curl_easy_setopt(curl, CURLOPT_URL, request->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                     request->car ? dag->car_headers : dag->raw_headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dag_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)dag->config->timeout);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT,
+                     (long)dag->config->stall_speed);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)dag->config->timeout);
+
+    block->state = BLOCK_COVERED;
+    block->request = request;
+    request->next = fetch->requests;
+    fetch->requests = request;
+    dag->requests++;
+    dag->car_requests += request->car;
+
+    log_trace("dag: fetching %s", request->url);
+    sched_acquire(dag->sched, gateway, 0);
+    engine_add(dag->engine, curl, dag_request_done, request);
+    return 1;
+}
+
+static void resume_requests(dag_fetch_t *fetch) {
+    dag_t *dag = fetch->dag;
+    int64_t rank = dag->rank(fetch->data);
+    for (dag_request_t *request = fetch->requests; request;
+         request = request->next) {
+        if (!request->throttled) {
+            continue;
+        }
+        if (!sched_bandwidth_available(dag->sched, rank)) {
+            dag->throttled = rank < dag->throttled ? rank : dag->throttled;
+            continue;
+        }
+        request->throttled = 0;
+        curl_easy_pause(request->curl, CURLPAUSE_CONT);
+    }
+}
+
+// Starts requests for waiting blocks, earliest fetch and lowest offset
+// first, until the scheduler runs out of room. Returns the rank of the
+// fetch left waiting, or SCHED_IDLE.
+int64_t dag_pump(dag_t *dag) {
+    dag->throttled = SCHED_IDLE;
+    for (dag_fetch_t *fetch = dag->fetches; fetch; fetch = fetch->next) {
+        resume_requests(fetch);
+    }
+    for (dag_fetch_t *fetch = dag->fetches; fetch; fetch = fetch->next) {
+        for (int i = 0; i < fetch->num_blocks; ++i) {
+            if (fetch->blocks[i].state == BLOCK_WAITING &&
+                !start_request(fetch, i)) {
+                return dag->rank(fetch->data);
+            }
+        }
+    }
+    return SCHED_IDLE;
+}
+
+// Returns NULL when `cid` cannot be fetched as a DAG. `size` is the
+// expected file size, or -1 when it is only known once the root arrives.
+dag_fetch_t *dag_fetch_start(dag_t *dag, const char *cid, int fd,
+                             int64_t offset, int64_t size, dag_done_fn done,
+                             void *data) {
+    cid_t root;
+    if (cid_decode(cid, &root) != 0 ||
+        (cid_codec(&root) != CID_CODEC_RAW &&
+         cid_codec(&root) != CID_CODEC_DAG_PB)) {
+        return NULL;
+    }
+
+    dag_fetch_t *fetch = (dag_fetch_t *)calloc(1, sizeof(dag_fetch_t));
+    if (!fetch) {
+        log_trace("dag: Memory allocation failed");
+        exit(-1);
+    }
+    fetch->dag = dag;
+    fetch->cid = strdup(cid);
+    fetch->fd = fd;
+    fetch->base = offset;
+    fetch->size = size;
+    fetch->done = done;
+    fetch->data = data;
+    add_block(fetch, &root, 0, size, NULL);
+
+    dag_fetch_t **link = &dag->fetches;
+    while (*link) {
+        link = &(*link)->next;
+    }
+    *link = fetch;
+    engine_hold(dag->engine);
+    dag_pump(dag);
+    return fetch;
+}
+
+int64_t dag_throttled(dag_t *dag) {
+    return dag->throttled;
+}
+
+int64_t dag_fetch_size(dag_fetch_t *fetch) {
+    return fetch->size;
+}
+
+void dag_log(dag_t *dag) {
+    log_trace("Trustless: %ld blocks verified, %ld rejected, %ld requests "
+              "(%ld CAR), %ld CIDs fetched whole",
+              dag->blocks, dag->rejected, dag->requests, dag->car_requests,
+              dag->fallbacks);
+    fprintf(stdout,
+            "Trustless: %ld blocks verified, %ld rejected, %ld requests "
+            "(%ld CAR), %ld CIDs fetched whole\n",
+            dag->blocks, dag->rejected, dag->requests, dag->car_requests,
+            dag->fallbacks);
+}
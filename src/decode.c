@@ -12,6 +12,7 @@
 #define OUT_SAMPLEFMT AV_SAMPLE_FMT_S16
 #define OUT_CHANNELS 2
 #define DUR_STRLEN 10
+#define STREAM_BUFSIZE 32768
 
 static void decode_print_metadata(AVFormatContext *fmt_ctx) {
     AVDictionaryEntry *tag = NULL;
@@ -299,11 +300,11 @@ static int decode_init(AVFormatContext **fmt_ctx, AVCodecContext **codec_ctx,
     return 0;
 }
 
-void decode_audio(char *pipe_name, char *filename, char *file_path) {
+static void decode_run(char *pipe_name, char *filename, char *file_path,
+                       AVFormatContext *fmt_ctx) {
     log_trace("decode_audio: start decoding %s", filename);
     apr_time_t start = apr_time_now();
 
-    AVFormatContext *fmt_ctx = NULL;
     AVCodecContext *codec_ctx = NULL;
     AVPacket *pkt = NULL;
     AVFrame *frame = NULL;
@@ -353,3 +354,46 @@ cleanup:
         swr_free(&swr_ctx);
     log_trace("decode_audio: finish decoding %s", filename);
 }
+
+
+void decode_audio(char *pipe_name, char *filename, char *file_path) {
+    decode_run(pipe_name, filename, file_path, NULL);
+}
+
+static int stream_read_packet(void *opaque, uint8_t *buf, int buf_size) {
+    int n = stream_read((stream_t *)opaque, buf, buf_size);
+    if (n == 0) {
+        return AVERROR_EOF;
+    }
+    return n < 0 ? AVERROR(EIO) : n;
+}
+
+static int64_t stream_seek_packet(void *opaque, int64_t offset, int whence) {
+    stream_t *stream = (stream_t *)opaque;
+    if (whence & AVSEEK_SIZE) {
+        return stream_size(stream);
+    }
+    return stream_seek(stream, offset, whence & ~AVSEEK_FORCE);
+}
+
+void decode_audio_stream(char *pipe_name, char *filename, stream_t *stream) {
+    unsigned char *buffer = av_malloc(STREAM_BUFSIZE);
+    AVIOContext *avio_ctx =
+        avio_alloc_context(buffer, STREAM_BUFSIZE, 0, stream,
+                           stream_read_packet, NULL, stream_seek_packet);
+    AVFormatContext *fmt_ctx = avformat_alloc_context();
+    if (!buffer || !avio_ctx || !fmt_ctx) {
+        log_trace("decode_audio_stream: Failed to allocate stream context");
+        exit(-1);
+    }
+    fmt_ctx->pb = avio_ctx;
+    fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    stream_attach(stream);
+    decode_run(pipe_name, filename, filename, fmt_ctx);
+    stream_detach(stream);
+
+    // avformat_close_input leaves custom I/O contexts to the caller
+    av_freep(&avio_ctx->buffer);
+    avio_context_free(&avio_ctx);
+}
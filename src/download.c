@@ -1,28 +1,165 @@
+#define _GNU_SOURCE
 #include "download.h"
-#include "const.h"
+#include "assemble.h"
+#include "cid.h"
+#include "copy.h"
+#include "dag.h"
+#include "engine.h"
+#include "flight.h"
 #include "log.h"
+#include "sched.h"
+#include "sniff.h"
+#include "source.h"
+#include <apr_atomic.h>
 #include <apr_strings.h>
-#include <apr_thread_pool.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 #include <apr_time.h>
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-typedef struct {
+#define HEDGE_PERCENTILE 0.95
+#define HEDGE_DEFAULT_DELAY 2
+#define HEDGE_MIN_DELAY apr_time_from_msec(500)
+#define HEDGE_INTERVAL apr_time_from_msec(250)
+#define SCHED_TICK_MS 50
+// Rank fields: batches, then tracks within a batch, then chunks
+#define RANK_BATCH_SHIFT 48
+#define RANK_TRACK_SHIFT 32
+#define SUBDOMAIN_GATEWAY "ipfs.nftstorage.link"
+#define SPLIT_MIN_PART (4 * 1024 * 1024)
+#define SPLIT_MAX_PARTS 8
+#define SPLIT_MAX_ERROR_RATE 0.5
+#define VERIFY_BUFFER_SIZE 65536
+
+typedef struct download_info download_info_t;
+
+typedef struct attempt {
+    download_info_t *download_info;
+    CURL *curl;
+    FILE *fp;
+    char *file_path;
+    int source;
+    int gateway;
+    int hedge;
+    int paused;
+    int checked;
+    int accepted;
+    int verify;
+    int corrupt;
+    int invalid;
+    cid_verifier_t verifier;
+    curl_off_t received;
+    curl_off_t resume_from;
+    int exclude;
+    int queued;
+    int throttled;
+    apr_time_t queued_at;
+    apr_time_t throttled_at;
+    apr_time_t started;
+    struct attempt *next;
+    char url[128];
+} attempt_t;
+
+struct download_info {
     char *cid;
     enum download_status *cid_download_status;
     config_t *config;
-} download_info_t;
+    download_t *download;
+    file_info_t *info;
+    stream_t *stream;
+    char *file_path;
+    int fd;
+    int64_t offset;
+    int64_t size;
+    int chunk;
+    int retries;
+    int hedged;
+    // The body matched its CID, so it is safe to keep in the cache
+    int verified;
+    // The trustless fetch gave up, so the CID is fetched whole instead
+    int dag_failed;
+    attempt_t *primary;
+    attempt_t *hedge;
+    // Set on the byte ranges of a split CID
+    download_info_t *whole;
+    int parts_pending;
+    int parts_failed;
+    // Singleflight: the leader downloads, followers wait for it to land
+    int leader;
+    flight_waiter_t waiter;
+    int landed;
+    int64_t landed_size;
+    download_info_t *next_landed;
+};
+
+typedef struct {
+    conn_t *conn;
+    gateways_t *gateways;
+    int gateway;
+} probe_info_t;
 
+struct download {
+    apr_pool_t *pool;
+    engine_t *engine;
+    conn_t *conn;
+    gateways_t *gateways;
+    cache_t *cache;
+    assembler_t *assembler;
+    sched_t *sched;
+    unsigned char *blocked;
+    dag_t *dag;
+    source_t **sources;
+    int num_sources;
+    pinner_t *pinner;
+    flight_t *flight;
+    apr_thread_mutex_t *landed_mutex;
+    download_info_t *landed;
+    int shared;
+    int local_misses;
+    attempt_t *queue_head;
+    // Batch number, and the scheduler slot it posts its waits in
+    int seq;
+    int slot;
+    int64_t dag_waiting;
+    // The track playing, or -1 before the batch starts playing
+    volatile apr_uint32_t playing;
+    // The most urgent transfer paused for tokens, posted to the scheduler
+    int64_t waiting_rank;
+    int preempted;
+    int invalid;
+    int cache_hits;
+    int cache_misses;
+    int cache_unknown;
+    int splits;
+    int parts;
+    config_t *config;
+    apr_thread_t *thread;
+    download_info_t **transfers;
+    int num_transfers;
+    int active_hedges;
+    int hedges_started;
+    int hedges_won;
+    int verified;
+    int rejected;
+    int unverified;
+    curl_off_t bytes;
+    curl_off_t wasted_bytes;
+    apr_time_t next_hedge_check;
+    apr_time_t start;
+    apr_time_t end;
+};
+
+// Names and CIDs belong to the resolved batch in the batch pool
 static void free_info(file_info_t *info) {
-    free(info->track_name);
-    free(info->album_path);
     free(info->filename);
     free(info->extension);
-    for (int j = 0; j < info->num_cids; ++j) {
-        free(info->cids[j]);
-    }
-    free(info->cids);
     free(info->cid_download_status);
 }
 
@@ -37,41 +174,29 @@ apr_status_t download_cleanup(void *data) {
     return APR_SUCCESS;
 }
 
-static void populate_file_status(file_downloaded_t *file_downloaded,
-                                 file_info_t *info, apr_pool_t *pool) {
-    file_downloaded->file_download_status = info->file_download_status;
-    file_downloaded->track_id = info->track_id;
-    if (info->file_download_status == DOWNLOAD_SUCCEEDED) {
-        file_downloaded->filename = apr_pstrdup(pool, info->filename);
-        file_downloaded->album_path = apr_pstrdup(pool, info->album_path);
-        file_downloaded->track_name = apr_pstrdup(pool, info->track_name);
-        file_downloaded->extension = apr_pstrdup(pool, info->extension);
-    }
-}
+static void init_file_info(file_info_t *info, int position,
+                           catalog_track_t *track, config_t *config) {
+    int num_cids = track->num_cids;
 
-file_downloaded_t *downloaded_files(apr_pool_t *pool, file_info_t *infos,
-                                    config_t *config) {
-    file_downloaded_t *file_downloaded =
-        apr_palloc(pool, config->num_files * sizeof(file_downloaded_t));
-    for (int i = 0; i < config->num_files; ++i) {
-        populate_file_status(&file_downloaded[i], &infos[i], pool);
+    if (!track->track_name) {
+        log_trace("download_init: Track %d is not in the catalog",
+                  track->track_id);
+        exit(-1);
     }
-    return file_downloaded;
-}
-
-static void init_file_info(file_info_t *info, int index, sqlite3 *db,
-                           config_t *config) {
-    int num_cids;
-
-    info->track_name = database_get_track_name(db, index);
-    info->album_path = database_get_album(db, index);
+    info->track_name = track->track_name;
+    info->album_path = track->album_path;
     info->filename = util_get_filename_with_extension(info->track_name);
     info->extension = util_get_extension(info->track_name);
-    info->cids = database_get_cids(db, index, &num_cids);
+    info->cids = track->cids;
     info->num_cids = num_cids;
-    info->track_id = index;
+    info->position = position;
+    info->track_id = track->track_id;
     info->config = config;
     info->file_download_status = DOWNLOAD_PENDING;
+    info->stream = NULL;
+    info->sizes = track->sizes;
+    info->fd = -1;
+    info->ready = NULL;
 
     info->cid_download_status =
         (enum download_status *)malloc(num_cids * sizeof(enum download_status));
@@ -85,16 +210,46 @@ static void init_file_info(file_info_t *info, int index, sqlite3 *db,
     }
 }
 
-void download_init(file_info_t *infos, config_t *config, sqlite3 *db) {
+// CIDs found in the cache are linked into the output directory and never
+// scheduled for download. A CID that an earlier track of the batch already
+// found there is shared with it.
+static void lookup_cached(file_info_t *info, cache_t *cache) {
+    for (int j = 0; j < info->num_cids; ++j) {
+        char *cid_path =
+            util_get_file_path(info->config->output, info->cids[j]);
+        if (access(cid_path, F_OK) == 0 ||
+            cache_lookup(cache, info->cids[j], cid_path) >= 0) {
+            log_trace("download_init: %s found in cache", info->cids[j]);
+            info->cid_download_status[j] = DOWNLOAD_SUCCEEDED;
+        }
+        free(cid_path);
+    }
+}
+
+// Tracks come from the catalog-wide shuffle or, with `"selection":
+// "weighted"`, are drawn by weight. The whole batch is resolved with one
+// catalog query.
+void download_init(apr_pool_t *pool, file_info_t *infos, config_t *config,
+                   context_t *context) {
     log_trace("download_init: start");
-    int *random_index = util_random_ints(config->num_files, config->min_value,
-                                         config->num_tracks);
+    int *track_ids = apr_palloc(pool, config->num_files * sizeof(int));
+    if (strcmp(config->selection, "weighted") == 0) {
+        picker_draw(context->picker, config, track_ids, config->num_files);
+        picker_log(context->picker);
+    } else {
+        shuffle_draw(context->shuffle, config->min_value, config->num_tracks,
+                     track_ids, config->num_files);
+        shuffle_log(context->shuffle);
+    }
+    catalog_batch_t *batch = catalog_resolve(context->catalog, pool,
+                                             track_ids, config->num_files);
 
+    cache_sync(context->cache, config);
     for (int i = 0; i < config->num_files; ++i) {
-        init_file_info(&infos[i], random_index[i], db, config);
+        init_file_info(&infos[i], i, &batch->tracks[i], config);
+        lookup_cached(&infos[i], context->cache);
     }
 
-    free(random_index);
     log_trace("download_init: finish");
 }
 
@@ -107,293 +262,1708 @@ static FILE *open_file_write(const char *file_path) {
     return fp;
 }
 
-static void set_curl_opts(CURL *curl, char *url, download_info_t *download_info,
-                          int retries) {
-    if (strlen(download_info->cid) == 59) {
-        snprintf(url, 128, "https://%s.ipfs.nftstorage.link",
-                 download_info->cid);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT,
-                         2 * download_info->config->timeout);
+// Transfers give up when they stall rather than after a fixed total time,
+// so large chunks are not cut off while they are still making progress.
+// Paused transfers are exempt from the low speed check.
+static void set_timeout(CURL *curl, attempt_t *attempt, long timeout) {
+    config_t *config = attempt->download_info->config;
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, timeout);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)config->stall_speed);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, timeout);
+}
+
+// A part of a split CID asks for the rest of its own byte range
+static void set_range(CURL *curl, attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
+    char range[64];
+
+    attempt->resume_from = download_info->offset + attempt->received;
+    snprintf(range, sizeof(range), "%lld-%lld",
+             (long long)attempt->resume_from,
+             (long long)(download_info->offset + download_info->size - 1));
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+}
+
+static void set_curl_opts(CURL *curl, attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
+    download_t *download = download_info->download;
+    source_t *source = download->sources[attempt->source];
+    const char *host = attempt->gateway >= 0
+                           ? gateway_host(download->gateways, attempt->gateway)
+                           : NULL;
+
+    source_url(source, download_info->cid, host, attempt->url,
+               sizeof(attempt->url));
+    set_timeout(curl, attempt,
+                source_timeout(source, download_info->config->timeout));
+    source_prepare(source, curl);
+    curl_easy_setopt(curl, CURLOPT_URL, attempt->url);
+
+    // Continue after the bytes an earlier attempt already wrote
+    attempt->resume_from = attempt->received;
+    attempt->checked = 0;
+    attempt->accepted = 0;
+    attempt->paused = 0;
+    attempt->throttled = 0;
+    if (download_info->whole) {
+        set_range(curl, attempt);
     } else {
-        int *random_index =
-            util_random_ints(1, 0, download_info->config->num_gateways - 1);
-        snprintf(url, 128, "https://%s/%s",
-                 download_info->config->gateways[*random_index],
-                 download_info->cid);
-        free(random_index);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, download_info->config->timeout);
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE,
+                         attempt->resume_from);
+    }
+    attempt->started = apr_time_now();
+    if (attempt->resume_from > 0) {
+        log_trace("download_cid: resuming from %s at byte "
+                  "%" CURL_FORMAT_CURL_OFF_T,
+                  attempt->url, attempt->resume_from);
+    } else {
+        log_trace("download_cid: downloading from %s", attempt->url);
     }
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    log_trace("download_cid: downloading from %s", url);
 }
 
-static size_t write_callback(void *ptr, size_t size, size_t nmemb,
-                             FILE *stream) {
-    return fwrite(ptr, size, nmemb, stream);
+static void record_gateway(CURL *curl, gateways_t *gateways, int gateway,
+                           int succeeded) {
+    curl_off_t ttfb_us = 0;
+    curl_off_t speed = 0;
+
+    if (gateway < 0) {
+        return;
+    }
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &ttfb_us);
+    curl_easy_getinfo(curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    gateway_record(gateways, gateway, succeeded,
+                   (double)ttfb_us / APR_USEC_PER_SEC, (double)speed);
 }
 
-static void perform_curl_download(CURL *curl, FILE *fp,
-                                  download_info_t *download_info) {
-    int retries = 0;
-    CURLcode res;
-    long response_code;
-    char url[128];
+// Public path gateways serve CIDs as octet-streams, anything else there is
+// an error page. Subdomain and local gateways sniff the real type.
+static int is_body_ok(attempt_t *attempt, long response_code) {
+    download_t *download = attempt->download_info->download;
     char *content_type = NULL;
 
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-
-    do {
-        set_curl_opts(curl, url, download_info, retries);
-        res = curl_easy_perform(curl);
-
-        if (res == CURLE_OK) {
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
-            if (response_code == 200 &&
-                (strlen(download_info->cid) == 59 ||
-                 (content_type &&
-                  strcmp(content_type, "application/octet-stream") == 0))) {
-
-                *(download_info->cid_download_status) = DOWNLOAD_SUCCEEDED;
-                log_trace("download_cid: finish downloading %s",
-                          download_info->cid);
-                fprintf(stdout, "Finish downloading %s\n", download_info->cid);
-                break;
-            }
-        }
+    curl_easy_getinfo(attempt->curl, CURLINFO_CONTENT_TYPE, &content_type);
+    return (response_code == 200 || response_code == 206) &&
+           (!source_uses_gateways(download->sources[attempt->source]) ||
+            (content_type &&
+             strcmp(content_type, "application/octet-stream") == 0));
+}
 
-        log_trace("download_cid: Retry to download %s (attempt %d)",
-                  download_info->cid, retries + 1);
-        retries++;
-        rewind(fp);
-    } while (retries < download_info->config->max_retries);
+static int range_start_ok(CURL *curl, curl_off_t resume_from) {
+    struct curl_header *header = NULL;
+    curl_off_t start = -1;
 
-    if (res != CURLE_OK || response_code != 200) {
-        log_trace("download_cid: Download of cid %s failed after %d tries",
-                  download_info->cid, retries + 1);
-        *(download_info->cid_download_status) = DOWNLOAD_FAILED;
+    if (curl_easy_header(curl, "Content-Range", 0, CURLH_HEADER, -1,
+                         &header) != CURLHE_OK ||
+        sscanf(header->value, "bytes %" CURL_FORMAT_CURL_OFF_T "-",
+               &start) != 1) {
+        return 0;
     }
+    return start == resume_from;
 }
 
-static void *APR_THREAD_FUNC download_cid(apr_thread_t *thd, void *data) {
-    download_info_t *download_info = (download_info_t *)data;
+// Cache status headers set by common gateway CDNs and proxies. Values
+// start with HIT or MISS, give or take case and trailing detail.
+static const char *cache_headers[] = {"CF-Cache-Status", "X-Cache",
+                                      "X-Cache-Status", "X-Proxy-Cache"};
 
-    fprintf(stdout, "Downloading %s\n", download_info->cid);
-    log_trace("download_cid: start downloading %s", download_info->cid);
-    fflush(stdout);
+// Returns 1 for a cache hit, 0 for a miss and -1 when the gateway does not
+// say. A positive Age means the response came out of a cache.
+static int cache_status(CURL *curl) {
+    struct curl_header *header = NULL;
 
-    CURL *curl = curl_easy_init();
+    for (size_t i = 0; i < sizeof(cache_headers) / sizeof(cache_headers[0]);
+         ++i) {
+        if (curl_easy_header(curl, cache_headers[i], 0, CURLH_HEADER, -1,
+                             &header) != CURLHE_OK) {
+            continue;
+        }
+        if (strncasecmp(header->value, "hit", 3) == 0 ||
+            strncasecmp(header->value, "stale", 5) == 0 ||
+            strncasecmp(header->value, "revalidated", 11) == 0) {
+            return 1;
+        }
+        if (strncasecmp(header->value, "miss", 4) == 0 ||
+            strncasecmp(header->value, "expired", 7) == 0) {
+            return 0;
+        }
+    }
+    if (curl_easy_header(curl, "Age", 0, CURLH_HEADER, -1, &header) ==
+            CURLHE_OK &&
+        atol(header->value) > 0) {
+        return 1;
+    }
+    return -1;
+}
 
-    if (!curl) {
-        log_trace("download_cid: Failed to create curl handle");
-        exit(-1);
+static void record_cache(download_t *download, attempt_t *attempt) {
+    int status = cache_status(attempt->curl);
+    if (status < 0) {
+        download->cache_unknown++;
+        return;
+    }
+    if (status) {
+        download->cache_hits++;
+    } else {
+        download->cache_misses++;
     }
+    gateway_record_cache(download->gateways, attempt->gateway, status);
+}
 
-    char *file_path =
-        util_get_file_path(download_info->config->output, download_info->cid);
-    FILE *fp = open_file_write(file_path);
-    perform_curl_download(curl, fp, download_info);
+// Drop everything an attempt has written so far. The stream forgets the
+// bytes before the file loses them, so the reader waits for them again
+// instead of reading past the end.
+static void restart_attempt(attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
 
-    fclose(fp);
-    free(file_path);
-    curl_easy_cleanup(curl);
-    return NULL;
+    if (download_info->stream && !attempt->hedge) {
+        stream_reset(download_info->stream, download_info->chunk);
+    }
+    if (attempt->fp) {
+        fflush(attempt->fp);
+        rewind(attempt->fp);
+        if (ftruncate(fileno(attempt->fp), 0) != 0) {
+            log_trace("download_cid: Failed to truncate %s",
+                      attempt->file_path);
+        }
+    }
+    attempt->received = 0;
+    attempt->resume_from = 0;
+    attempt->corrupt = 0;
+    if (attempt->verify) {
+        cid_verifier_reset(&attempt->verifier);
+    }
 }
 
-static apr_thread_pool_t *create_pool(apr_pool_t *pool, config_t *config) {
-    apr_thread_pool_t *thread_pool;
-    apr_status_t status;
+// Error pages must never reach the CID file or the decoder, and a resumed
+// body has to start exactly where the file ends
+static int accept_body(attempt_t *attempt) {
+    long response_code = 0;
 
-    apr_size_t ncores = 2;
-    status = apr_thread_pool_create(&thread_pool, config->num_files, 4 * ncores,
-                                    pool);
-    if (status != APR_SUCCESS) {
-        log_trace("Failed to create thread pool");
-        exit(-1);
+    curl_easy_getinfo(attempt->curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (!is_body_ok(attempt, response_code)) {
+        return 0;
+    }
+    if (attempt->download_info->whole) {
+        if (response_code != 206) {
+            log_trace("download_cid: %s ignored the range for a part of %s",
+                      attempt->url, attempt->download_info->cid);
+            return 0;
+        }
+        return range_start_ok(attempt->curl, attempt->resume_from);
+    }
+    if (attempt->resume_from == 0) {
+        return response_code == 200;
+    }
+    if (response_code == 200) {
+        log_trace("download_cid: %s ignored the range, restarting %s",
+                  attempt->url, attempt->download_info->cid);
+        restart_attempt(attempt);
+        return 1;
+    }
+    return range_start_ok(attempt->curl, attempt->resume_from);
+}
+
+// Size of the body a complete transfer ends up with, or -1 when the catalog
+// does not know it
+static int64_t expected_size(download_info_t *download_info) {
+    file_info_t *info = download_info->info;
+
+    if (download_info->offset >= 0) {
+        return download_info->size;
     }
+    if (info->sizes && info->sizes[download_info->chunk] > 0) {
+        return info->sizes[download_info->chunk];
+    }
+    return -1;
+}
 
-    return thread_pool;
+static int reject_body(attempt_t *attempt, const char *reason) {
+    log_trace("download_cid: rejecting %s from %s: %s",
+              attempt->download_info->cid, attempt->url, reason);
+    attempt->invalid = 1;
+    return 0;
 }
 
-static void push_task(apr_thread_pool_t *thread_pool, file_info_t *info,
-                      int cid_index, apr_pool_t *pool) {
-    download_info_t *download_info = apr_palloc(pool, sizeof(download_info_t));
-    download_info->cid = info->cids[cid_index];
-    download_info->cid_download_status =
-        &(info->cid_download_status[cid_index]);
-    download_info->config = info->config;
+// Runs on the first bytes of an accepted body, so an error page, a
+// captcha or a body of the wrong length fails over straight away instead
+// of after the whole transfer
+static int validate_body(attempt_t *attempt, const void *data, size_t len) {
+    download_info_t *download_info = attempt->download_info;
+    int64_t expected = expected_size(download_info);
+    curl_off_t length = -1;
 
-    apr_status_t status =
-        apr_thread_pool_push(thread_pool, download_cid, download_info, 0, NULL);
-    if (status != APR_SUCCESS) {
-        log_trace("Failed to push task to thread pool for cid %s",
-                  info->cids[cid_index]);
-        exit(-1);
+    curl_easy_getinfo(attempt->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &length);
+    if (expected >= 0 && length >= 0 &&
+        length != expected - attempt->received) {
+        return reject_body(attempt, "unexpected Content-Length");
+    }
+    if (sniff_html(data, len) == SNIFF_MATCH) {
+        return reject_body(attempt, "HTML body");
     }
+    // Only the first bytes of a track carry its container magic
+    if (download_info->chunk == 0 && download_info->offset <= 0 &&
+        attempt->received == 0 &&
+        sniff_magic(download_info->info->extension, data, len) ==
+            SNIFF_MISMATCH) {
+        return reject_body(attempt, "wrong container magic");
+    }
+    return 1;
 }
 
-static void wait_tasks(apr_thread_pool_t *thread_pool) {
-    while (apr_thread_pool_tasks_count(thread_pool) > 0) {
-        apr_sleep(apr_time_from_sec(1));
+// Direct chunks land at their offset in the preallocated track file. Only
+// the primary attempt writes there; a hedge has a file of its own that is
+// copied into place if it wins, since a body that cannot be verified as it
+// arrives must not overwrite bytes the other attempt already wrote.
+static size_t write_direct(attempt_t *attempt, void *ptr, size_t size) {
+    download_info_t *download_info = attempt->download_info;
+
+    if (attempt->received + (int64_t)size > download_info->size) {
+        log_trace("download_cid: %s is larger than %lld bytes",
+                  download_info->cid, (long long)download_info->size);
+        return 0;
+    }
+    ssize_t written = pwrite(download_info->fd, ptr, size,
+                             download_info->offset + attempt->received);
+    if (written < 0) {
+        log_trace("download_cid: Failed to write %s", download_info->cid);
+        return 0;
+    }
+    if (attempt->verify) {
+        cid_verifier_update(&attempt->verifier, ptr, written);
     }
+    attempt->received += written;
+    return written;
 }
 
-static void log_duration(apr_time_t start) {
-    apr_time_t end = apr_time_now();
-    apr_time_t diff_usec = end - start;
-    double elapsed_time = (double)diff_usec / APR_USEC_PER_SEC;
-    log_trace("Downloading took %.3f seconds", elapsed_time);
-    fprintf(stdout, "%s %.3f seconds\n", "Downloading took", elapsed_time);
+static int64_t attempt_rank(attempt_t *attempt);
+
+static size_t write_callback(void *ptr, size_t size, size_t nmemb,
+                             void *userdata) {
+    attempt_t *attempt = (attempt_t *)userdata;
+    download_info_t *download_info = attempt->download_info;
+    // Hedges write to their own file and only reach the stream if they win
+    int streamed = download_info->stream && !attempt->hedge;
+
+    if (!attempt->checked) {
+        attempt->checked = 1;
+        attempt->accepted = accept_body(attempt) &&
+                            validate_body(attempt, ptr, size * nmemb);
+    }
+    // Abort instead of draining a body that is going to be thrown away
+    if (!attempt->accepted) {
+        return 0;
+    }
+
+    if (streamed &&
+        stream_should_pause(download_info->stream, download_info->chunk)) {
+        attempt->paused = 1;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    // A paused transfer gets the same data again once it resumes, so the
+    // bucket is only charged for data that is written now. While bandwidth
+    // is short, it also stands aside for any more urgent transfer of any
+    // batch that the shaper is holding back.
+    if (!sched_consume(download_info->download->sched, attempt_rank(attempt),
+                       size * nmemb)) {
+        attempt->throttled = 1;
+        attempt->throttled_at = apr_time_now();
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if (!attempt->fp) {
+        return write_direct(attempt, ptr, size * nmemb);
+    }
+
+    size_t written = fwrite(ptr, size, nmemb, attempt->fp);
+    if (attempt->verify) {
+        cid_verifier_update(&attempt->verifier, ptr, written * size);
+    }
+    attempt->received += written * size;
+    if (streamed) {
+        fflush(attempt->fp);
+        stream_write(download_info->stream, download_info->chunk,
+                     written * size);
+    }
+    return written;
 }
 
-void download_files(apr_pool_t *pool, file_info_t *infos, config_t *config) {
-    log_trace("download_files: start");
+static int is_response_ok(attempt_t *attempt, CURLcode res) {
+    if (res != CURLE_OK) {
+        log_trace("download_cid: %s: %s", attempt->download_info->cid,
+                  curl_easy_strerror(res));
+        return 0;
+    }
+    // Empty bodies never go through write_callback
+    if (!attempt->checked) {
+        attempt->checked = 1;
+        attempt->accepted =
+            accept_body(attempt) && validate_body(attempt, NULL, 0);
+    }
+    int64_t expected = expected_size(attempt->download_info);
+    if (attempt->accepted && expected >= 0 && attempt->received != expected) {
+        log_trace("download_cid: %s has %lld bytes, expected %lld",
+                  attempt->download_info->cid, (long long)attempt->received,
+                  (long long)expected);
+        return 0;
+    }
+    if (attempt->accepted && attempt->verify &&
+        !cid_verifier_check(&attempt->verifier)) {
+        log_trace("download_cid: %s from %s does not match its hash",
+                  attempt->download_info->cid, attempt->url);
+        attempt->corrupt = 1;
+        attempt->download_info->download->rejected++;
+        return 0;
+    }
+    return attempt->accepted;
+}
 
-    apr_pool_t *subpool;
-    apr_pool_create(&subpool, pool);
+// Returns the first source after `from` that will serve the CID, or -1
+static int next_source(download_t *download, const char *cid, int from) {
+    for (int i = from + 1; i < download->num_sources; ++i) {
+        if (source_accepts(download->sources[i], cid)) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    apr_thread_pool_t *thread_pool = create_pool(subpool, config);
-    apr_time_t start = apr_time_now();
+static attempt_t *open_attempt(download_info_t *download_info, int hedge) {
+    download_t *download = download_info->download;
+    attempt_t *attempt = apr_pcalloc(download->pool, sizeof(attempt_t));
+    attempt->download_info = download_info;
+    attempt->hedge = hedge;
+    attempt->source = hedge ? download_info->primary->source
+                            : next_source(download, download_info->cid, -1);
+    // Parts only see a slice of the CID, which is checked once it is whole
+    attempt->verify = !download_info->whole &&
+                      cid_verifier_init(&attempt->verifier, download_info->cid);
+    if (download_info->offset < 0) {
+        attempt->file_path =
+            hedge ? apr_pstrcat(download->pool, download_info->file_path,
+                                ".hedge", NULL)
+                  : download_info->file_path;
+        attempt->fp = open_file_write(attempt->file_path);
+    } else if (hedge) {
+        // Parts of one CID share its file path
+        attempt->file_path =
+            apr_psprintf(download->pool, "%s.%lld.hedge",
+                         download_info->file_path,
+                         (long long)download_info->offset);
+        attempt->fp = open_file_write(attempt->file_path);
+    }
+    attempt->curl = conn_acquire(download->conn);
 
-    for (int i = 0; i < config->num_files; ++i) {
-        for (int j = 0; j < infos[i].num_cids; ++j) {
-            push_task(thread_pool, &infos[i], j, subpool);
+    curl_easy_setopt(attempt->curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(attempt->curl, CURLOPT_WRITEDATA, attempt);
+    return attempt;
+}
+
+static void close_attempt(attempt_t *attempt, int remove_file) {
+    download_info_t *download_info = attempt->download_info;
+
+    if (attempt->fp) {
+        fclose(attempt->fp);
+        if (remove_file) {
+            remove(attempt->file_path);
         }
     }
+    conn_release(download_info->download->conn, attempt->curl);
 
-    wait_tasks(thread_pool);
-    log_duration(start);
-    apr_thread_pool_destroy(thread_pool);
-    apr_pool_destroy(subpool);
-    log_trace("download_files: finish");
+    if (download_info->primary == attempt) {
+        download_info->primary = NULL;
+    } else {
+        download_info->hedge = NULL;
+        download_info->download->active_hedges--;
+    }
 }
 
-static int is_download_successful(file_info_t *info) {
-    for (int j = 0; j < info->num_cids; ++j) {
-        if (info->cid_download_status[j] != DOWNLOAD_SUCCEEDED) {
-            info->file_download_status = DOWNLOAD_FAILED;
+// Streamed tracks play from their CID files, all others are assembled as
+// soon as their last CID has finished and become ready once that is done
+static void finish_track(download_t *download, file_info_t *info) {
+    if (download->assembler) {
+        assemble_submit(download->assembler, info);
+    } else {
+        future_set(info->ready);
+    }
+}
+
+static void finish_part(download_info_t *part, enum download_status status);
+
+static void finish_cid(download_info_t *download_info,
+                       enum download_status status) {
+    if (download_info->whole) {
+        finish_part(download_info, status);
+        return;
+    }
+    *(download_info->cid_download_status) = status;
+    if (download_info->leader) {
+        download_info->leader = 0;
+        flight_land(download_info->download->flight, download_info->cid,
+                    status == DOWNLOAD_SUCCEEDED, download_info);
+    }
+    if (download_info->stream) {
+        stream_finish(download_info->stream, download_info->chunk,
+                      status == DOWNLOAD_SUCCEEDED);
+    }
+    if (--download_info->info->num_pending == 0) {
+        finish_track(download_info->download, download_info->info);
+    }
+}
+
+static void download_cid_done(engine_t *engine, CURL *curl, CURLcode res,
+                              void *data);
+
+// Each part of a split CID has a key and a preferred gateway of its own,
+// so the parts still spread over several gateways
+static int pick_gateway(attempt_t *attempt, int exclude,
+                        const unsigned char *blocked) {
+    download_info_t *download_info = attempt->download_info;
+    download_t *download = download_info->download;
+    char key[CID_MAX_TEXT + 32];
+
+    if (!download_info->config->gateway_affinity) {
+        return gateway_pick(download->gateways, exclude, blocked);
+    }
+    if (download_info->whole) {
+        snprintf(key, sizeof(key), "%s/%lld", download_info->cid,
+                 (long long)download_info->offset);
+    } else {
+        snprintf(key, sizeof(key), "%s", download_info->cid);
+    }
+    return gateway_pick_for(download->gateways, key, exclude, blocked);
+}
+
+// Picks a gateway with room in its budgets, preferring one other than
+// `exclude` for retries and hedges. Returns 0 while the concurrency window
+// or all of the gateways are full.
+static int launch_attempt(download_t *download, attempt_t *attempt) {
+    apr_time_t now = apr_time_now();
+
+    if (!sched_admit(download->sched, attempt_rank(attempt))) {
+        return 0;
+    }
+    if (!source_uses_gateways(download->sources[attempt->source])) {
+        attempt->gateway = -1;
+    } else {
+        unsigned char *blocked = download->blocked;
+        sched_blocked(download->sched, blocked, download->config->num_gateways);
+        attempt->gateway = pick_gateway(attempt, attempt->exclude, blocked);
+        if (attempt->gateway < 0 && attempt->exclude >= 0) {
+            attempt->gateway = pick_gateway(attempt, -1, blocked);
+        }
+        if (attempt->gateway < 0) {
             return 0;
         }
     }
-    info->file_download_status = DOWNLOAD_SUCCEEDED;
+    sched_acquire(download->sched, attempt->gateway, now - attempt->queued_at);
+
+    set_curl_opts(attempt->curl, attempt);
+    engine_add(download->engine, attempt->curl, download_cid_done, attempt);
     return 1;
 }
 
-static void log_assembly(file_info_t *info) {
-    log_trace("assemble: start assembling %s", info->filename);
-    fprintf(stdout, "%-*s: %s\n", WIDTH + 2, "Assemble", info->filename);
-    log_trace("assemble: track: %d / %d", info->track_id,
-              info->config->num_tracks);
-    fprintf(stdout, "  %-*s: %d / %d\n", WIDTH, "track", info->track_id,
-            info->config->num_tracks);
-    log_trace("assemble: path: %s", info->album_path);
-    fprintf(stdout, "  %-*s: %s\n", WIDTH, "path", info->album_path);
-    log_trace("assemble: filename: %s", info->track_name);
-    fprintf(stdout, "  %-*s: %s\n", WIDTH, "filename", info->track_name);
-
-    if (info->num_cids == 1) {
-        log_trace("assemble: info: %s -> %s", info->cids[0], info->filename);
-        fprintf(stdout, "  %-*s: %s -> %s\n", WIDTH, "info", info->cids[0],
-                info->filename);
+// Lower ranks are more urgent. Batches are ranked by how far they are from
+// the one playing, tracks by how far they are from the track playing, and
+// chunks by their order within the track, so ranks compare across batches
+// and are re-evaluated as playback advances. A batch that has not started
+// playing counts its first track as one away. Hedges share the rank of
+// their CID.
+static int64_t info_rank(download_info_t *download_info) {
+    download_t *download = download_info->download;
+    int64_t batch = download->seq - sched_playing(download->sched);
+    int64_t playing = (int32_t)apr_atomic_read32(&download->playing);
+    int64_t distance = playing < 0 ? download_info->info->position + 1
+                                   : download_info->info->position - playing;
+
+    return ((batch > 0 ? batch : 0) << RANK_BATCH_SHIFT) +
+           ((distance > 0 ? distance : 0) << RANK_TRACK_SHIFT) +
+           download_info->chunk;
+}
+
+static int64_t attempt_rank(attempt_t *attempt) {
+    return info_rank(attempt->download_info);
+}
+
+static int is_playing_rank(int64_t rank) {
+    return rank >> RANK_TRACK_SHIFT == 0;
+}
+
+static int is_playing(attempt_t *attempt) {
+    return is_playing_rank(attempt_rank(attempt));
+}
+
+static int64_t dag_rank(void *data) {
+    return info_rank((download_info_t *)data);
+}
+
+// Tracks only ever move closer to the one playing, which keeps the queue in
+// rank order without re-sorting it
+static void enqueue_attempt(download_t *download, attempt_t *attempt) {
+    int64_t rank = attempt_rank(attempt);
+    attempt_t **link = &download->queue_head;
+    while (*link && attempt_rank(*link) <= rank) {
+        link = &(*link)->next;
+    }
+    attempt->next = *link;
+    *link = attempt;
+    attempt->queued = 1;
+    attempt->queued_at = apr_time_now();
+    engine_hold(download->engine);
+}
+
+static void unqueue_attempt(download_t *download, attempt_t *attempt) {
+    attempt_t **link = &download->queue_head;
+    while (*link && *link != attempt) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = attempt->next;
+        attempt->next = NULL;
+        attempt->queued = 0;
+        engine_unhold(download->engine);
+    }
+}
+
+static int is_running(attempt_t *attempt) {
+    return attempt && !attempt->queued;
+}
+
+// The least urgent running transfer, if it ranks below `rank`, which may
+// belong to another batch
+static attempt_t *find_victim(download_t *download, int64_t rank) {
+    attempt_t *victim = NULL;
+    int64_t victim_rank = rank;
+
+    for (int i = 0; i < download->num_transfers; ++i) {
+        download_info_t *download_info = download->transfers[i];
+        attempt_t *primary = download_info->primary;
+        if (!is_running(primary) || download_info->hedge ||
+            is_playing(primary)) {
+            continue;
+        }
+        if (attempt_rank(primary) > victim_rank) {
+            victim = primary;
+            victim_rank = attempt_rank(primary);
+        }
+    }
+    return victim;
+}
+
+// Sends a running transfer back to the queue. It resumes with a Range
+// request once it is launched again.
+static void preempt(download_t *download, attempt_t *victim,
+                    const char *cid) {
+    log_trace("download_cid: preempting %s for %s", victim->url, cid);
+    if (victim->fp) {
+        fflush(victim->fp);
+    }
+    download->preempted++;
+    enqueue_attempt(download, victim);
+    victim->exclude = -1;
+    engine_remove(download->engine, victim->curl);
+    sched_release(download->sched, victim->gateway);
+}
+
+// When the track that is playing waits for a slot in the concurrency window
+// or on a gateway, the least urgent transfer of its batch gives up its slot
+static int preempt_for(download_t *download, attempt_t *attempt) {
+    int64_t rank = attempt_rank(attempt);
+    if (!is_playing_rank(rank) ||
+        (download->config->gateway_max_connections <= 0 &&
+         sched_admit(download->sched, rank))) {
+        return 0;
+    }
+    attempt_t *victim = find_victim(download, rank);
+    if (!victim) {
+        return 0;
+    }
+    preempt(download, victim, attempt->download_info->cid);
+    return 1;
+}
+
+// A track playing in another batch that waits for a slot takes one from
+// the least urgent transfer of this batch, a slot per tick
+static void yield_to_playing(download_t *download) {
+    int64_t rank = sched_window_waiter(download->sched);
+    if (rank == SCHED_IDLE || !is_playing_rank(rank) ||
+        download->seq == sched_playing(download->sched)) {
+        return;
+    }
+    attempt_t *victim = find_victim(download, rank);
+    if (victim) {
+        preempt(download, victim, "another batch");
+    }
+}
+
+// Attempts start in rank order. What is left waiting, here or in the DAG
+// fetcher, is posted for the other batches to stand aside for.
+static void drain_queue(download_t *download) {
+    int64_t waiting = download->dag_waiting;
+    while (download->queue_head) {
+        attempt_t *attempt = download->queue_head;
+        if (!launch_attempt(download, attempt) &&
+            !(preempt_for(download, attempt) &&
+              launch_attempt(download, attempt))) {
+            int64_t rank = attempt_rank(attempt);
+            waiting = rank < waiting ? rank : waiting;
+            break;
+        }
+        download->queue_head = attempt->next;
+        attempt->next = NULL;
+        attempt->queued = 0;
+        engine_unhold(download->engine);
+    }
+    sched_wait_window(download->sched, download->slot, waiting);
+}
+
+static void start_attempt(download_t *download, attempt_t *attempt,
+                          int exclude) {
+    attempt->exclude = exclude;
+    enqueue_attempt(download, attempt);
+    drain_queue(download);
+}
+
+// The loser of a hedge race is dropped without a completion callback
+static void cancel_attempt(engine_t *engine, attempt_t *attempt) {
+    download_t *download = attempt->download_info->download;
+    download->wasted_bytes += attempt->received;
+
+    log_trace("download_cid: cancel %s from %s",
+              attempt->download_info->cid, attempt->url);
+    if (attempt->queued) {
+        unqueue_attempt(download, attempt);
     } else {
-        log_trace("assemble: info: %d CIDs -> %s", info->num_cids,
-                  info->filename);
-        fprintf(stdout, "  %-*s: %d CIDs -> %s\n", WIDTH, "info",
-                info->num_cids, info->filename);
+        engine_remove(engine, attempt->curl);
+        sched_release(download->sched, attempt->gateway);
+    }
+    close_attempt(attempt, attempt->hedge);
+}
+
+static void cid_succeeded(download_info_t *download_info) {
+    download_t *download = download_info->download;
+
+    if (download_info->whole) {
+        finish_part(download_info, DOWNLOAD_SUCCEEDED);
+        return;
     }
 
-    fprintf(stdout, "\n");
-    fflush(stdout);
+    log_trace("download_cid: finish downloading %s", download_info->cid);
+    // Nothing vouches for an unverified body beyond this playback, so it
+    // stays out of the cache
+    if (download_info->verified && download_info->offset >= 0) {
+        cache_insert_range(download->cache, download_info->cid,
+                           download_info->info->fd, download_info->offset,
+                           download_info->size);
+    } else if (download_info->verified) {
+        cache_insert(download->cache, download_info->cid,
+                     download_info->file_path);
+    }
+    finish_cid(download_info, DOWNLOAD_SUCCEEDED);
 }
 
-static void append_cid_output(char *filename, char *cid, FILE *outfile,
-                              char *buffer, config_t *config) {
-    char *cid_path = util_get_file_path(config->output, cid);
+// Hashes a reassembled split CID, when its CID allows it
+static int verify_whole(download_info_t *whole) {
+    download_t *download = whole->download;
+    cid_verifier_t verifier;
+    char buffer[VERIFY_BUFFER_SIZE];
 
-    FILE *infile = fopen(cid_path, "rb");
-    if (!infile) {
-        log_trace("assemble: Failed to open file %s", cid_path);
-        exit(-1);
+    if (!cid_verifier_init(&verifier, whole->cid)) {
+        download->unverified++;
+        return 1;
+    }
+    for (int64_t pos = 0; pos < whole->size;) {
+        size_t len = whole->size - pos < (int64_t)sizeof(buffer)
+                         ? (size_t)(whole->size - pos)
+                         : sizeof(buffer);
+        ssize_t n = pread(whole->fd, buffer, len, pos);
+        if (n <= 0) {
+            log_trace("download_cid: Failed to read back %s", whole->cid);
+            return 0;
+        }
+        cid_verifier_update(&verifier, buffer, n);
+        pos += n;
+    }
+    if (!cid_verifier_check(&verifier)) {
+        log_trace("download_cid: %s does not match its hash", whole->cid);
+        download->rejected++;
+        return 0;
     }
+    download->verified++;
+    whole->verified = 1;
+    return 1;
+}
 
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, 4096, infile)) > 0) {
-        fwrite(buffer, 1, bytes_read, outfile);
+// The CID is done once its last part is. A part that failed after all of
+// its retries fails the CID.
+static void finish_part(download_info_t *part, enum download_status status) {
+    download_info_t *whole = part->whole;
+
+    if (status != DOWNLOAD_SUCCEEDED) {
+        whole->parts_failed++;
+    }
+    if (--whole->parts_pending > 0) {
+        return;
     }
 
-    fclose(infile);
-    log_trace("assemble: %s -> %s", cid, filename);
+    int succeeded = !whole->parts_failed && verify_whole(whole);
+    close(whole->fd);
+    if (!succeeded) {
+        log_trace("download_cid: Split download of %s failed", whole->cid);
+        finish_cid(whole, DOWNLOAD_FAILED);
+        return;
+    }
+    cid_succeeded(whole);
+}
 
-    if (remove(cid_path) != 0) {
-        log_trace("assemble: Failed to delete file %s", cid_path);
-        exit(-1);
+// Copies the body of a winning hedge of a direct chunk to its range of the
+// track file
+static int place_hedge(attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
+    int in = open(attempt->file_path, O_RDONLY);
+    int succeeded =
+        in >= 0 && copy_fd(in, 0, download_info->fd, download_info->offset,
+                           attempt->received, COPY_REFLINK) != COPY_FAILED;
+    if (in >= 0) {
+        close(in);
     }
+    remove(attempt->file_path);
+    return succeeded;
+}
 
-    free(cid_path);
+static void win_attempt(engine_t *engine, attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
+    download_t *download = download_info->download;
+    attempt_t *other =
+        attempt->hedge ? download_info->primary : download_info->hedge;
+    curl_off_t bytes = attempt->received;
+
+    download->bytes += bytes;
+    download_info->verified = attempt->verify;
+    if (attempt->verify) {
+        download->verified++;
+    } else if (!download_info->whole) {
+        download->unverified++;
+    }
+    if (other) {
+        cancel_attempt(engine, other);
+    }
+
+    int hedge = attempt->hedge;
+    close_attempt(attempt, 0);
+    if (hedge) {
+        download->hedges_won++;
+        log_trace("download_cid: hedge won for %s", download_info->cid);
+    }
+    if (hedge && download_info->offset >= 0) {
+        if (!place_hedge(attempt)) {
+            log_trace("download_cid: Failed to place %s", attempt->file_path);
+            finish_cid(download_info, DOWNLOAD_FAILED);
+            return;
+        }
+    } else if (hedge && attempt->file_path) {
+        if (rename(attempt->file_path, download_info->file_path) != 0) {
+            log_trace("download_cid: Failed to move %s", attempt->file_path);
+            finish_cid(download_info, DOWNLOAD_FAILED);
+            return;
+        }
+        if (download_info->stream) {
+            stream_replace(download_info->stream, download_info->chunk,
+                           bytes);
+        }
+    }
+
+    cid_succeeded(download_info);
 }
 
-static void move_single_file(file_info_t *info, char *file_path,
-                             config_t *config) {
-    char *cid_path = util_get_file_path(config->output, info->cids[0]);
+static void complete_attempt(engine_t *engine, CURL *curl, CURLcode res,
+                             attempt_t *attempt) {
+    download_info_t *download_info = attempt->download_info;
+    download_t *download = download_info->download;
+    conn_record(download->conn, curl);
 
-    if (rename(cid_path, file_path) != 0) {
-        log_trace("assemble: Failed to move file %s to %s", info->cids[0],
-                  info->filename);
-        exit(-1);
+    int succeeded = is_response_ok(attempt, res);
+    record_gateway(curl, download->gateways, attempt->gateway, succeeded);
+    if (succeeded && attempt->gateway >= 0) {
+        record_cache(download, attempt);
+    }
+    if (attempt->invalid || attempt->corrupt) {
+        gateway_record_rejection(download->gateways, attempt->gateway);
+    }
+    if (attempt->invalid) {
+        download->invalid++;
+        attempt->invalid = 0;
+    }
+
+    if (succeeded) {
+        win_attempt(engine, attempt);
+        return;
+    }
+
+    // The other half of a hedged pair carries on alone
+    if (download_info->primary && download_info->hedge) {
+        close_attempt(attempt, attempt->hedge);
+        return;
     }
 
-    log_trace("assemble: %s -> %s", info->cids[0], info->filename);
+    // A miss on the local node is expected and does not count as a retry
+    int next = next_source(download, download_info->cid, attempt->source);
+    if (source_falls_through(download->sources[attempt->source]) &&
+        next >= 0) {
+        log_trace("download_cid: %s not on the %s source, trying %s",
+                  download_info->cid,
+                  source_name(download->sources[attempt->source]),
+                  source_name(download->sources[next]));
+        download->local_misses++;
+        attempt->source = next;
+        if (attempt->corrupt) {
+            restart_attempt(attempt);
+        }
+        start_attempt(download, attempt, -1);
+        return;
+    }
+
+    download_info->retries++;
+    if (download_info->retries >= download_info->config->max_retries) {
+        log_trace("download_cid: Download of cid %s failed after %d tries",
+                  download_info->cid, download_info->retries);
+        close_attempt(attempt, attempt->hedge);
+        finish_cid(download_info, DOWNLOAD_FAILED);
+        return;
+    }
+
+    // Bytes already in the CID file stay there and the retry asks the next
+    // gateway for the rest with a Range request, unless they were corrupt
+    log_trace("download_cid: Retry to download %s (attempt %d)",
+              download_info->cid, download_info->retries + 1);
+    if (attempt->corrupt) {
+        restart_attempt(attempt);
+    }
+    download_info->hedged = 0;
+    start_attempt(download, attempt, attempt->gateway);
+}
+
+static void download_cid_done(engine_t *engine, CURL *curl, CURLcode res,
+                              void *data) {
+    attempt_t *attempt = (attempt_t *)data;
+    download_t *download = attempt->download_info->download;
+
+    long response_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    if (res == CURLE_OPERATION_TIMEDOUT) {
+        sched_congested(download->sched, "timeout");
+    } else if (response_code == 429) {
+        sched_congested(download->sched, "429");
+    }
+
+    sched_release(download->sched, attempt->gateway);
+    complete_attempt(engine, curl, res, attempt);
+    drain_queue(download);
+}
+
+static int64_t chunk_offset(file_info_t *info, int cid_index) {
+    int64_t offset = 0;
+    for (int j = 0; j < cid_index; ++j) {
+        offset += info->sizes[j];
+    }
+    return offset;
+}
+
+// A cached chunk of a direct track is copied into place, or downloaded
+// again when it does not match the catalog size. The CID file is left for
+// the batch area cleanup, since another track of the batch may share it.
+static void place_cached(file_info_t *info, int cid_index) {
+    char *cid_path =
+        util_get_file_path(info->config->output, info->cids[cid_index]);
+    int in = open(cid_path, O_RDONLY);
+    struct stat st;
+
+    if (in < 0 || fstat(in, &st) != 0 || st.st_size != info->sizes[cid_index] ||
+        copy_fd(in, 0, info->fd, chunk_offset(info, cid_index), st.st_size,
+                COPY_REFLINK) == COPY_FAILED) {
+        log_trace("download_start: Failed to place cached %s",
+                  info->cids[cid_index]);
+        info->cid_download_status[cid_index] = DOWNLOAD_PENDING;
+    }
+    if (in >= 0) {
+        close(in);
+    }
     free(cid_path);
-    free(file_path);
 }
 
-static char *alloc_buffer(size_t buffer_size) {
-    char *buffer = (char *)malloc(buffer_size);
-    if (!buffer) {
-        log_trace("assemble: Memory allocation failed");
+// Multi-CID tracks whose chunk sizes are known are written straight into a
+// preallocated track file and need no assembly afterwards
+static void open_direct(file_info_t *info) {
+    config_t *config = info->config;
+    if (config->stream || info->num_cids < 2 || !info->sizes) {
+        return;
+    }
+
+    char *file_path = util_get_file_path(config->output, info->filename);
+    int64_t total = chunk_offset(info, info->num_cids);
+    int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_trace("download_start: Failed to open file %s", file_path);
         exit(-1);
     }
-    return buffer;
+    if (fallocate(fd, 0, 0, total) != 0 && ftruncate(fd, total) != 0) {
+        log_trace("download_start: Failed to preallocate %s", file_path);
+        close(fd);
+        remove(file_path);
+        free(file_path);
+        return;
+    }
+    free(file_path);
+
+    info->fd = fd;
+    for (int j = 0; j < info->num_cids; ++j) {
+        if (info->cid_download_status[j] == DOWNLOAD_SUCCEEDED) {
+            place_cached(info, j);
+        }
+    }
+}
+
+static void start_transfer(download_t *download,
+                           download_info_t *download_info);
+
+static void dag_done(dag_fetch_t *fetch, int succeeded, void *data) {
+    download_info_t *download_info = (download_info_t *)data;
+    download_t *download = download_info->download;
+    int64_t size = dag_fetch_size(fetch);
+
+    if (download_info->offset < 0) {
+        close(download_info->fd);
+    }
+    // One bad block should not cost the whole CID, so it is fetched again
+    // without the DAG, and checked like any other whole-file body
+    if (!succeeded) {
+        log_trace("download_cid: Trustless download of %s failed, "
+                  "fetching it whole",
+                  download_info->cid);
+        download_info->dag_failed = 1;
+        start_transfer(download, download_info);
+        return;
+    }
+
+    download->bytes += size;
+    download->verified++;
+    download_info->verified = 1;
+    if (download_info->stream) {
+        stream_replace(download_info->stream, download_info->chunk, size);
+    }
+    cid_succeeded(download_info);
+}
+
+// Trustless mode walks the DAG of a CID block by block instead of fetching
+// it as one opaque file. Returns 0 for CIDs that are not raw or dag-pb.
+static int start_dag(download_t *download, download_info_t *download_info) {
+    int direct = download_info->offset >= 0;
+
+    if (!direct) {
+        download_info->fd =
+            open(download_info->file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (download_info->fd < 0) {
+            log_trace("download_cid: Failed to open file %s",
+                      download_info->file_path);
+            exit(-1);
+        }
+    }
+
+    if (!dag_fetch_start(download->dag, download_info->cid, download_info->fd,
+                         direct ? download_info->offset : 0,
+                         direct ? download_info->size : -1, dag_done,
+                         download_info)) {
+        if (!direct) {
+            close(download_info->fd);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// The first source that a miss does not fall through picks from the
+// gateway scoreboard
+static int reaches_gateways(download_t *download, const char *cid) {
+    int source = next_source(download, cid, -1);
+    while (source >= 0 && source_falls_through(download->sources[source])) {
+        source = next_source(download, cid, source);
+    }
+    return source >= 0 && source_uses_gateways(download->sources[source]);
+}
+
+// Only whole-file CIDs of known size that are fetched from public gateways
+// are split; direct chunks and streamed tracks already have their own
+// layout and order.
+static int is_splittable(download_t *download, file_info_t *info,
+                         int cid_index) {
+    config_t *config = info->config;
+    return config->split_min_size > 0 && !config->stream && info->fd < 0 &&
+           info->sizes && info->sizes[cid_index] >= config->split_min_size &&
+           !download->dag && reaches_gateways(download, info->cids[cid_index]);
 }
 
-static void assemble_multiple_cids(file_info_t *info, char *file_path,
-                                   config_t *config) {
-    FILE *outfile = fopen(file_path, "wb");
-    if (!outfile) {
-        log_trace("assemble: Failed to open file %s", file_path);
+// Parts are at least SPLIT_MIN_PART bytes with at most one per healthy
+// gateway, so the fan-out grows with the size of the CID until every
+// gateway has a part, and after that the parts grow instead
+static int split_parts(download_t *download, file_info_t *info,
+                       int cid_index) {
+    if (!is_splittable(download, info, cid_index)) {
+        return 1;
+    }
+    int64_t parts = info->sizes[cid_index] / SPLIT_MIN_PART;
+    int healthy =
+        gateway_count_healthy(download->gateways, SPLIT_MAX_ERROR_RATE);
+    if (parts > healthy) {
+        parts = healthy;
+    }
+    if (parts > SPLIT_MAX_PARTS) {
+        parts = SPLIT_MAX_PARTS;
+    }
+    return parts < 2 ? 1 : (int)parts;
+}
+
+// Each part is a transfer of its own that writes its byte range into the
+// preallocated CID file, so it is queued, hedged, preempted and retried on
+// another gateway like any other transfer
+static int start_parts(download_t *download, download_info_t *whole,
+                       int parts) {
+    int64_t size = whole->info->sizes[whole->chunk];
+    int fd = open(whole->file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_trace("download_cid: Failed to open file %s", whole->file_path);
         exit(-1);
     }
+    if (fallocate(fd, 0, 0, size) != 0 && ftruncate(fd, size) != 0) {
+        log_trace("download_cid: Failed to preallocate %s", whole->file_path);
+        close(fd);
+        return 0;
+    }
+
+    whole->fd = fd;
+    whole->size = size;
+    whole->parts_pending = parts;
+    int64_t part_size = (size + parts - 1) / parts;
+    log_trace("download_cid: splitting %s into %d parts of %lld bytes",
+              whole->cid, parts, (long long)part_size);
+    download->splits++;
+    download->parts += parts;
 
-    char *buffer = alloc_buffer(4096);
-    for (int j = 0; j < info->num_cids; j++) {
-        append_cid_output(info->filename, info->cids[j], outfile, buffer,
-                          config);
+    for (int k = 0; k < parts; ++k) {
+        download_info_t *part =
+            apr_palloc(download->pool, sizeof(download_info_t));
+        *part = *whole;
+        part->whole = whole;
+        part->parts_pending = 0;
+        part->offset = k * part_size;
+        part->size = size - part->offset < part_size ? size - part->offset
+                                                     : part_size;
+        download->transfers[download->num_transfers++] = part;
+        part->primary = open_attempt(part, 0);
+        start_attempt(download, part->primary, -1);
     }
+    return 1;
+}
 
-    fclose(outfile);
-    free(file_path);
-    free(buffer);
+static void start_transfer(download_t *download,
+                           download_info_t *download_info) {
+    if (download->dag && !download_info->dag_failed &&
+        start_dag(download, download_info)) {
+        return;
+    }
+    int parts = split_parts(download, download_info->info,
+                            download_info->chunk);
+    if (parts > 1 && start_parts(download, download_info, parts)) {
+        return;
+    }
+    download_info->primary = open_attempt(download_info, 0);
+    start_attempt(download, download_info->primary, -1);
 }
 
-static void assemble(file_info_t *info, config_t *config) {
-    char *file_path = util_get_file_path(config->output, info->filename);
+// Puts the bytes the leader downloaded where the follower wants them: the
+// same file when both share a batch, a hard link or copy in another batch,
+// or the follower's range of its track file
+static int deliver_cid(download_info_t *leader, download_info_t *follower) {
+    int direct = leader->offset >= 0;
+    int in = direct ? leader->fd : open(leader->file_path, O_RDONLY);
+    int64_t offset = direct ? leader->offset : 0;
+    int64_t size = leader->size;
+    struct stat st;
+    int succeeded;
+
+    if (in < 0 || (!direct && fstat(in, &st) != 0)) {
+        log_trace("download_cid: Failed to open %s to share it",
+                  leader->file_path);
+        if (in >= 0) {
+            close(in);
+        }
+        return 0;
+    }
+    if (!direct) {
+        size = st.st_size;
+    }
 
-    if (info->num_cids == 1) {
-        move_single_file(info, file_path, config);
+    if (follower->offset >= 0) {
+        succeeded = size == follower->size &&
+                    copy_fd(in, offset, follower->fd, follower->offset, size,
+                            COPY_REFLINK) != COPY_FAILED;
+    } else if (!direct &&
+               (strcmp(leader->file_path, follower->file_path) == 0 ||
+                link(leader->file_path, follower->file_path) == 0)) {
+        succeeded = 1;
     } else {
-        assemble_multiple_cids(info, file_path, config);
+        int out =
+            open(follower->file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        succeeded = out >= 0 && copy_fd(in, offset, out, 0, size,
+                                        COPY_REFLINK) != COPY_FAILED;
+        if (out >= 0) {
+            close(out);
+        }
+    }
+    if (!direct) {
+        close(in);
+    }
+    follower->landed_size = size;
+    return succeeded;
+}
+
+// Runs on the leader's engine thread. The follower is finished on its own.
+static void land_follower(flight_waiter_t *waiter, int succeeded,
+                          void *result) {
+    download_info_t *follower = (download_info_t *)waiter->data;
+    download_t *download = follower->download;
+
+    follower->landed =
+        succeeded && deliver_cid((download_info_t *)result, follower);
+    apr_thread_mutex_lock(download->landed_mutex);
+    follower->next_landed = download->landed;
+    download->landed = follower;
+    apr_thread_mutex_unlock(download->landed_mutex);
+    engine_wakeup(download->engine);
+}
+
+// Returns 1 when another transfer, in this batch or another one, is already
+// downloading the CID. The engine is held until that one lands.
+static int join_flight(download_t *download, download_info_t *download_info) {
+    download_info->waiter.land = land_follower;
+    download_info->waiter.data = download_info;
+    if (flight_join(download->flight, download_info->cid,
+                    &download_info->waiter)) {
+        download_info->leader = 1;
+        return 0;
+    }
+    log_trace("download_cid: %s is already in flight, waiting for it",
+              download_info->cid);
+    engine_hold(download->engine);
+    return 1;
+}
+
+// Followers whose leader failed download the CID themselves
+static void process_landed(download_t *download) {
+    apr_thread_mutex_lock(download->landed_mutex);
+    download_info_t *landed = download->landed;
+    download->landed = NULL;
+    apr_thread_mutex_unlock(download->landed_mutex);
+
+    while (landed) {
+        download_info_t *download_info = landed;
+        landed = landed->next_landed;
+        download_info->next_landed = NULL;
+        engine_unhold(download->engine);
+
+        if (!download_info->landed) {
+            log_trace("download_cid: shared download of %s failed, "
+                      "downloading it here",
+                      download_info->cid);
+            start_transfer(download, download_info);
+            continue;
+        }
+        log_trace("download_cid: %s shared with an in-flight download",
+                  download_info->cid);
+        download->shared++;
+        if (download_info->stream) {
+            stream_replace(download_info->stream, download_info->chunk,
+                           download_info->landed_size);
+        }
+        finish_cid(download_info, DOWNLOAD_SUCCEEDED);
+    }
+}
+
+static download_info_t *start_cid(download_t *download, file_info_t *info,
+                                  int cid_index) {
+    download_info_t *download_info =
+        apr_pcalloc(download->pool, sizeof(download_info_t));
+    download_info->cid = info->cids[cid_index];
+    download_info->cid_download_status =
+        &(info->cid_download_status[cid_index]);
+    download_info->config = info->config;
+    download_info->download = download;
+    download_info->info = info;
+    download_info->stream = info->stream;
+    download_info->chunk = cid_index;
+    download_info->file_path = apr_pstrcat(
+        download->pool, info->config->output, "/", download_info->cid, NULL);
+    download_info->offset = -1;
+    download_info->fd = info->fd;
+    if (info->fd >= 0) {
+        download_info->offset = chunk_offset(info, cid_index);
+        download_info->size = info->sizes[cid_index];
+    }
+
+    log_trace("download_cid: start downloading %s", download_info->cid);
+
+    if (!join_flight(download, download_info)) {
+        start_transfer(download, download_info);
+    }
+    return download_info;
+}
+
+static apr_time_t hedge_delay(download_t *download) {
+    double ttfb = gateway_ttfb_percentile(download->gateways, HEDGE_PERCENTILE);
+    if (ttfb < 0) {
+        return apr_time_from_sec(HEDGE_DEFAULT_DELAY);
+    }
+    apr_time_t delay = (apr_time_t)(ttfb * APR_USEC_PER_SEC);
+    return delay < HEDGE_MIN_DELAY ? HEDGE_MIN_DELAY : delay;
+}
+
+static int can_hedge(download_t *download, int in_flight) {
+    config_t *config = download->config;
+    int max_hedges = in_flight * config->hedge_budget / 100;
+
+    if (download->active_hedges >= (max_hedges > 0 ? max_hedges : 1)) {
+        return 0;
+    }
+    // Bytes thrown away by cancelled losers stay within the budget
+    return download->wasted_bytes * 100 <=
+           download->bytes * config->hedge_budget;
+}
+
+static int needs_hedge(download_info_t *download_info, apr_time_t now,
+                       apr_time_t delay) {
+    attempt_t *primary = download_info->primary;
+    curl_off_t bytes = 0;
+    curl_off_t speed = 0;
+
+    if (!primary || download_info->hedge || download_info->hedged ||
+        primary->queued || primary->paused || primary->throttled ||
+        primary->gateway < 0 ||
+        now - primary->started < delay) {
+        return 0;
+    }
+
+    curl_easy_getinfo(primary->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(primary->curl, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+    return bytes == 0 || speed < download_info->config->hedge_min_speed;
+}
+
+// Race transfers that have no first byte, or crawl below the throughput
+// floor, on a second gateway once they exceed the observed TTFB percentile
+static void check_hedges(engine_t *engine, void *data) {
+    download_t *download = (download_t *)data;
+    config_t *config = download->config;
+
+    if (config->hedge_budget <= 0 || config->num_gateways < 2) {
+        return;
+    }
+
+    int in_flight = 0;
+    for (int i = 0; i < download->num_transfers; ++i) {
+        in_flight += download->transfers[i]->primary != NULL;
+    }
+
+    apr_time_t now = apr_time_now();
+    apr_time_t delay = hedge_delay(download);
+    for (int i = 0; i < download->num_transfers; ++i) {
+        download_info_t *download_info = download->transfers[i];
+        if (!needs_hedge(download_info, now, delay)) {
+            continue;
+        }
+        if (!can_hedge(download, in_flight)) {
+            break;
+        }
+
+        log_trace("download_cid: hedging %s after %.3f seconds",
+                  download_info->cid,
+                  (double)(now - download_info->primary->started) /
+                      APR_USEC_PER_SEC);
+        download_info->hedged = 1;
+        download_info->hedge = open_attempt(download_info, 1);
+        download->active_hedges++;
+        download->hedges_started++;
+        start_attempt(download, download_info->hedge,
+                      download_info->primary->gateway);
+    }
+}
+
+static void log_verification(download_t *download) {
+    log_trace("Verification: %d verified, %d rejected, %d unverifiable",
+              download->verified, download->rejected, download->unverified);
+    fprintf(stdout, "Verification: %d verified, %d rejected, %d unverifiable\n",
+            download->verified, download->rejected, download->unverified);
+    log_trace("Validation: %d bodies rejected", download->invalid);
+    fprintf(stdout, "Validation: %d bodies rejected\n", download->invalid);
+}
+
+static void resume_attempt(download_t *download, attempt_t *attempt) {
+    if (!attempt || !attempt->throttled || attempt->queued) {
+        return;
+    }
+    int64_t rank = attempt_rank(attempt);
+    if (!sched_bandwidth_available(download->sched, rank)) {
+        if (rank < download->waiting_rank) {
+            download->waiting_rank = rank;
+        }
+        return;
+    }
+    sched_throttled(download->sched, apr_time_now() - attempt->throttled_at);
+    attempt->throttled = 0;
+    curl_easy_pause(attempt->curl, CURLPAUSE_CONT);
+}
+
+// Transfers paused by the bandwidth shaper get tokens back in rank order.
+// Transfers are started in play order, so that is their order here too.
+static void resume_throttled(download_t *download) {
+    download->waiting_rank = download->dag ? dag_throttled(download->dag)
+                                           : SCHED_IDLE;
+    for (int i = 0; i < download->num_transfers; ++i) {
+        download_info_t *download_info = download->transfers[i];
+        resume_attempt(download, download_info->primary);
+        resume_attempt(download, download_info->hedge);
+    }
+    sched_wait_bandwidth(download->sched, download->slot,
+                         download->waiting_rank);
+}
+
+static void download_tick(engine_t *engine, void *data) {
+    download_t *download = (download_t *)data;
+    apr_time_t now = apr_time_now();
+
+    resume_throttled(download);
+    sched_tick(download->sched, apr_time_now());
+    yield_to_playing(download);
+    if (download->dag) {
+        download->dag_waiting = dag_pump(download->dag);
+    }
+    drain_queue(download);
+    if (now >= download->next_hedge_check) {
+        download->next_hedge_check = now + HEDGE_INTERVAL;
+        check_hedges(engine, download);
+    }
+}
+
+static void log_hedges(download_t *download) {
+    log_trace("Hedging: %d started, %d won, %.3f MB wasted",
+              download->hedges_started, download->hedges_won,
+              (double)download->wasted_bytes / (1024 * 1024));
+    fprintf(stdout, "Hedging: %d started, %d won, %.3f MB wasted\n",
+            download->hedges_started, download->hedges_won,
+            (double)download->wasted_bytes / (1024 * 1024));
+}
+
+static void log_sources(download_t *download) {
+    if (source_falls_through(download->sources[0])) {
+        log_trace("Local node: %d misses", download->local_misses);
+        fprintf(stdout, "Local node: %d misses\n", download->local_misses);
+    }
+    if (download->pinner) {
+        pin_log(download->pinner);
     }
 }
 
-void assemble_files(file_info_t *infos, config_t *config) {
-    fprintf(stdout, "\n");
+static void log_gateway_cache(download_t *download) {
+    log_trace("Gateway cache: %d hits, %d misses, %d unreported",
+              download->cache_hits, download->cache_misses,
+              download->cache_unknown);
+    fprintf(stdout, "Gateway cache: %d hits, %d misses, %d unreported\n",
+            download->cache_hits, download->cache_misses,
+            download->cache_unknown);
+}
+
+static void log_splits(download_t *download) {
+    log_trace("Split: %d CIDs in %d parts", download->splits,
+              download->parts);
+    fprintf(stdout, "Split: %d CIDs in %d parts\n", download->splits,
+            download->parts);
+}
+
+static void log_preemptions(download_t *download) {
+    log_trace("Priority: %d transfers preempted", download->preempted);
+    fprintf(stdout, "Priority: %d transfers preempted\n", download->preempted);
+}
+
+static void log_duration(apr_time_t start, apr_time_t end) {
+    apr_time_t diff_usec = end - start;
+    double elapsed_time = (double)diff_usec / APR_USEC_PER_SEC;
+    log_trace("Downloading took %.3f seconds", elapsed_time);
+    fprintf(stdout, "%s %.3f seconds\n", "Downloading took", elapsed_time);
+}
+
+static size_t discard_callback(void *ptr, size_t size, size_t nmemb,
+                               void *userdata) {
+    return size * nmemb;
+}
+
+static void probe_done(engine_t *engine, CURL *curl, CURLcode res,
+                       void *data) {
+    probe_info_t *probe_info = (probe_info_t *)data;
+    long response_code = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    record_gateway(curl, probe_info->gateways, probe_info->gateway,
+                   res == CURLE_OK && response_code == 200);
+    conn_record(probe_info->conn, curl);
+    conn_release(probe_info->conn, curl);
+}
+
+// Fetch a known CID from every gateway so that idle or recovering gateways
+// keep fresh scores
+static void start_probes(download_t *download, config_t *config) {
+    for (int i = 0; i < config->num_gateways; ++i) {
+        probe_info_t *probe_info =
+            apr_palloc(download->pool, sizeof(probe_info_t));
+        probe_info->conn = download->conn;
+        probe_info->gateways = download->gateways;
+        probe_info->gateway = i;
+
+        char *url = apr_psprintf(download->pool, "https://%s/%s",
+                                 config->gateways[i], config->probe_cid);
+        CURL *curl = conn_acquire(download->conn);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)config->timeout);
+        log_trace("download_start: probing %s", url);
+        engine_add(download->engine, curl, probe_done, probe_info);
+    }
+}
+
+static void resume_transfers(engine_t *engine, void *data) {
+    download_t *download = (download_t *)data;
+
+    for (int i = 0; i < download->num_transfers; ++i) {
+        download_info_t *download_info = download->transfers[i];
+        attempt_t *primary = download_info->primary;
+        if (primary && primary->paused &&
+            !stream_should_pause(download_info->stream, download_info->chunk)) {
+            // curl_easy_pause may call write_callback, which can pause again
+            primary->paused = 0;
+            curl_easy_pause(primary->curl, CURLPAUSE_CONT);
+        }
+    }
+    process_landed(download);
+    drain_queue(download);
+}
+
+static void stream_wakeup(void *data) {
+    engine_wakeup((engine_t *)data);
+}
+
+// Chunks served from the cache are complete before any transfer starts
+static void stream_cached(file_info_t *info) {
+    for (int j = 0; j < info->num_cids; ++j) {
+        if (info->cid_download_status[j] != DOWNLOAD_SUCCEEDED) {
+            continue;
+        }
+        char *cid_path =
+            util_get_file_path(info->config->output, info->cids[j]);
+        struct stat st;
+        if (stat(cid_path, &st) == 0) {
+            stream_write(info->stream, j, st.st_size);
+            stream_finish(info->stream, j, 1);
+        } else {
+            log_trace("download_start: Failed to stat %s", cid_path);
+            info->cid_download_status[j] = DOWNLOAD_FAILED;
+            stream_finish(info->stream, j, 0);
+        }
+        free(cid_path);
+    }
+}
+
+static void *APR_THREAD_FUNC download_thread(apr_thread_t *thd, void *data) {
+    download_t *download = (download_t *)data;
+    engine_run(download->engine);
+    sched_leave(download->sched, download->slot);
+    download->end = apr_time_now();
+    gateway_save(download->gateways);
+    cache_save(download->cache);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+// Printed on the main thread once the batch has played, so the lines do
+// not cut into the position line of the track playing
+static void log_stats(download_t *download) {
+    log_duration(download->start, download->end);
+    log_hedges(download);
+    log_preemptions(download);
+    log_splits(download);
+    log_gateway_cache(download);
+    flight_log(download->flight);
+    log_sources(download);
+    log_verification(download);
+    if (download->dag) {
+        dag_log(download->dag);
+    }
+    sched_log(download->sched);
+    conn_log_stats(download->conn);
+    gateway_log(download->gateways);
+    cache_log_stats(download->cache);
+}
+
+static void add_source(download_t *download, source_t *source) {
+    apr_pool_cleanup_register(download->pool, source, source_destroy,
+                              apr_pool_cleanup_null);
+    download->sources[download->num_sources++] = source;
+}
+
+// Sources are tried in order, the gateway scoreboard last since it takes
+// any CID
+static void add_sources(download_t *download, config_t *config) {
+    download->sources = apr_palloc(download->pool, 3 * sizeof(source_t *));
+    if (config->local_gateway) {
+        add_source(download, source_local_create(download->pool,
+                                                 config->local_gateway));
+    }
+    add_source(download,
+               source_subdomain_create(download->pool, SUBDOMAIN_GATEWAY));
+    add_source(download, source_gateway_create(download->pool));
+}
+
+download_t *download_start(apr_pool_t *pool, file_info_t *infos,
+                           config_t *config, context_t *context, int seq) {
+    log_trace("download_start: start");
+
+    apr_pool_t *subpool;
+    apr_pool_create(&subpool, pool);
+
+    download_t *download = apr_pcalloc(subpool, sizeof(download_t));
+    download->pool = subpool;
+    download->conn = context->conn;
+    download->gateways = context->gateways;
+    download->cache = context->cache;
+    download->pinner = context->pinner;
+    download->flight = context->flight;
+    download->sched = context->sched;
+    apr_thread_mutex_create(&download->landed_mutex, APR_THREAD_MUTEX_DEFAULT,
+                            subpool);
+    download->config = config;
+    gateway_sync(download->gateways, config);
+    sched_sync(download->sched, config);
+    download->seq = seq;
+    download->slot = sched_join(download->sched);
+    download->dag_waiting = SCHED_IDLE;
+    apr_atomic_set32(&download->playing, (apr_uint32_t)-1);
+    download->blocked = apr_pcalloc(subpool, config->num_gateways + 1);
+    download->engine =
+        engine_create(download->conn, config->max_connections);
+    apr_pool_cleanup_register(subpool, download->engine, engine_destroy,
+                              apr_pool_cleanup_null);
+    engine_set_wakeup(download->engine, resume_transfers, download);
+    download->waiting_rank = SCHED_IDLE;
+    add_sources(download, config);
+    engine_set_tick(download->engine, SCHED_TICK_MS, download_tick, download);
+    if (config->trustless) {
+        download->dag =
+            dag_create(subpool, download->engine, context, config, dag_rank);
+        apr_pool_cleanup_register(subpool, download->dag, dag_destroy,
+                                  apr_pool_cleanup_null);
+    }
+
+    if (!config->stream) {
+        download->assembler =
+            assemble_create(subpool, config->assemble_threads);
+        apr_pool_cleanup_register(subpool, download->assembler,
+                                  assemble_destroy, apr_pool_cleanup_null);
+    }
+
+    int num_transfers = 0;
+    for (int i = 0; i < config->num_files; ++i) {
+        open_direct(&infos[i]);
+        infos[i].ready = future_create(pool);
+        infos[i].num_pending = 0;
+        for (int j = 0; j < infos[i].num_cids; ++j) {
+            if (infos[i].cid_download_status[j] != DOWNLOAD_PENDING) {
+                continue;
+            }
+            infos[i].num_pending++;
+            // Room for the parts should the CID be split
+            if (is_splittable(download, &infos[i], j)) {
+                num_transfers += SPLIT_MAX_PARTS;
+            }
+        }
+        num_transfers += infos[i].num_pending;
+        if (config->stream) {
+            infos[i].stream =
+                stream_create(pool, config->output, infos[i].cids,
+                              infos[i].num_cids, config->stream_buffer);
+            stream_set_notify(infos[i].stream, stream_wakeup,
+                              download->engine);
+            stream_cached(&infos[i]);
+        }
+    }
+    download->transfers =
+        apr_palloc(subpool, num_transfers * sizeof(download_info_t *));
+
+    // Prefetched batches are queued here well before they play, which
+    // gives the local node time to fetch them before we ask for them
+    for (int i = 0; download->pinner && i < config->num_files; ++i) {
+        for (int j = 0; j < infos[i].num_cids; ++j) {
+            if (infos[i].cid_download_status[j] == DOWNLOAD_PENDING) {
+                pin_submit(download->pinner, infos[i].cids[j]);
+            }
+        }
+    }
+
+    download->start = apr_time_now();
+    if (config->probe_cid) {
+        start_probes(download, config);
+    }
     for (int i = 0; i < config->num_files; ++i) {
-        if (is_download_successful(&infos[i])) {
-            log_assembly(&infos[i]);
-            assemble(&infos[i], config);
-            log_trace("assemble: finish assembling %s", infos[i].filename);
+        if (infos[i].num_pending == 0) {
+            finish_track(download, &infos[i]);
+        }
+        for (int j = 0; j < infos[i].num_cids; ++j) {
+            if (infos[i].cid_download_status[j] == DOWNLOAD_PENDING) {
+                download->transfers[download->num_transfers++] =
+                    start_cid(download, &infos[i], j);
+            }
         }
     }
+
+    if (apr_thread_create(&download->thread, NULL, download_thread, download,
+                          subpool) != APR_SUCCESS) {
+        log_trace("download_start: Failed to create download thread");
+        exit(-1);
+    }
+
+    log_trace("download_start: finish");
+    return download;
+}
+
+void download_wait(download_t *download) {
+    log_trace("download_wait: start");
+    apr_status_t rv;
+    apr_thread_join(&rv, download->thread);
+    if (download->assembler) {
+        assemble_wait(download->assembler);
+    }
+    log_stats(download);
+    apr_pool_destroy(download->pool);
+    log_trace("download_wait: finish");
+}
+
+// Called by the player before it starts the track at `position`
+void download_set_playing(download_t *download, int position) {
+    sched_play(download->sched, download->seq);
+    apr_atomic_set32(&download->playing, position);
+    engine_wakeup(download->engine);
+}
+
+// Blocks until the track has been assembled, or has failed, and returns
+// how long the player had to wait for it
+apr_time_t download_wait_track(file_info_t *info) {
+    if (future_is_set(info->ready)) {
+        return 0;
+    }
+    apr_time_t start = apr_time_now();
+    future_wait(info->ready);
+    return apr_time_now() - start;
 }
@@ -0,0 +1,292 @@
+#include "engine.h"
+#include "log.h"
+#include <apr_time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+
+typedef struct {
+    engine_done_fn done;
+    void *data;
+} engine_transfer_t;
+
+struct engine {
+    conn_t *conn;
+    CURLM *multi;
+    int epfd;
+    int wakefd;
+    long timeout_ms;
+    int num_transfers;
+    engine_wakeup_fn on_wakeup;
+    void *wakeup_data;
+    long tick_ms;
+    apr_time_t next_tick;
+    engine_tick_fn on_tick;
+    void *tick_data;
+};
+
+static int socket_callback(CURL *curl, curl_socket_t s, int what, void *userp,
+                           void *socketp) {
+    engine_t *engine = (engine_t *)userp;
+    struct epoll_event ev = {0};
+    ev.data.fd = s;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(engine->epfd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(engine->multi, s, NULL);
+        return 0;
+    }
+
+    if (what & CURL_POLL_IN) {
+        ev.events |= EPOLLIN;
+    }
+    if (what & CURL_POLL_OUT) {
+        ev.events |= EPOLLOUT;
+    }
+
+    // socketp is non-NULL once the descriptor has been registered with
+    // epoll, though perhaps with the epoll instance of an earlier engine
+    // that had the same multi handle
+    if (!socketp || epoll_ctl(engine->epfd, EPOLL_CTL_MOD, s, &ev) != 0) {
+        if (epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+            log_trace("engine: Failed to add socket %d to epoll", s);
+            return -1;
+        }
+        curl_multi_assign(engine->multi, s, engine);
+    }
+    return 0;
+}
+
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    engine_t *engine = (engine_t *)userp;
+    engine->timeout_ms = timeout_ms;
+    return 0;
+}
+
+engine_t *engine_create(conn_t *conn, int max_connections) {
+    engine_t *engine = (engine_t *)malloc(sizeof(engine_t));
+    if (!engine) {
+        log_trace("engine_create: Memory allocation failed");
+        exit(-1);
+    }
+
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine->epfd < 0) {
+        log_trace("engine_create: Failed to create epoll instance");
+        exit(-1);
+    }
+
+    engine->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->wakefd < 0) {
+        log_trace("engine_create: Failed to create eventfd");
+        exit(-1);
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = engine->wakefd;
+    epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->wakefd, &ev);
+
+    engine->conn = conn;
+    engine->multi = conn_acquire_multi(conn);
+    engine->timeout_ms = -1;
+    engine->num_transfers = 0;
+    engine->on_wakeup = NULL;
+    engine->wakeup_data = NULL;
+    engine->tick_ms = -1;
+    engine->next_tick = 0;
+    engine->on_tick = NULL;
+    engine->tick_data = NULL;
+
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      max_connections > 0 ? (long)max_connections : 0L);
+
+    return engine;
+}
+
+apr_status_t engine_destroy(void *data) {
+    log_trace("engine_destroy: start");
+    engine_t *engine = (engine_t *)data;
+    // Keeps the open connections for the next engine
+    conn_release_multi(engine->conn, engine->multi);
+    close(engine->wakefd);
+    close(engine->epfd);
+    free(engine);
+    log_trace("engine_destroy: finish");
+    return APR_SUCCESS;
+}
+
+void engine_set_wakeup(engine_t *engine, engine_wakeup_fn on_wakeup,
+                       void *data) {
+    engine->on_wakeup = on_wakeup;
+    engine->wakeup_data = data;
+}
+
+void engine_set_tick(engine_t *engine, long interval_ms, engine_tick_fn on_tick,
+                     void *data) {
+    engine->tick_ms = interval_ms;
+    engine->next_tick = apr_time_now() + apr_time_from_msec(interval_ms);
+    engine->on_tick = on_tick;
+    engine->tick_data = data;
+}
+
+void engine_wakeup(engine_t *engine) {
+    uint64_t one = 1;
+    if (write(engine->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_trace("engine_wakeup: Failed to signal engine");
+    }
+}
+
+static void handle_wakeup(engine_t *engine) {
+    uint64_t count;
+    while (read(engine->wakefd, &count, sizeof(count)) > 0) {
+    }
+    if (engine->on_wakeup) {
+        engine->on_wakeup(engine, engine->wakeup_data);
+    }
+}
+
+void engine_add(engine_t *engine, CURL *curl, engine_done_fn done,
+                void *data) {
+    engine_transfer_t *transfer =
+        (engine_transfer_t *)malloc(sizeof(engine_transfer_t));
+    if (!transfer) {
+        log_trace("engine_add: Memory allocation failed");
+        exit(-1);
+    }
+    transfer->done = done;
+    transfer->data = data;
+
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    if (curl_multi_add_handle(engine->multi, curl) != CURLM_OK) {
+        log_trace("engine_add: Failed to add handle to multi");
+        exit(-1);
+    }
+    engine->num_transfers++;
+}
+
+void engine_remove(engine_t *engine, CURL *curl) {
+    engine_transfer_t *transfer = NULL;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&transfer);
+
+    curl_multi_remove_handle(engine->multi, curl);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+    engine->num_transfers--;
+    free(transfer);
+}
+
+// Queued work that has not reached the multi handle yet keeps the engine
+// running just like a transfer does
+void engine_hold(engine_t *engine) {
+    engine->num_transfers++;
+}
+
+void engine_unhold(engine_t *engine) {
+    engine->num_transfers--;
+}
+
+// The epoll timeout is whichever comes first, curl's timer or the next tick
+static int wait_timeout(engine_t *engine) {
+    if (!engine->on_tick) {
+        return (int)engine->timeout_ms;
+    }
+
+    apr_time_t now = apr_time_now();
+    long tick_ms = engine->next_tick > now
+                       ? (long)apr_time_as_msec(engine->next_tick - now)
+                       : 0;
+    if (engine->timeout_ms < 0 || tick_ms < engine->timeout_ms) {
+        return (int)tick_ms;
+    }
+    return (int)engine->timeout_ms;
+}
+
+static void handle_tick(engine_t *engine) {
+    if (!engine->on_tick) {
+        return;
+    }
+
+    apr_time_t now = apr_time_now();
+    if (now >= engine->next_tick) {
+        engine->next_tick = now + apr_time_from_msec(engine->tick_ms);
+        engine->on_tick(engine, engine->tick_data);
+    }
+}
+
+static void check_completions(engine_t *engine) {
+    CURLMsg *msg;
+    int msgs_left;
+
+    while ((msg = curl_multi_info_read(engine->multi, &msgs_left))) {
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        CURL *curl = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        engine_transfer_t *transfer = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&transfer);
+
+        curl_multi_remove_handle(engine->multi, curl);
+        engine->num_transfers--;
+
+        engine_done_fn done = transfer->done;
+        void *data = transfer->data;
+        free(transfer);
+        done(engine, curl, result, data);
+    }
+}
+
+void engine_run(engine_t *engine) {
+    struct epoll_event events[MAX_EVENTS];
+    int running;
+
+    log_trace("engine_run: start with %d transfers", engine->num_transfers);
+    while (engine->num_transfers > 0) {
+        int n = epoll_wait(engine->epfd, events, MAX_EVENTS,
+                           wait_timeout(engine));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_trace("engine_run: epoll_wait failed");
+            exit(-1);
+        }
+
+        if (n == 0) {
+            curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0,
+                                     &running);
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.fd == engine->wakefd) {
+                handle_wakeup(engine);
+                continue;
+            }
+            int flags = 0;
+            if (events[i].events & EPOLLIN) {
+                flags |= CURL_CSELECT_IN;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flags |= CURL_CSELECT_OUT;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                flags |= CURL_CSELECT_ERR;
+            }
+            curl_multi_socket_action(engine->multi, events[i].data.fd, flags,
+                                     &running);
+        }
+
+        check_completions(engine);
+        handle_tick(engine);
+    }
+    log_trace("engine_run: finish");
+}
@@ -0,0 +1,89 @@
+#include "flight.h"
+#include "log.h"
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Registry of CIDs being downloaded right now, shared by every batch. The
+// first requester of a CID leads and downloads it; anyone asking for the
+// same CID before it lands waits for the leader instead of starting a
+// second transfer into the same file.
+
+typedef struct {
+    char *cid;
+    flight_waiter_t *waiters;
+} flight_entry_t;
+
+struct flight {
+    apr_thread_mutex_t *mutex;
+    apr_hash_t *entries;
+    long leaders;
+    long joins;
+};
+
+flight_t *flight_create(apr_pool_t *pool) {
+    flight_t *flight = apr_pcalloc(pool, sizeof(flight_t));
+    flight->entries = apr_hash_make(pool);
+    apr_thread_mutex_create(&flight->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    return flight;
+}
+
+// Returns 1 when the caller leads and has to download the CID, and 0 when
+// `waiter` has been queued behind the leader
+int flight_join(flight_t *flight, const char *cid, flight_waiter_t *waiter) {
+    apr_thread_mutex_lock(flight->mutex);
+    flight_entry_t *entry = (flight_entry_t *)apr_hash_get(
+        flight->entries, cid, APR_HASH_KEY_STRING);
+    if (entry) {
+        waiter->next = entry->waiters;
+        entry->waiters = waiter;
+        flight->joins++;
+        apr_thread_mutex_unlock(flight->mutex);
+        return 0;
+    }
+
+    entry = (flight_entry_t *)calloc(1, sizeof(flight_entry_t));
+    if (!entry || !(entry->cid = strdup(cid))) {
+        log_trace("flight_join: Memory allocation failed");
+        exit(-1);
+    }
+    apr_hash_set(flight->entries, entry->cid, APR_HASH_KEY_STRING, entry);
+    flight->leaders++;
+    apr_thread_mutex_unlock(flight->mutex);
+    return 1;
+}
+
+// Only the leader lands a CID. Waiters are called outside the lock, so
+// they may join other flights.
+void flight_land(flight_t *flight, const char *cid, int succeeded,
+                 void *result) {
+    apr_thread_mutex_lock(flight->mutex);
+    flight_entry_t *entry = (flight_entry_t *)apr_hash_get(
+        flight->entries, cid, APR_HASH_KEY_STRING);
+    if (!entry) {
+        apr_thread_mutex_unlock(flight->mutex);
+        return;
+    }
+    apr_hash_set(flight->entries, entry->cid, APR_HASH_KEY_STRING, NULL);
+    apr_thread_mutex_unlock(flight->mutex);
+
+    while (entry->waiters) {
+        flight_waiter_t *waiter = entry->waiters;
+        entry->waiters = waiter->next;
+        waiter->next = NULL;
+        waiter->land(waiter, succeeded, result);
+    }
+    free(entry->cid);
+    free(entry);
+}
+
+void flight_log(flight_t *flight) {
+    apr_thread_mutex_lock(flight->mutex);
+    log_trace("In-flight: %ld downloads, %ld shared", flight->leaders,
+              flight->joins);
+    fprintf(stdout, "In-flight: %ld downloads, %ld shared\n",
+            flight->leaders, flight->joins);
+    apr_thread_mutex_unlock(flight->mutex);
+}
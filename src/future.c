@@ -0,0 +1,38 @@
+#include "future.h"
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+
+struct future {
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int done;
+};
+
+future_t *future_create(apr_pool_t *pool) {
+    future_t *future = apr_pcalloc(pool, sizeof(future_t));
+    apr_thread_mutex_create(&future->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    apr_thread_cond_create(&future->cond, pool);
+    return future;
+}
+
+void future_set(future_t *future) {
+    apr_thread_mutex_lock(future->mutex);
+    future->done = 1;
+    apr_thread_cond_broadcast(future->cond);
+    apr_thread_mutex_unlock(future->mutex);
+}
+
+int future_is_set(future_t *future) {
+    apr_thread_mutex_lock(future->mutex);
+    int done = future->done;
+    apr_thread_mutex_unlock(future->mutex);
+    return done;
+}
+
+void future_wait(future_t *future) {
+    apr_thread_mutex_lock(future->mutex);
+    while (!future->done) {
+        apr_thread_cond_wait(future->cond, future->mutex);
+    }
+    apr_thread_mutex_unlock(future->mutex);
+}
@@ -0,0 +1,447 @@
+#include "gateway.h"
+#include "log.h"
+#include <apr_random.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Gateway scoreboard. Keeps EWMA time-to-first-byte, throughput and error
+// rate for every gateway we have talked to, survives config re-reads and
+// is persisted to disk between runs.
+
+#define EWMA_ALPHA 0.2
+#define NOMINAL_SIZE (1024.0 * 1024.0)
+#define UNKNOWN_WEIGHT_FACTOR 1.0
+#define MIN_WEIGHT_FACTOR 0.01
+#define TTFB_WINDOW 128
+#define AFFINITY_MIN_SHARE 0.75
+
+typedef struct {
+    char *host;
+    double ttfb;
+    double throughput;
+    double error_rate;
+    double reject_rate;
+    long samples;
+    long rejections;
+    long cache_hits;
+    long cache_misses;
+} gateway_stat_t;
+
+struct gateways {
+    apr_pool_t *pool;
+    apr_thread_mutex_t *mutex;
+    gateway_stat_t *stats;
+    int num_stats;
+    int *active;
+    int num_active;
+    char *state_file;
+    char *tmp_file;
+    double ttfbs[TTFB_WINDOW];
+    int num_ttfbs;
+    int next_ttfb;
+};
+
+gateways_t *gateway_create(apr_pool_t *pool) {
+    gateways_t *gateways = apr_pcalloc(pool, sizeof(gateways_t));
+    gateways->pool = pool;
+    apr_thread_mutex_create(&gateways->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    return gateways;
+}
+
+static int find_stat(gateways_t *gateways, const char *host) {
+    for (int i = 0; i < gateways->num_stats; ++i) {
+        if (strcmp(gateways->stats[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add_stat(gateways_t *gateways, const char *host) {
+    gateway_stat_t *stats = (gateway_stat_t *)realloc(
+        gateways->stats, (gateways->num_stats + 1) * sizeof(gateway_stat_t));
+    if (!stats) {
+        log_trace("gateway: Memory allocation failed");
+        exit(-1);
+    }
+    gateways->stats = stats;
+
+    gateway_stat_t *stat = &gateways->stats[gateways->num_stats];
+    memset(stat, 0, sizeof(gateway_stat_t));
+    stat->host = apr_pstrdup(gateways->pool, host);
+    return gateways->num_stats++;
+}
+
+static void load_state(gateways_t *gateways) {
+    json_error_t error;
+    json_t *root = json_load_file(gateways->state_file, 0, &error);
+    if (!root) {
+        log_trace("gateway: No scoreboard loaded from %s",
+                  gateways->state_file);
+        return;
+    }
+
+    json_t *array = json_object_get(root, "gateways");
+    for (size_t i = 0; json_is_array(array) && i < json_array_size(array);
+         ++i) {
+        json_t *obj = json_array_get(array, i);
+        json_t *host = json_object_get(obj, "host");
+        if (!json_is_string(host)) {
+            continue;
+        }
+
+        int index = find_stat(gateways, json_string_value(host));
+        if (index < 0) {
+            index = add_stat(gateways, json_string_value(host));
+        }
+        gateway_stat_t *stat = &gateways->stats[index];
+        stat->ttfb = json_number_value(json_object_get(obj, "ttfb"));
+        stat->throughput =
+            json_number_value(json_object_get(obj, "throughput"));
+        stat->error_rate =
+            json_number_value(json_object_get(obj, "error_rate"));
+        stat->reject_rate =
+            json_number_value(json_object_get(obj, "reject_rate"));
+        stat->samples = json_integer_value(json_object_get(obj, "samples"));
+    }
+
+    log_trace("gateway: Loaded %d gateways from %s", gateways->num_stats,
+              gateways->state_file);
+    json_decref(root);
+}
+
+void gateway_sync(gateways_t *gateways, config_t *config) {
+    apr_thread_mutex_lock(gateways->mutex);
+
+    if (!gateways->state_file) {
+        gateways->state_file =
+            apr_pstrdup(gateways->pool, config->gateway_state);
+        gateways->tmp_file =
+            apr_pstrcat(gateways->pool, config->gateway_state, ".tmp", NULL);
+        load_state(gateways);
+    }
+
+    int *active = (int *)realloc(gateways->active,
+                                 config->num_gateways * sizeof(int));
+    if (config->num_gateways > 0 && !active) {
+        log_trace("gateway_sync: Memory allocation failed");
+        exit(-1);
+    }
+    gateways->active = active;
+    gateways->num_active = config->num_gateways;
+
+    for (int i = 0; i < config->num_gateways; ++i) {
+        int index = find_stat(gateways, config->gateways[i]);
+        if (index < 0) {
+            index = add_stat(gateways, config->gateways[i]);
+        }
+        gateways->active[i] = index;
+    }
+
+    apr_thread_mutex_unlock(gateways->mutex);
+}
+
+// A gateway that serves the wrong bytes is worse than one that fails, so
+// rejected bodies cost weight on top of counting as errors
+static double stat_weight(gateway_stat_t *stat) {
+    double healthy = (1.0 - stat->error_rate) * (1.0 - stat->reject_rate);
+    double expected = stat->ttfb;
+    if (stat->throughput > 0) {
+        expected += NOMINAL_SIZE / stat->throughput;
+    } else {
+        expected += NOMINAL_SIZE / 1024.0;
+    }
+    return healthy * healthy / (expected > 0.001 ? expected : 0.001);
+}
+
+static double random_unit(void) {
+    apr_uint32_t random_value;
+    apr_generate_random_bytes((unsigned char *)&random_value,
+                              sizeof(random_value));
+    return (double)random_value / 4294967296.0;
+}
+
+// Returns -1 when every gateway other than `exclude` is `blocked`
+int gateway_pick(gateways_t *gateways, int exclude,
+                 const unsigned char *blocked) {
+    apr_thread_mutex_lock(gateways->mutex);
+
+    int num_active = gateways->num_active;
+    if (num_active <= 1) {
+        apr_thread_mutex_unlock(gateways->mutex);
+        return num_active == 1 && blocked && blocked[0] ? -1 : 0;
+    }
+
+    double *weights = (double *)malloc(num_active * sizeof(double));
+    if (!weights) {
+        log_trace("gateway_pick: Memory allocation failed");
+        exit(-1);
+    }
+
+    double max_weight = 0;
+    for (int i = 0; i < num_active; ++i) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[i]];
+        weights[i] = stat->samples > 0 ? stat_weight(stat) : -1;
+        if (weights[i] > max_weight) {
+            max_weight = weights[i];
+        }
+    }
+    if (max_weight <= 0) {
+        max_weight = 1.0;
+    }
+
+    // Unknown gateways are explored as if they were the best one, and even
+    // the worst gateway keeps a small share so it can recover.
+    double total = 0;
+    for (int i = 0; i < num_active; ++i) {
+        if (weights[i] < 0) {
+            weights[i] = UNKNOWN_WEIGHT_FACTOR * max_weight;
+        } else if (weights[i] < MIN_WEIGHT_FACTOR * max_weight) {
+            weights[i] = MIN_WEIGHT_FACTOR * max_weight;
+        }
+        if (i == exclude || (blocked && blocked[i])) {
+            weights[i] = 0;
+        }
+        total += weights[i];
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+
+    if (blocked && total <= 0) {
+        free(weights);
+        return -1;
+    }
+
+    // Rounding can run past the end, so default to the last candidate
+    double target = random_unit() * total;
+    int pick = -1;
+    for (int i = 0; i < num_active; ++i) {
+        if (weights[i] <= 0) {
+            continue;
+        }
+        pick = i;
+        if (target < weights[i]) {
+            break;
+        }
+        target -= weights[i];
+    }
+    if (pick < 0) {
+        pick = (exclude + 1) % num_active;
+    }
+
+    free(weights);
+    return pick;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *text) {
+    for (; *text; ++text) {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// FNV-1a of host and key, with the splitmix64 finaliser to spread the
+// weak low bits of FNV
+static uint64_t rendezvous_score(const char *key, const char *host) {
+    uint64_t hash = fnv1a(14695981039346656037ULL, host);
+    hash = fnv1a(hash ^ 0xff, key);
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+// Rendezvous hashing: every healthy gateway scores the key and the highest
+// score wins, so the same CID keeps going to the same gateway and finds it
+// in that gateway's cache. Adding or dropping a gateway only moves the keys
+// it scored highest on. Retries and hedges exclude the gateway that failed
+// and get the runner-up. Falls back to gateway_pick() when no gateway is
+// healthy enough, a gateway counting as healthy while its weight is at
+// least AFFINITY_MIN_SHARE of the best one, i.e. within 25% of it.
+int gateway_pick_for(gateways_t *gateways, const char *key, int exclude,
+                     const unsigned char *blocked) {
+    apr_thread_mutex_lock(gateways->mutex);
+
+    double max_weight = 0;
+    for (int i = 0; i < gateways->num_active; ++i) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[i]];
+        if (stat->samples > 0 && stat_weight(stat) > max_weight) {
+            max_weight = stat_weight(stat);
+        }
+    }
+
+    int best = -1;
+    uint64_t best_score = 0;
+    for (int i = 0; i < gateways->num_active; ++i) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[i]];
+        if (i == exclude || (blocked && blocked[i]) ||
+            (stat->samples > 0 &&
+             stat_weight(stat) < AFFINITY_MIN_SHARE * max_weight)) {
+            continue;
+        }
+        uint64_t score = rendezvous_score(key, stat->host);
+        if (best < 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+
+    return best >= 0 ? best : gateway_pick(gateways, exclude, blocked);
+}
+
+const char *gateway_host(gateways_t *gateways, int index) {
+    apr_thread_mutex_lock(gateways->mutex);
+    const char *host = gateways->stats[gateways->active[index]].host;
+    apr_thread_mutex_unlock(gateways->mutex);
+    return host;
+}
+
+void gateway_record(gateways_t *gateways, int index, int succeeded,
+                    double ttfb, double throughput) {
+    apr_thread_mutex_lock(gateways->mutex);
+    if (index < 0 || index >= gateways->num_active) {
+        apr_thread_mutex_unlock(gateways->mutex);
+        return;
+    }
+
+    gateway_stat_t *stat = &gateways->stats[gateways->active[index]];
+    if (succeeded) {
+        gateways->ttfbs[gateways->next_ttfb] = ttfb;
+        gateways->next_ttfb = (gateways->next_ttfb + 1) % TTFB_WINDOW;
+        if (gateways->num_ttfbs < TTFB_WINDOW) {
+            gateways->num_ttfbs++;
+        }
+
+        if (stat->samples == 0 || stat->throughput <= 0) {
+            stat->ttfb = ttfb;
+            stat->throughput = throughput;
+        } else {
+            stat->ttfb = EWMA_ALPHA * ttfb + (1 - EWMA_ALPHA) * stat->ttfb;
+            stat->throughput = EWMA_ALPHA * throughput +
+                               (1 - EWMA_ALPHA) * stat->throughput;
+        }
+    }
+    stat->error_rate =
+        EWMA_ALPHA * (succeeded ? 0.0 : 1.0) +
+        (1 - EWMA_ALPHA) * stat->error_rate;
+    if (succeeded) {
+        stat->reject_rate = (1 - EWMA_ALPHA) * stat->reject_rate;
+    }
+    stat->samples++;
+    apr_thread_mutex_unlock(gateways->mutex);
+}
+
+// Gateways we know nothing about yet count as healthy
+int gateway_count_healthy(gateways_t *gateways, double max_error_rate) {
+    int count = 0;
+
+    apr_thread_mutex_lock(gateways->mutex);
+    for (int i = 0; i < gateways->num_active; ++i) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[i]];
+        count += stat->samples == 0 || stat->error_rate <= max_error_rate;
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+    return count;
+}
+
+// Called on top of gateway_record() for a body that failed validation
+void gateway_record_rejection(gateways_t *gateways, int index) {
+    apr_thread_mutex_lock(gateways->mutex);
+    if (index >= 0 && index < gateways->num_active) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[index]];
+        stat->reject_rate =
+            EWMA_ALPHA + (1 - EWMA_ALPHA) * stat->reject_rate;
+        stat->rejections++;
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+}
+
+void gateway_record_cache(gateways_t *gateways, int index, int hit) {
+    apr_thread_mutex_lock(gateways->mutex);
+    if (index >= 0 && index < gateways->num_active) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[index]];
+        if (hit) {
+            stat->cache_hits++;
+        } else {
+            stat->cache_misses++;
+        }
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentile of the most recent successful TTFBs across all gateways,
+// or -1 when nothing has been measured yet
+double gateway_ttfb_percentile(gateways_t *gateways, double percentile) {
+    double sorted[TTFB_WINDOW];
+
+    apr_thread_mutex_lock(gateways->mutex);
+    int count = gateways->num_ttfbs;
+    memcpy(sorted, gateways->ttfbs, count * sizeof(double));
+    apr_thread_mutex_unlock(gateways->mutex);
+
+    if (count == 0) {
+        return -1;
+    }
+    qsort(sorted, count, sizeof(double), compare_double);
+    int index = (int)(percentile * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+void gateway_save(gateways_t *gateways) {
+    apr_thread_mutex_lock(gateways->mutex);
+    if (!gateways->state_file) {
+        apr_thread_mutex_unlock(gateways->mutex);
+        return;
+    }
+
+    json_t *array = json_array();
+    for (int i = 0; i < gateways->num_stats; ++i) {
+        gateway_stat_t *stat = &gateways->stats[i];
+        json_t *obj = json_object();
+        json_object_set_new(obj, "host", json_string(stat->host));
+        json_object_set_new(obj, "ttfb", json_real(stat->ttfb));
+        json_object_set_new(obj, "throughput", json_real(stat->throughput));
+        json_object_set_new(obj, "error_rate", json_real(stat->error_rate));
+        json_object_set_new(obj, "reject_rate",
+                            json_real(stat->reject_rate));
+        json_object_set_new(obj, "samples", json_integer(stat->samples));
+        json_array_append_new(array, obj);
+    }
+    json_t *root = json_object();
+    json_object_set_new(root, "gateways", array);
+
+    // Write then rename so a crash never leaves a truncated scoreboard
+    if (json_dump_file(root, gateways->tmp_file, JSON_INDENT(2)) != 0 ||
+        rename(gateways->tmp_file, gateways->state_file) != 0) {
+        log_trace("gateway_save: Failed to write %s", gateways->state_file);
+    }
+    json_decref(root);
+    apr_thread_mutex_unlock(gateways->mutex);
+}
+
+void gateway_log(gateways_t *gateways) {
+    apr_thread_mutex_lock(gateways->mutex);
+    for (int i = 0; i < gateways->num_active; ++i) {
+        gateway_stat_t *stat = &gateways->stats[gateways->active[i]];
+        log_trace("gateway: %s ttfb %.3f s, %.1f KB/s, errors %.0f%%, "
+                  "%ld samples, %ld rejected, cache %ld hits %ld misses",
+                  stat->host, stat->ttfb, stat->throughput / 1024,
+                  stat->error_rate * 100, stat->samples, stat->rejections,
+                  stat->cache_hits, stat->cache_misses);
+    }
+    apr_thread_mutex_unlock(gateways->mutex);
+}
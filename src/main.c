@@ -1,6 +1,6 @@
 #include "config.h"
 #include "const.h"
-#include "database.h"
+#include "context.h"
 #include "decode.h"
 #include "dir.h"
 #include "download.h"
@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 void initialize_pool(apr_pool_t **pool) {
     if (apr_initialize() != APR_SUCCESS) {
@@ -38,79 +39,167 @@ FILE *setup_logging(const char *config_file, config_t **config) {
     return fp;
 }
 
-void play_files(file_downloaded_t *file_downloaded, int num_files,
-                int num_tracks, char *output, char *pipe_name) {
-    for (int i = 0; i < num_files; ++i) {
-        if (file_downloaded[i].file_download_status == DOWNLOAD_SUCCEEDED) {
-            char *file_path =
-                util_get_file_path(output, file_downloaded[i].filename);
-            log_trace("main: start playing %s", file_downloaded[i].filename);
-
-            log_trace("PLAYING: %s", file_downloaded[i].filename);
-            fprintf(stdout, "%-*s: %s\n", WIDTH + 2, "PLAYING",
-                    file_downloaded[i].filename);
-            log_trace("track: %d / %d", file_downloaded[i].track_id,
-                      num_tracks);
-            fprintf(stdout, "  %-*s: %d / %d\n", WIDTH, "track",
-                    file_downloaded[i].track_id, num_tracks);
-            log_trace("path: %s", file_downloaded[i].album_path);
-            fprintf(stdout, "  %-*s: %s\n", WIDTH, "path",
-                    file_downloaded[i].album_path);
-            log_trace("filename: %s", file_downloaded[i].track_name);
-            fprintf(stdout, "  %-*s: %s\n", WIDTH, "filename",
-                    file_downloaded[i].track_name);
-
-            decode_audio(pipe_name, file_downloaded[i].filename, file_path);
-            log_trace("main: finish playing %s", file_downloaded[i].filename);
-            free(file_path);
+static void print_track(char *filename, int track_id, int num_tracks,
+                        char *album_path, char *track_name) {
+    log_trace("PLAYING: %s", filename);
+    fprintf(stdout, "%-*s: %s\n", WIDTH + 2, "PLAYING", filename);
+    log_trace("track: %d / %d", track_id, num_tracks);
+    fprintf(stdout, "  %-*s: %d / %d\n", WIDTH, "track", track_id, num_tracks);
+    log_trace("path: %s", album_path);
+    fprintf(stdout, "  %-*s: %s\n", WIDTH, "path", album_path);
+    log_trace("filename: %s", track_name);
+    fprintf(stdout, "  %-*s: %s\n", WIDTH, "filename", track_name);
+}
+
+// A batch downloads into its own area below the output directory, so the
+// next batches can be prefetched while this one is playing
+typedef struct {
+    apr_pool_t *pool;
+    config_t *config;
+    file_info_t *infos;
+    download_t *download;
+    char *area;
+    long blocks;
+    apr_time_t blocked;
+} batch_t;
+
+// Tracks play in order as soon as each one is ready, so a slow track later
+// in the batch never holds back the ones before it
+void play_files(batch_t *batch) {
+    config_t *config = batch->config;
+    file_info_t *infos = batch->infos;
+
+    for (int i = 0; i < config->num_files; ++i) {
+        download_set_playing(batch->download, i);
+        apr_time_t waited = download_wait_track(&infos[i]);
+        if (waited > 0) {
+            batch->blocks++;
+            batch->blocked += waited;
         }
+        if (infos[i].file_download_status != DOWNLOAD_SUCCEEDED) {
+            continue;
+        }
+
+        char *file_path = util_get_file_path(config->output, infos[i].filename);
+        log_trace("main: start playing %s", infos[i].filename);
+        print_track(infos[i].filename, infos[i].track_id, config->num_tracks,
+                    infos[i].album_path, infos[i].track_name);
+
+        decode_audio(config->pipe_name, infos[i].filename, file_path);
+        log_trace("main: finish playing %s", infos[i].filename);
+        free(file_path);
     }
 }
 
-void process_files(apr_pool_t *pool, const char *config_file,
-                   config_t **config) {
-    apr_pool_t *subp1;
-    apr_pool_create(&subp1, pool);
+void stream_files(batch_t *batch) {
+    config_t *config = batch->config;
+    file_info_t *infos = batch->infos;
 
-    *config = apr_palloc(subp1, sizeof(config_t));
-    config_read(config_file, *config);
-    apr_pool_cleanup_register(subp1, *config, config_free,
-                              apr_pool_cleanup_null);
+    for (int i = 0; i < config->num_files; ++i) {
+        download_set_playing(batch->download, i);
+        log_trace("main: start streaming %s", infos[i].filename);
+        print_track(infos[i].filename, infos[i].track_id, config->num_tracks,
+                    infos[i].album_path, infos[i].track_name);
+
+        decode_audio_stream(config->pipe_name, infos[i].filename,
+                            infos[i].stream);
+        log_trace("main: finish streaming %s", infos[i].filename);
+
+        apr_time_t stalled;
+        batch->blocks += stream_stalls(infos[i].stream, &stalled);
+        batch->blocked += stalled;
+    }
+}
+
+// How often playback had to wait for a download is what the download
+// priorities are tuned against
+static void log_blocked(batch_t *batch) {
+    log_trace("Player blocked: %ld times, %.3f seconds", batch->blocks,
+              (double)batch->blocked / APR_USEC_PER_SEC);
+    fprintf(stdout, "Player blocked: %ld times, %.3f seconds\n",
+            batch->blocks, (double)batch->blocked / APR_USEC_PER_SEC);
+}
+
+static void open_area(batch_t *batch, int seq) {
+    config_t *config = batch->config;
+    batch->area = apr_psprintf(batch->pool, "%s/%d", config->output, seq);
+    dir_create(batch->pool, batch->area);
 
-    sqlite3 *db;
-    database_open_readonly((*config)->db, &db);
-    apr_pool_cleanup_register(subp1, db, database_close, apr_pool_cleanup_null);
+    free(config->output);
+    config->output = strdup(batch->area);
+}
 
-    (*config)->num_tracks = database_count_tracks(db);
-    dir_delete(subp1, (*config)->output);
-    dir_create(subp1, (*config)->output);
+batch_t *start_batch(apr_pool_t *pool, const char *config_file,
+                     context_t *context, int seq) {
+    apr_pool_t *subpool;
+    apr_pool_create(&subpool, pool);
 
-    file_info_t *file_infos =
-        apr_palloc(subp1, (*config)->num_files * sizeof(file_info_t));
-    file_infos_t *file_infos_cleaner = apr_palloc(subp1, sizeof(file_infos_t));
-    file_infos_cleaner->file_infos = file_infos;
-    file_infos_cleaner->num_files = (*config)->num_files;
-    apr_pool_cleanup_register(subp1, file_infos_cleaner, download_cleanup,
+    batch_t *batch = apr_pcalloc(subpool, sizeof(batch_t));
+    batch->pool = subpool;
+    batch->config = apr_palloc(subpool, sizeof(config_t));
+    config_t *config = batch->config;
+    config_read(config_file, config);
+    apr_pool_cleanup_register(subpool, config, config_free,
                               apr_pool_cleanup_null);
 
-    download_init(file_infos, *config, db);
-    download_files(subp1, file_infos, *config);
-    assemble_files(file_infos, *config);
+    catalog_refresh(context->catalog);
+    config->num_tracks = catalog_count_tracks(context->catalog);
+    open_area(batch, seq);
 
-    apr_pool_t *subp2;
-    apr_pool_create(&subp2, pool);
+    batch->infos = apr_palloc(subpool, config->num_files * sizeof(file_info_t));
+    file_infos_t *file_infos_cleaner =
+        apr_palloc(subpool, sizeof(file_infos_t));
+    file_infos_cleaner->file_infos = batch->infos;
+    file_infos_cleaner->num_files = config->num_files;
+    apr_pool_cleanup_register(subpool, file_infos_cleaner, download_cleanup,
+                              apr_pool_cleanup_null);
 
-    file_downloaded_t *file_downloaded =
-        downloaded_files(subp2, file_infos, *config);
-    char *output = apr_pstrdup(subp2, (*config)->output);
-    char *pipe_name = apr_pstrdup(subp2, (*config)->pipe_name);
-    int num_files = (*config)->num_files;
-    int num_tracks = (*config)->num_tracks;
+    log_trace("main: start batch %d", seq);
+    download_init(subpool, batch->infos, config, context);
+    batch->download =
+        download_start(subpool, batch->infos, config, context, seq);
+    return batch;
+}
 
-    apr_pool_destroy(subp1);
+void play_batch(apr_pool_t *pool, batch_t *batch) {
+    config_t *config = batch->config;
+
+    if (config->stream) {
+        // Tracks play straight from their CID files while downloads continue
+        stream_files(batch);
+    } else {
+        play_files(batch);
+    }
+    download_wait(batch->download);
+    log_blocked(batch);
 
-    play_files(file_downloaded, num_files, num_tracks, output, pipe_name);
-    apr_pool_destroy(subp2);
+    apr_pool_t *subpool;
+    apr_pool_create(&subpool, pool);
+    char *area = apr_pstrdup(subpool, batch->area);
+    apr_pool_destroy(batch->pool);
+    dir_delete(subpool, area);
+    log_trace("main: finish batch %s", area);
+    apr_pool_destroy(subpool);
+}
+
+void process_files(apr_pool_t *pool, const char *config_file, config_t *config,
+                   context_t *context) {
+    dir_delete(pool, config->output);
+    dir_create(pool, config->output);
+
+    // Batch N plays while up to `prefetch` later batches download
+    int depth = config->prefetch > 0 ? config->prefetch + 1 : 1;
+    batch_t **batches = apr_pcalloc(pool, depth * sizeof(batch_t *));
+    int seq = 0;
+    for (; seq < depth; ++seq) {
+        batches[seq] = start_batch(pool, config_file, context, seq);
+    }
+
+    for (int current = 0;; ++current) {
+        play_batch(pool, batches[current % depth]);
+        batches[current % depth] =
+            start_batch(pool, config_file, context, seq++);
+    }
 }
 
 int main(int argc, const char *argv[]) {
@@ -125,12 +214,42 @@ int main(int argc, const char *argv[]) {
     config_t *config = NULL;
     FILE *fp = setup_logging(argv[1], &config);
 
+    context_t *context = apr_pcalloc(pool, sizeof(context_t));
+    context->conn = conn_create(pool);
+    apr_pool_cleanup_register(pool, context->conn, conn_destroy,
+                              apr_pool_cleanup_null);
+    context->gateways = gateway_create(pool);
+    context->flight = flight_create(pool);
+    // One scheduler for every batch in flight, so prefetching does not
+    // multiply the bandwidth and gateway caps
+    context->sched = sched_create(pool);
+    apr_pool_cleanup_register(pool, context->sched, sched_destroy,
+                              apr_pool_cleanup_null);
+    context->cache = cache_create(pool);
+    apr_pool_cleanup_register(pool, context->cache, cache_destroy,
+                              apr_pool_cleanup_null);
+
     log_trace("start main");
-    while (true) {
-        log_trace("start while");
-        process_files(pool, argv[1], &config);
-        log_trace("finish while");
+    config = apr_palloc(pool, sizeof(config_t));
+    config_read(argv[1], config);
+    apr_pool_cleanup_register(pool, config, config_free, apr_pool_cleanup_null);
+    // The catalog and its prepared statements are kept for the whole run
+    context->catalog =
+        catalog_open(pool, config->db, config->catalog_snapshot);
+    apr_pool_cleanup_register(pool, context->catalog, catalog_close,
+                              apr_pool_cleanup_null);
+    context->shuffle = shuffle_create(pool, config->shuffle_state);
+    context->picker = picker_create(pool, context->catalog,
+                                    config->picker_state);
+    apr_pool_cleanup_register(pool, context->picker, picker_destroy,
+                              apr_pool_cleanup_null);
+    if (config->local_rpc) {
+        context->pinner =
+            pin_create(pool, config->local_rpc, config->local_pins);
+        apr_pool_cleanup_register(pool, context->pinner, pin_destroy,
+                                  apr_pool_cleanup_null);
     }
+    process_files(pool, argv[1], config, context);
     log_trace("finish main");
 
     fclose(fp);
@@ -0,0 +1,328 @@
+#include "picker.h"
+#include "alias.h"
+#include "log.h"
+#include <apr_random.h>
+#include <apr_strings.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Weighted track selection, the alternative to the shuffle when the config
+// says `"selection": "weighted"`. Every track in [min_value, num_tracks]
+// starts from weight 1, multiplied by 1 + its rating and by its boost when
+// the catalog has them, and divided by the size of its album with
+// `weight_album`, so every album is as likely as every other. The last
+// `weight_recent` tracks drawn keep `weight_recent_percent` of their
+// weight until they drop out of that window.
+//
+// Draws come from an alias table indexed by track ID. Recent plays only
+// touch the blocks of the tracks involved, so the table is patched rather
+// than rebuilt after every batch. A catalog change or a change to the
+// weighting settings reloads every weight, but still only rebuilds the
+// blocks whose weights moved.
+//
+// The recent window is persisted after every draw, like the shuffle's
+// cursor, so a restart does not forget what was just played.
+
+typedef struct {
+    int min_value;
+    int max_value;
+    int album;
+    int recent;
+    int recent_percent;
+    long generation;
+} picker_settings_t;
+
+struct picker {
+    catalog_t *catalog;
+    char *state_file;
+    char *tmp_file;
+    picker_settings_t settings;
+    alias_t *alias;
+    double *base;
+    // How often each track appears in the recent window
+    uint16_t *recent_count;
+    int *recent;
+    int num_recent;
+    int next_recent;
+    // The window to put back on the next reload, oldest first: the one
+    // loaded from state_file, or the one a resize is about to free
+    int *saved;
+    int num_saved;
+    uint64_t state;
+    long draws;
+    long reloads;
+    long rebuilt_blocks;
+};
+
+static void *alloc(size_t count, size_t size) {
+    void *data = calloc(count ? count : 1, size);
+    if (!data) {
+        log_trace("picker: Memory allocation failed");
+        exit(-1);
+    }
+    return data;
+}
+
+static void load_state(picker_t *picker) {
+    json_error_t error;
+    json_t *root = json_load_file(picker->state_file, 0, &error);
+    if (!root) {
+        log_trace("picker: No recent tracks loaded from %s",
+                  picker->state_file);
+        return;
+    }
+
+    json_t *array = json_object_get(root, "recent");
+    if (!json_is_array(array)) {
+        log_trace("picker: Ignoring malformed %s", picker->state_file);
+        json_decref(root);
+        return;
+    }
+    picker->saved = alloc(json_array_size(array), sizeof(int));
+    for (size_t i = 0; i < json_array_size(array); ++i) {
+        json_t *obj = json_array_get(array, i);
+        if (!json_is_integer(obj)) {
+            log_trace("picker: Ignoring malformed %s", picker->state_file);
+            picker->num_saved = 0;
+            break;
+        }
+        picker->saved[picker->num_saved++] = json_integer_value(obj);
+    }
+
+    log_trace("picker: Loaded %d recent tracks from %s", picker->num_saved,
+              picker->state_file);
+    json_decref(root);
+}
+
+static void save_state(picker_t *picker) {
+    json_t *array = json_array();
+    int oldest = picker->num_recent == picker->settings.recent
+                     ? picker->next_recent
+                     : 0;
+    for (int i = 0; i < picker->num_recent; ++i) {
+        int track_id =
+            picker->recent[(oldest + i) % picker->settings.recent];
+        json_array_append_new(array, json_integer(track_id));
+    }
+    json_t *root = json_object();
+    json_object_set_new(root, "recent", array);
+
+    if (json_dump_file(root, picker->tmp_file, JSON_INDENT(2)) != 0 ||
+        rename(picker->tmp_file, picker->state_file) != 0) {
+        log_trace("picker_draw: Failed to write %s", picker->state_file);
+    }
+    json_decref(root);
+}
+
+picker_t *picker_create(apr_pool_t *pool, catalog_t *catalog,
+                        const char *state_file) {
+    picker_t *picker = apr_pcalloc(pool, sizeof(picker_t));
+    picker->catalog = catalog;
+    picker->state_file = apr_pstrdup(pool, state_file);
+    picker->tmp_file = apr_pstrcat(pool, state_file, ".tmp", NULL);
+    apr_generate_random_bytes((unsigned char *)&picker->state,
+                              sizeof(picker->state));
+    load_state(picker);
+    return picker;
+}
+
+static void release(picker_t *picker) {
+    if (picker->alias) {
+        alias_destroy(picker->alias);
+        picker->alias = NULL;
+    }
+    free(picker->base);
+    free(picker->recent_count);
+    free(picker->recent);
+    picker->base = NULL;
+    picker->recent_count = NULL;
+    picker->recent = NULL;
+}
+
+apr_status_t picker_destroy(void *data) {
+    picker_t *picker = (picker_t *)data;
+    release(picker);
+    free(picker->saved);
+    picker->saved = NULL;
+    return APR_SUCCESS;
+}
+
+static uint64_t next_random(picker_t *picker) {
+    uint64_t x = (picker->state += 0x9e3779b97f4a7c15ULL);
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static double track_weight(picker_t *picker, int track_id) {
+    double weight = picker->base[track_id];
+    if (picker->recent_count[track_id] > 0) {
+        weight = weight * picker->settings.recent_percent / 100.0;
+    }
+    return weight;
+}
+
+static void weigh_track(int track_id, int album_tracks, double rating,
+                        double boost, void *data) {
+    picker_t *picker = (picker_t *)data;
+    if (track_id < picker->settings.min_value ||
+        track_id > picker->settings.max_value) {
+        return;
+    }
+    double weight = 1.0;
+    if (rating >= 0) {
+        weight *= 1.0 + rating;
+    }
+    if (boost >= 0) {
+        weight *= boost;
+    }
+    if (picker->settings.album && album_tracks > 0) {
+        weight /= album_tracks;
+    }
+    picker->base[track_id] = weight;
+}
+
+static void remember(picker_t *picker, int track_id);
+
+// Copies the recent window, oldest first, into `saved` so that the reload
+// which frees it can put it back
+static void keep_window(picker_t *picker) {
+    if (!picker->recent || picker->saved) {
+        return;
+    }
+    picker->saved = alloc(picker->num_recent, sizeof(int));
+    int oldest = picker->num_recent == picker->settings.recent
+                     ? picker->next_recent
+                     : 0;
+    for (int i = 0; i < picker->num_recent; ++i) {
+        picker->saved[i] =
+            picker->recent[(oldest + i) % picker->settings.recent];
+    }
+    picker->num_saved = picker->num_recent;
+}
+
+// Loads every weight from the catalog. Only blocks with a changed weight
+// are rebuilt, unless the range or the recent window changed size, in
+// which case everything starts over.
+static void reload(picker_t *picker, picker_settings_t *settings) {
+    int num_items = settings->max_value + 1;
+    if (!picker->alias || settings->max_value != picker->settings.max_value ||
+        settings->recent != picker->settings.recent) {
+        keep_window(picker);
+        release(picker);
+        picker->alias = alias_create(num_items);
+        picker->base = alloc(num_items, sizeof(double));
+        picker->recent_count = alloc(num_items, sizeof(uint16_t));
+        picker->recent = alloc(settings->recent, sizeof(int));
+        picker->num_recent = 0;
+        picker->next_recent = 0;
+    }
+    picker->settings = *settings;
+
+    memset(picker->base, 0, num_items * sizeof(double));
+    catalog_scan_weights(picker->catalog, weigh_track, picker);
+    for (int i = 0; i < num_items; ++i) {
+        alias_set(picker->alias, i, track_weight(picker, i));
+    }
+    // The window from the last run or from before the resize, minus tracks
+    // that are out of range now
+    for (int i = 0; i < picker->num_saved; ++i) {
+        if (picker->saved[i] >= settings->min_value &&
+            picker->saved[i] <= settings->max_value) {
+            remember(picker, picker->saved[i]);
+        }
+    }
+    free(picker->saved);
+    picker->saved = NULL;
+    picker->num_saved = 0;
+    picker->rebuilt_blocks += alias_build(picker->alias);
+    picker->reloads++;
+    log_trace("picker: Loaded weights for %d..%d, total %.1f",
+              settings->min_value, settings->max_value,
+              alias_total(picker->alias));
+}
+
+static void remember(picker_t *picker, int track_id) {
+    if (picker->settings.recent <= 0) {
+        return;
+    }
+    if (picker->num_recent == picker->settings.recent) {
+        int old = picker->recent[picker->next_recent];
+        picker->recent_count[old]--;
+        alias_set(picker->alias, old, track_weight(picker, old));
+    } else {
+        picker->num_recent++;
+    }
+    picker->recent[picker->next_recent] = track_id;
+    picker->next_recent = (picker->next_recent + 1) % picker->settings.recent;
+    if (picker->recent_count[track_id] < UINT16_MAX) {
+        picker->recent_count[track_id]++;
+    }
+    alias_set(picker->alias, track_id, track_weight(picker, track_id));
+}
+
+static int same_settings(picker_settings_t *a, picker_settings_t *b) {
+    return a->min_value == b->min_value && a->max_value == b->max_value &&
+           a->album == b->album && a->recent == b->recent &&
+           a->recent_percent == b->recent_percent &&
+           a->generation == b->generation;
+}
+
+// Fills `track_ids` with distinct tracks drawn by weight
+void picker_draw(picker_t *picker, config_t *config, int *track_ids,
+                 int num_tracks) {
+    picker_settings_t settings = {
+        .min_value = config->min_value,
+        .max_value = config->num_tracks,
+        .album = config->weight_album,
+        .recent = config->weight_recent > 0 ? config->weight_recent : 0,
+        .recent_percent = config->weight_recent_percent,
+        .generation = catalog_generation(picker->catalog),
+    };
+    if (!picker->alias || !same_settings(&settings, &picker->settings)) {
+        reload(picker, &settings);
+    }
+    if (alias_total(picker->alias) <= 0) {
+        log_trace("picker_draw: No track has any weight");
+        exit(-1);
+    }
+
+    long attempts = 0;
+    for (int i = 0; i < num_tracks;) {
+        if (++attempts > 1000L * num_tracks + 100000) {
+            log_trace("picker_draw: Too few weighted tracks for %d",
+                      num_tracks);
+            exit(-1);
+        }
+        uint64_t r0 = next_random(picker);
+        uint64_t r1 = next_random(picker);
+        int track_id = alias_sample(picker->alias, r0, r1);
+        int repeated = 0;
+        for (int j = 0; j < i && !repeated; ++j) {
+            repeated = track_ids[j] == track_id;
+        }
+        if (!repeated) {
+            track_ids[i++] = track_id;
+        }
+    }
+
+    for (int i = 0; i < num_tracks; ++i) {
+        remember(picker, track_ids[i]);
+    }
+    picker->rebuilt_blocks += alias_build(picker->alias);
+    picker->draws += num_tracks;
+    save_state(picker);
+}
+
+void picker_log(picker_t *picker) {
+    if (!picker->alias) {
+        return;
+    }
+    fprintf(stdout, "Weighted: %ld tracks drawn, total weight %.1f, "
+                    "%ld reloads, %ld blocks rebuilt\n",
+            picker->draws, alias_total(picker->alias), picker->reloads,
+            picker->rebuilt_blocks);
+}
@@ -0,0 +1,201 @@
+#include "pin.h"
+#include "log.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_pool.h>
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pins upcoming CIDs on the local IPFS node through its RPC API, so that
+// by the time a track is downloaded the local gateway can serve it from
+// its blockstore. Requests run one at a time on a background thread and
+// only the most recent `max_pins` CIDs are kept pinned; the oldest is
+// unpinned to make room for a new one.
+
+#define PIN_TIMEOUT 600L
+#define UNPIN_TIMEOUT 30L
+
+typedef enum { PIN_ADD, PIN_RM } pin_op_t;
+
+struct pinner {
+    apr_thread_pool_t *thread_pool;
+    apr_thread_mutex_t *mutex;
+    char *rpc;
+    char **pinned;
+    int max_pins;
+    int num_pinned;
+    int next_pin;
+    volatile apr_uint32_t stopping;
+    long pins;
+    long unpins;
+    long failures;
+};
+
+typedef struct {
+    pinner_t *pinner;
+    pin_op_t op;
+    char *cid;
+} pin_task_t;
+
+pinner_t *pin_create(apr_pool_t *pool, const char *rpc, int max_pins) {
+    pinner_t *pinner = apr_pcalloc(pool, sizeof(pinner_t));
+    pinner->rpc = apr_pstrdup(pool, rpc);
+    pinner->max_pins = max_pins > 0 ? max_pins : 1;
+    pinner->pinned = apr_pcalloc(pool, pinner->max_pins * sizeof(char *));
+    apr_thread_mutex_create(&pinner->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+
+    if (apr_thread_pool_create(&pinner->thread_pool, 0, 1, pool) !=
+        APR_SUCCESS) {
+        log_trace("pin_create: Failed to create thread pool");
+        exit(-1);
+    }
+    return pinner;
+}
+
+// Pins stay on the node after exit, so the next run starts warm
+apr_status_t pin_destroy(void *data) {
+    pinner_t *pinner = (pinner_t *)data;
+    apr_atomic_set32(&pinner->stopping, 1);
+    apr_thread_pool_destroy(pinner->thread_pool);
+    for (int i = 0; i < pinner->num_pinned; ++i) {
+        free(pinner->pinned[i]);
+    }
+    return APR_SUCCESS;
+}
+
+static size_t discard_callback(void *ptr, size_t size, size_t nmemb,
+                               void *userdata) {
+    return size * nmemb;
+}
+
+// Aborts a pin that is still fetching blocks when the pinner shuts down
+static int progress_callback(void *data, curl_off_t dltotal, curl_off_t dlnow,
+                             curl_off_t ultotal, curl_off_t ulnow) {
+    pinner_t *pinner = (pinner_t *)data;
+    return apr_atomic_read32(&pinner->stopping) != 0;
+}
+
+static int rpc_call(pinner_t *pinner, pin_op_t op, const char *cid) {
+    char url[512];
+    long response_code = 0;
+
+    snprintf(url, sizeof(url), "http://%s/api/v0/pin/%s?arg=%s%s",
+             pinner->rpc, op == PIN_ADD ? "add" : "rm", cid,
+             op == PIN_ADD ? "&progress=false" : "");
+
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return 0;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_callback);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT,
+                     op == PIN_ADD ? PIN_TIMEOUT : UNPIN_TIMEOUT);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, pinner);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK || response_code != 200) {
+        log_trace("pin: %s %s failed: %s (HTTP %ld)",
+                  op == PIN_ADD ? "pin" : "unpin", cid,
+                  curl_easy_strerror(res), response_code);
+        return 0;
+    }
+    return 1;
+}
+
+static void *APR_THREAD_FUNC pin_task(apr_thread_t *thread, void *data) {
+    pin_task_t *task = (pin_task_t *)data;
+    pinner_t *pinner = task->pinner;
+
+    if (!apr_atomic_read32(&pinner->stopping)) {
+        log_trace("pin: %s %s", task->op == PIN_ADD ? "pinning" : "unpinning",
+                  task->cid);
+        int succeeded = rpc_call(pinner, task->op, task->cid);
+
+        apr_thread_mutex_lock(pinner->mutex);
+        if (!succeeded) {
+            pinner->failures++;
+        } else if (task->op == PIN_ADD) {
+            pinner->pins++;
+        } else {
+            pinner->unpins++;
+        }
+        apr_thread_mutex_unlock(pinner->mutex);
+    }
+
+    free(task->cid);
+    free(task);
+    return NULL;
+}
+
+static void push_task(pinner_t *pinner, pin_op_t op, char *cid) {
+    pin_task_t *task = (pin_task_t *)malloc(sizeof(pin_task_t));
+    if (!task) {
+        log_trace("pin_submit: Memory allocation failed");
+        exit(-1);
+    }
+    task->pinner = pinner;
+    task->op = op;
+    task->cid = cid;
+    if (apr_thread_pool_push(pinner->thread_pool, pin_task, task,
+                             APR_THREAD_TASK_PRIORITY_NORMAL,
+                             NULL) != APR_SUCCESS) {
+        log_trace("pin_submit: Failed to queue %s", cid);
+        free(cid);
+        free(task);
+    }
+}
+
+static int is_pinned(pinner_t *pinner, const char *cid) {
+    for (int i = 0; i < pinner->num_pinned; ++i) {
+        if (strcmp(pinner->pinned[i], cid) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Tasks run in submission order, so an unpin of the oldest CID always
+// comes after its own pin
+void pin_submit(pinner_t *pinner, const char *cid) {
+    apr_thread_mutex_lock(pinner->mutex);
+    if (is_pinned(pinner, cid)) {
+        apr_thread_mutex_unlock(pinner->mutex);
+        return;
+    }
+
+    char *evicted = NULL;
+    if (pinner->num_pinned == pinner->max_pins) {
+        evicted = pinner->pinned[pinner->next_pin];
+    } else {
+        pinner->num_pinned++;
+    }
+    pinner->pinned[pinner->next_pin] = strdup(cid);
+    pinner->next_pin = (pinner->next_pin + 1) % pinner->max_pins;
+    apr_thread_mutex_unlock(pinner->mutex);
+
+    if (evicted) {
+        push_task(pinner, PIN_RM, evicted);
+    }
+    push_task(pinner, PIN_ADD, strdup(cid));
+}
+
+void pin_log(pinner_t *pinner) {
+    apr_thread_mutex_lock(pinner->mutex);
+    log_trace("Pinning: %ld pinned, %ld unpinned, %ld failed", pinner->pins,
+              pinner->unpins, pinner->failures);
+    fprintf(stdout, "Pinning: %ld pinned, %ld unpinned, %ld failed\n",
+            pinner->pins, pinner->unpins, pinner->failures);
+    apr_thread_mutex_unlock(pinner->mutex);
+}
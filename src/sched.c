@@ -0,0 +1,508 @@
+#include "sched.h"
+#include "log.h"
+#include <apr_atomic.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Download budgets. A global token bucket caps the bytes per second taken
+// from the uplink, and every gateway has a cap on concurrent transfers and
+// on requests per second. The number of transfers in flight follows an
+// AIMD window driven by aggregate throughput, timeouts and 429s.
+//
+// One scheduler is shared by every batch in flight, so the caps hold for
+// the whole process however many batches prefetch, and the window carries
+// over from one batch to the next. Each batch runs on its own engine
+// thread, so every call takes the mutex.
+//
+// Ranks order transfers across batches, most urgent lowest. Each batch in
+// flight has a slot where it posts the rank of the most urgent transfer
+// it has waiting for a place in the window, and a transfer that ranks
+// below any posted one is not admitted. A prefetch batch thus only takes
+// the slots the playing batch leaves unused. Transfers paused by the
+// bandwidth bucket are posted the same way, and while any are, less urgent
+// transfers of every batch stand aside and get no tokens.
+
+#define MIN_BURST 65536.0
+#define ADAPT_INTERVAL apr_time_from_sec(1)
+#define GAIN_THRESHOLD 1.05
+#define PER_TRANSFER_DROP 0.5
+#define BACKOFF_FACTOR 0.5
+
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    apr_time_t last;
+} bucket_t;
+
+typedef struct {
+    char *host;
+    int active;
+    bucket_t requests;
+    apr_time_t waited;
+    long waits;
+} gateway_budget_t;
+
+// The limits of the config last synced. Copied, since configs live only as
+// long as their batch.
+typedef struct {
+    int max_bandwidth;
+    int min_concurrency;
+    int max_concurrency;
+    int gateway_max_connections;
+    int gateway_max_rps;
+} sched_limits_t;
+
+typedef struct {
+    int used;
+    int64_t window;
+    int64_t bandwidth;
+} sched_slot_t;
+
+struct sched {
+    apr_pool_t *pool;
+    apr_thread_mutex_t *mutex;
+    sched_limits_t limits;
+    bucket_t bandwidth;
+    apr_time_t throttled;
+    long throttles;
+    // Budgets are kept per host and survive config changes; `active` maps
+    // the gateway indices of the current config onto them
+    gateway_budget_t *gateways;
+    int num_gateways;
+    int *active;
+    int num_active;
+    int in_flight;
+    int window;
+    int slow_start;
+    int limited;
+    double bytes;
+    double last_rate;
+    double last_per_transfer;
+    apr_time_t last_adapt;
+    apr_time_t last_backoff;
+    long increases;
+    long decreases;
+    sched_slot_t *slots;
+    int num_slots;
+    volatile apr_uint32_t playing;
+};
+
+static void bucket_init(bucket_t *bucket, double rate, double burst) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->last = apr_time_now();
+}
+
+static void bucket_refill(bucket_t *bucket, apr_time_t now) {
+    bucket->tokens += bucket->rate * (now - bucket->last) / APR_USEC_PER_SEC;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last = now;
+}
+
+// The scheduler starts without limits until sched_sync()
+sched_t *sched_create(apr_pool_t *pool) {
+    sched_t *sched = apr_pcalloc(pool, sizeof(sched_t));
+    sched->pool = pool;
+    apr_thread_mutex_create(&sched->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    bucket_init(&sched->bandwidth, 0, MIN_BURST);
+    sched->window = 1;
+    sched->slow_start = 1;
+    sched->last_adapt = apr_time_now();
+    return sched;
+}
+
+static int find_budget(sched_t *sched, const char *host) {
+    for (int i = 0; i < sched->num_gateways; ++i) {
+        if (strcmp(sched->gateways[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int add_budget(sched_t *sched, const char *host, double rps) {
+    gateway_budget_t *gateways = (gateway_budget_t *)realloc(
+        sched->gateways, (sched->num_gateways + 1) * sizeof(gateway_budget_t));
+    if (!gateways) {
+        log_trace("sched: Memory allocation failed");
+        exit(-1);
+    }
+    sched->gateways = gateways;
+
+    gateway_budget_t *budget = &sched->gateways[sched->num_gateways];
+    memset(budget, 0, sizeof(gateway_budget_t));
+    budget->host = apr_pstrdup(sched->pool, host);
+    bucket_init(&budget->requests, rps, rps > 1 ? rps : 1);
+    return sched->num_gateways++;
+}
+
+static void set_rate(bucket_t *bucket, double rate, double burst) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+}
+
+static int clamp_window(sched_t *sched, int window);
+
+// Takes the limits and gateways of a batch's config. Gateway indices
+// follow the config last synced, as they do in gateway_sync(). Tokens,
+// transfers in flight and the window are kept.
+void sched_sync(sched_t *sched, config_t *config) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched_limits_t *limits = &sched->limits;
+    limits->max_bandwidth = config->max_bandwidth;
+    limits->min_concurrency = config->min_concurrency;
+    limits->max_concurrency = config->max_concurrency;
+    limits->gateway_max_connections = config->gateway_max_connections;
+    limits->gateway_max_rps = config->gateway_max_rps;
+
+    // A quarter second of burst keeps other users of the link responsive
+    double burst = config->max_bandwidth / 4.0;
+    set_rate(&sched->bandwidth, config->max_bandwidth,
+             burst > MIN_BURST ? burst : MIN_BURST);
+
+    int *active =
+        (int *)realloc(sched->active, config->num_gateways * sizeof(int));
+    if (config->num_gateways > 0 && !active) {
+        log_trace("sched_sync: Memory allocation failed");
+        exit(-1);
+    }
+    sched->active = active;
+    sched->num_active = config->num_gateways;
+
+    double rps = config->gateway_max_rps;
+    for (int i = 0; i < config->num_gateways; ++i) {
+        int index = find_budget(sched, config->gateways[i]);
+        if (index < 0) {
+            index = add_budget(sched, config->gateways[i], rps);
+        }
+        set_rate(&sched->gateways[index].requests, rps, rps > 1 ? rps : 1);
+        sched->active[i] = index;
+    }
+
+    sched->window = clamp_window(sched, sched->window);
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+apr_status_t sched_destroy(void *data) {
+    sched_t *sched = (sched_t *)data;
+    free(sched->gateways);
+    free(sched->active);
+    free(sched->slots);
+    return APR_SUCCESS;
+}
+
+static gateway_budget_t *budget_for(sched_t *sched, int gateway) {
+    if (gateway < 0 || gateway >= sched->num_active) {
+        return NULL;
+    }
+    return &sched->gateways[sched->active[gateway]];
+}
+
+static int64_t bandwidth_waiter(sched_t *sched) {
+    int64_t rank = SCHED_IDLE;
+    for (int i = 0; i < sched->num_slots; ++i) {
+        if (sched->slots[i].used && sched->slots[i].bandwidth < rank) {
+            rank = sched->slots[i].bandwidth;
+        }
+    }
+    return rank;
+}
+
+// Lets a write through while the bucket is not in debt and no more urgent
+// transfer waits for tokens. The caller pauses the transfer when this
+// returns 0 and retries once tokens are back.
+int sched_consume(sched_t *sched, int64_t rank, size_t bytes) {
+    apr_thread_mutex_lock(sched->mutex);
+    if (rank > bandwidth_waiter(sched)) {
+        apr_thread_mutex_unlock(sched->mutex);
+        return 0;
+    }
+    if (sched->limits.max_bandwidth > 0) {
+        bucket_refill(&sched->bandwidth, apr_time_now());
+        if (sched->bandwidth.tokens <= 0) {
+            apr_thread_mutex_unlock(sched->mutex);
+            return 0;
+        }
+        sched->bandwidth.tokens -= bytes;
+    }
+    sched->bytes += bytes;
+    apr_thread_mutex_unlock(sched->mutex);
+    return 1;
+}
+
+int sched_bandwidth_available(sched_t *sched, int64_t rank) {
+    apr_thread_mutex_lock(sched->mutex);
+    int available = rank <= bandwidth_waiter(sched);
+    if (sched->limits.max_bandwidth > 0) {
+        bucket_refill(&sched->bandwidth, apr_time_now());
+        available = available && sched->bandwidth.tokens > 0;
+    }
+    apr_thread_mutex_unlock(sched->mutex);
+    return available;
+}
+
+void sched_throttled(sched_t *sched, apr_time_t waited) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->throttled += waited;
+    sched->throttles++;
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+// Fills `blocked`, one entry per gateway of the config
+void sched_blocked(sched_t *sched, unsigned char *blocked,
+                   int num_gateways) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched_limits_t *limits = &sched->limits;
+    apr_time_t now = apr_time_now();
+
+    for (int i = 0; i < num_gateways; ++i) {
+        gateway_budget_t *budget = budget_for(sched, i);
+        blocked[i] = 0;
+        if (!budget) {
+            continue;
+        }
+        if (limits->gateway_max_connections > 0 &&
+            budget->active >= limits->gateway_max_connections) {
+            blocked[i] = 1;
+        }
+        if (limits->gateway_max_rps > 0) {
+            bucket_refill(&budget->requests, now);
+            if (budget->requests.tokens < 1) {
+                blocked[i] = 1;
+            }
+        }
+    }
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+void sched_acquire(sched_t *sched, int gateway, apr_time_t waited) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->in_flight++;
+    gateway_budget_t *budget = budget_for(sched, gateway);
+    if (budget) {
+        budget->active++;
+        budget->requests.tokens -= 1;
+        if (waited > 0) {
+            budget->waited += waited;
+            budget->waits++;
+        }
+    }
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+void sched_release(sched_t *sched, int gateway) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->in_flight--;
+    gateway_budget_t *budget = budget_for(sched, gateway);
+    if (budget) {
+        budget->active--;
+    }
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+static int clamp_window(sched_t *sched, int window) {
+    sched_limits_t *limits = &sched->limits;
+    int min = limits->min_concurrency > 0 ? limits->min_concurrency : 1;
+    int max = limits->max_concurrency > min ? limits->max_concurrency : min;
+    return window < min ? min : window > max ? max : window;
+}
+
+static void set_window(sched_t *sched, int window, const char *reason) {
+    window = clamp_window(sched, window);
+    if (window == sched->window) {
+        return;
+    }
+    log_trace("sched: concurrency %d -> %d (%s)", sched->window, window,
+              reason);
+    if (window > sched->window) {
+        sched->increases++;
+    } else {
+        sched->decreases++;
+    }
+    sched->window = window;
+}
+
+static int64_t window_waiter(sched_t *sched) {
+    int64_t rank = SCHED_IDLE;
+    for (int i = 0; i < sched->num_slots; ++i) {
+        if (sched->slots[i].used && sched->slots[i].window < rank) {
+            rank = sched->slots[i].window;
+        }
+    }
+    return rank;
+}
+
+// Returns 0 while the transfers in flight fill the window, or while a
+// more urgent transfer of any batch waits for room in it
+int sched_admit(sched_t *sched, int64_t rank) {
+    apr_thread_mutex_lock(sched->mutex);
+    int admitted = sched->in_flight < sched->window;
+    if (!admitted) {
+        sched->limited = 1;
+    }
+    admitted = admitted && rank <= window_waiter(sched);
+    apr_thread_mutex_unlock(sched->mutex);
+    return admitted;
+}
+
+// Gives a batch its slot for posting what it waits for
+int sched_join(sched_t *sched) {
+    apr_thread_mutex_lock(sched->mutex);
+    int slot = 0;
+    while (slot < sched->num_slots && sched->slots[slot].used) {
+        slot++;
+    }
+    if (slot == sched->num_slots) {
+        sched_slot_t *slots = (sched_slot_t *)realloc(
+            sched->slots, (sched->num_slots + 1) * sizeof(sched_slot_t));
+        if (!slots) {
+            log_trace("sched_join: Memory allocation failed");
+            exit(-1);
+        }
+        sched->slots = slots;
+        sched->num_slots++;
+    }
+    sched->slots[slot].used = 1;
+    sched->slots[slot].window = SCHED_IDLE;
+    sched->slots[slot].bandwidth = SCHED_IDLE;
+    apr_thread_mutex_unlock(sched->mutex);
+    return slot;
+}
+
+void sched_leave(sched_t *sched, int slot) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->slots[slot].used = 0;
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+// Posts the rank of the most urgent transfer the batch has waiting for the
+// window, or SCHED_IDLE
+void sched_wait_window(sched_t *sched, int slot, int64_t rank) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->slots[slot].window = rank;
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+// Posts the rank of the most urgent transfer the batch has paused for
+// tokens, or SCHED_IDLE
+void sched_wait_bandwidth(sched_t *sched, int slot, int64_t rank) {
+    apr_thread_mutex_lock(sched->mutex);
+    sched->slots[slot].bandwidth = rank;
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+int64_t sched_window_waiter(sched_t *sched) {
+    apr_thread_mutex_lock(sched->mutex);
+    int64_t rank = window_waiter(sched);
+    apr_thread_mutex_unlock(sched->mutex);
+    return rank;
+}
+
+// Batches are numbered in play order, and ranks count from the one playing
+void sched_play(sched_t *sched, int batch) {
+    apr_atomic_set32(&sched->playing, batch);
+}
+
+int sched_playing(sched_t *sched) {
+    return (int)apr_atomic_read32(&sched->playing);
+}
+
+static void congested(sched_t *sched, apr_time_t now, const char *reason) {
+    if (now - sched->last_backoff < ADAPT_INTERVAL) {
+        return;
+    }
+    sched->last_backoff = now;
+    sched->slow_start = 0;
+    set_window(sched, (int)(sched->window * BACKOFF_FACTOR), reason);
+}
+
+// Timeouts and 429s halve the window, at most once per interval so that
+// one burst of failures counts as a single signal
+void sched_congested(sched_t *sched, const char *reason) {
+    apr_thread_mutex_lock(sched->mutex);
+    congested(sched, apr_time_now(), reason);
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+// Once per interval the window grows while it is the limit and aggregate
+// throughput keeps improving, doubling until the first backoff and adding
+// one after that. It shrinks when each transfer gets much less than before
+// without the total improving, i.e. the link or gateways are saturated.
+// Every engine ticks, and whichever comes first in an interval adapts.
+// Callers pass the current time, which lets tests step it.
+void sched_tick(sched_t *sched, apr_time_t now) {
+    apr_thread_mutex_lock(sched->mutex);
+    if (now - sched->last_adapt < ADAPT_INTERVAL) {
+        apr_thread_mutex_unlock(sched->mutex);
+        return;
+    }
+
+    double rate = sched->bytes * APR_USEC_PER_SEC / (now - sched->last_adapt);
+    double per_transfer = rate / (sched->in_flight > 0 ? sched->in_flight : 1);
+    int improving = rate > sched->last_rate * GAIN_THRESHOLD;
+
+    if (sched->limited && improving) {
+        set_window(sched,
+                   sched->slow_start ? sched->window * 2 : sched->window + 1,
+                   "throughput");
+    } else if (!improving && sched->last_per_transfer > 0 &&
+               per_transfer < sched->last_per_transfer * PER_TRANSFER_DROP) {
+        congested(sched, now, "per-transfer rate");
+    }
+
+    sched->last_rate = rate;
+    sched->last_per_transfer = per_transfer;
+    sched->bytes = 0;
+    sched->limited = 0;
+    sched->last_adapt = now;
+    apr_thread_mutex_unlock(sched->mutex);
+}
+
+int sched_window(sched_t *sched) {
+    apr_thread_mutex_lock(sched->mutex);
+    int window = sched->window;
+    apr_thread_mutex_unlock(sched->mutex);
+    return window;
+}
+
+// Totals since the start of the run
+void sched_log(sched_t *sched) {
+    apr_time_t waited = 0;
+    long waits = 0;
+
+    apr_thread_mutex_lock(sched->mutex);
+    for (int i = 0; i < sched->num_gateways; ++i) {
+        gateway_budget_t *budget = &sched->gateways[i];
+        waited += budget->waited;
+        waits += budget->waits;
+        if (budget->waits > 0) {
+            log_trace("sched: %s: %ld transfers waited %.3f seconds",
+                      budget->host, budget->waits,
+                      (double)budget->waited / APR_USEC_PER_SEC);
+        }
+    }
+    log_trace("sched: gateway budgets: %ld waits, %.3f seconds; bandwidth: "
+              "%ld pauses, %.3f seconds",
+              waits, (double)waited / APR_USEC_PER_SEC, sched->throttles,
+              (double)sched->throttled / APR_USEC_PER_SEC);
+    fprintf(stdout,
+            "Waiting: %.3f seconds on gateway budgets, %.3f seconds on "
+            "bandwidth\n",
+            (double)waited / APR_USEC_PER_SEC,
+            (double)sched->throttled / APR_USEC_PER_SEC);
+    log_trace("sched: concurrency %d, %ld increases, %ld decreases",
+              sched->window, sched->increases, sched->decreases);
+    fprintf(stdout, "Concurrency: %d, %ld increases, %ld decreases\n",
+            sched->window, sched->increases, sched->decreases);
+    apr_thread_mutex_unlock(sched->mutex);
+}
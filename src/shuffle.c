@@ -0,0 +1,301 @@
+#include "shuffle.h"
+#include "log.h"
+#include <apr_random.h>
+#include <apr_strings.h>
+#include <inttypes.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// No-repeat shuffle over the whole catalog. A cycle walks a keyed
+// pseudorandom permutation of [min_value, max_value], so every track plays
+// once before any track plays again, and only the key and a cursor need
+// to be kept, not the order itself. The permutation is a Feistel network
+// over the smallest power of 4 covering the range; indices it maps past
+// the end of the range are skipped (cycle walking).
+//
+// Tracks added to the catalog mid-cycle get a segment of their own, and
+// draws pick among segments in proportion to what each has left, so new
+// tracks mix into the rest of the cycle rather than waiting for the next.
+// The state is persisted after every draw so a restart continues the
+// same cycle.
+
+#define FEISTEL_ROUNDS 6
+#define MAX_SEGMENTS 16
+
+typedef struct {
+    // Track IDs lo .. lo + size - 1
+    int64_t lo;
+    int64_t size;
+    int half_bits;
+    // Next permutation index, and how many tracks it has produced
+    uint64_t cursor;
+    int64_t emitted;
+} shuffle_segment_t;
+
+struct shuffle {
+    char *state_file;
+    char *tmp_file;
+    uint64_t key;
+    uint64_t draws;
+    long cycle;
+    int64_t min_value;
+    shuffle_segment_t segments[MAX_SEGMENTS];
+    int num_segments;
+    // Tracks left out of the current cycle because there was no segment
+    // left for them
+    int64_t deferred;
+};
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t random_key(void) {
+    uint64_t key;
+    apr_generate_random_bytes((unsigned char *)&key, sizeof(key));
+    return key;
+}
+
+static uint64_t permute(uint64_t key, int half_bits, uint64_t index) {
+    uint64_t mask = (1ULL << half_bits) - 1;
+    uint64_t left = index >> half_bits;
+    uint64_t right = index & mask;
+    for (int round = 0; round < FEISTEL_ROUNDS; ++round) {
+        uint64_t next = left ^ (mix(key ^ (right << 8) ^ round) & mask);
+        left = right;
+        right = next;
+    }
+    return (left << half_bits) | right;
+}
+
+static int64_t remaining(const shuffle_segment_t *segment) {
+    return segment->size - segment->emitted;
+}
+
+static void add_segment(shuffle_t *shuffle, int64_t lo, int64_t size) {
+    shuffle_segment_t *segment = &shuffle->segments[shuffle->num_segments++];
+    memset(segment, 0, sizeof(shuffle_segment_t));
+    segment->lo = lo;
+    segment->size = size;
+    segment->half_bits = 1;
+    while ((1LL << (2 * segment->half_bits)) < size) {
+        segment->half_bits++;
+    }
+}
+
+static void start_cycle(shuffle_t *shuffle, int min_value, int max_value) {
+    shuffle->key = random_key();
+    shuffle->draws = 0;
+    shuffle->cycle++;
+    shuffle->min_value = min_value;
+    shuffle->num_segments = 0;
+    shuffle->deferred = 0;
+    add_segment(shuffle, min_value, (int64_t)max_value - min_value + 1);
+    log_trace("shuffle: Cycle %ld over %d..%d", shuffle->cycle, min_value,
+              max_value);
+}
+
+// Tracks past the end of the last segment were added since the cycle
+// started. A segment nothing was drawn from yet simply grows.
+static void cover_growth(shuffle_t *shuffle, int max_value) {
+    shuffle_segment_t *last = &shuffle->segments[shuffle->num_segments - 1];
+    int64_t end = last->lo + last->size;
+    if (max_value < end) {
+        return;
+    }
+    int64_t added = (int64_t)max_value - end + 1;
+    if (last->emitted == 0) {
+        int64_t lo = last->lo;
+        shuffle->num_segments--;
+        add_segment(shuffle, lo, last->size + added);
+    } else if (shuffle->num_segments < MAX_SEGMENTS) {
+        add_segment(shuffle, end, added);
+    } else {
+        // Played from the next cycle on
+        shuffle->deferred = added;
+        return;
+    }
+    log_trace("shuffle: %" PRId64 " tracks added mid-cycle", added);
+}
+
+// Weighted by what each segment has left, so every remaining track is
+// equally likely to come next
+static shuffle_segment_t *pick_segment(shuffle_t *shuffle, int64_t left) {
+    uint64_t r = mix(shuffle->key ^ mix(++shuffle->draws));
+    int64_t target = (int64_t)((double)(r >> 11) * 0x1.0p-53 * left);
+    for (int i = 0; i < shuffle->num_segments; ++i) {
+        shuffle_segment_t *segment = &shuffle->segments[i];
+        if (target < remaining(segment)) {
+            return segment;
+        }
+        target -= remaining(segment);
+    }
+    return &shuffle->segments[shuffle->num_segments - 1];
+}
+
+static int64_t next_in(shuffle_t *shuffle, shuffle_segment_t *segment) {
+    uint64_t key = mix(shuffle->key + (uint64_t)(segment - shuffle->segments));
+    for (;;) {
+        uint64_t value = permute(key, segment->half_bits, segment->cursor++);
+        if ((int64_t)value < segment->size) {
+            segment->emitted++;
+            return segment->lo + (int64_t)value;
+        }
+    }
+}
+
+static int64_t count_remaining(shuffle_t *shuffle) {
+    int64_t left = 0;
+    for (int i = 0; i < shuffle->num_segments; ++i) {
+        left += remaining(&shuffle->segments[i]);
+    }
+    return left;
+}
+
+static int next_track(shuffle_t *shuffle, int min_value, int max_value) {
+    for (;;) {
+        int64_t left = count_remaining(shuffle);
+        if (left == 0) {
+            start_cycle(shuffle, min_value, max_value);
+            left = count_remaining(shuffle);
+        }
+        int64_t track_id = next_in(shuffle, pick_segment(shuffle, left));
+        // The catalog shrank; tracks past its end no longer exist
+        if (track_id <= max_value) {
+            return (int)track_id;
+        }
+    }
+}
+
+static void load_state(shuffle_t *shuffle) {
+    json_error_t error;
+    json_t *root = json_load_file(shuffle->state_file, 0, &error);
+    if (!root) {
+        log_trace("shuffle: No cursor loaded from %s", shuffle->state_file);
+        return;
+    }
+
+    const char *key = json_string_value(json_object_get(root, "key"));
+    json_t *array = json_object_get(root, "segments");
+    if (!key || !json_is_array(array) || json_array_size(array) == 0 ||
+        json_array_size(array) > MAX_SEGMENTS) {
+        log_trace("shuffle: Ignoring malformed %s", shuffle->state_file);
+        json_decref(root);
+        return;
+    }
+    shuffle->key = strtoull(key, NULL, 16);
+    shuffle->draws = json_integer_value(json_object_get(root, "draws"));
+    shuffle->cycle = json_integer_value(json_object_get(root, "cycle"));
+    shuffle->min_value =
+        json_integer_value(json_object_get(root, "min_value"));
+    shuffle->deferred = json_integer_value(json_object_get(root, "deferred"));
+    for (size_t i = 0; i < json_array_size(array); ++i) {
+        json_t *obj = json_array_get(array, i);
+        add_segment(shuffle, json_integer_value(json_object_get(obj, "lo")),
+                    json_integer_value(json_object_get(obj, "size")));
+        shuffle_segment_t *segment = &shuffle->segments[i];
+        segment->cursor =
+            json_integer_value(json_object_get(obj, "cursor"));
+        segment->emitted =
+            json_integer_value(json_object_get(obj, "emitted"));
+        if (segment->size <= 0 || segment->emitted < 0 ||
+            segment->emitted > segment->size) {
+            log_trace("shuffle: Ignoring malformed %s", shuffle->state_file);
+            shuffle->num_segments = 0;
+            break;
+        }
+    }
+
+    log_trace("shuffle: Continuing cycle %ld from %s", shuffle->cycle,
+              shuffle->state_file);
+    json_decref(root);
+}
+
+static void save_state(shuffle_t *shuffle) {
+    char key[17];
+    snprintf(key, sizeof(key), "%016" PRIx64, shuffle->key);
+
+    json_t *array = json_array();
+    for (int i = 0; i < shuffle->num_segments; ++i) {
+        shuffle_segment_t *segment = &shuffle->segments[i];
+        json_t *obj = json_object();
+        json_object_set_new(obj, "lo", json_integer(segment->lo));
+        json_object_set_new(obj, "size", json_integer(segment->size));
+        json_object_set_new(obj, "cursor", json_integer(segment->cursor));
+        json_object_set_new(obj, "emitted", json_integer(segment->emitted));
+        json_array_append_new(array, obj);
+    }
+    json_t *root = json_object();
+    json_object_set_new(root, "key", json_string(key));
+    json_object_set_new(root, "draws", json_integer(shuffle->draws));
+    json_object_set_new(root, "cycle", json_integer(shuffle->cycle));
+    json_object_set_new(root, "min_value", json_integer(shuffle->min_value));
+    json_object_set_new(root, "deferred", json_integer(shuffle->deferred));
+    json_object_set_new(root, "segments", array);
+
+    if (json_dump_file(root, shuffle->tmp_file, JSON_INDENT(2)) != 0 ||
+        rename(shuffle->tmp_file, shuffle->state_file) != 0) {
+        log_trace("shuffle_draw: Failed to write %s", shuffle->state_file);
+    }
+    json_decref(root);
+}
+
+shuffle_t *shuffle_create(apr_pool_t *pool, const char *state_file) {
+    shuffle_t *shuffle = apr_pcalloc(pool, sizeof(shuffle_t));
+    shuffle->state_file = apr_pstrdup(pool, state_file);
+    shuffle->tmp_file = apr_pstrcat(pool, state_file, ".tmp", NULL);
+    load_state(shuffle);
+    return shuffle;
+}
+
+// Fills `track_ids` with the next `num_tracks` tracks of the cycle. A batch
+// that straddles two cycles skips tracks it already has.
+void shuffle_draw(shuffle_t *shuffle, int min_value, int max_value,
+                  int *track_ids, int num_tracks) {
+    if (num_tracks > (int64_t)max_value - min_value + 1) {
+        log_trace("shuffle_draw: Batch of %d exceeds the catalog range",
+                  num_tracks);
+        exit(-1);
+    }
+
+    // A different range is a different catalog; the old cycle means
+    // nothing for it
+    if (shuffle->num_segments == 0 || shuffle->min_value != min_value) {
+        start_cycle(shuffle, min_value, max_value);
+    } else {
+        cover_growth(shuffle, max_value);
+    }
+
+    for (int i = 0; i < num_tracks;) {
+        int track_id = next_track(shuffle, min_value, max_value);
+        int repeated = 0;
+        for (int j = 0; j < i && !repeated; ++j) {
+            repeated = track_ids[j] == track_id;
+        }
+        if (!repeated) {
+            track_ids[i++] = track_id;
+        }
+    }
+    save_state(shuffle);
+}
+
+void shuffle_log(shuffle_t *shuffle) {
+    int64_t total = 0;
+    for (int i = 0; i < shuffle->num_segments; ++i) {
+        total += shuffle->segments[i].size;
+    }
+    fprintf(stdout, "Shuffle: cycle %ld, %" PRId64 " of %" PRId64
+                    " tracks left",
+            shuffle->cycle, count_remaining(shuffle), total);
+    if (shuffle->deferred > 0) {
+        fprintf(stdout, ", %" PRId64 " waiting for the next cycle",
+                shuffle->deferred);
+    }
+    fprintf(stdout, "\n");
+}
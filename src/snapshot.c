@@ -0,0 +1,566 @@
+#include "snapshot.h"
+#include "database.h"
+#include "log.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A read-only image of the tracks, albums and content tables. Tracks sit
+// in a fixed-width array indexed by track ID and refer to one arena of
+// names and album paths and one arena of CIDs by offset, so the file is
+// used straight from the mapping: a lookup is a few loads and needs
+// neither SQL nor allocations for the strings.
+//
+// The file is written in native byte order next to the catalog it was
+// built from and records the state of that catalog, so a changed catalog
+// is noticed and the snapshot rebuilt rather than read stale.
+
+#define SNAPSHOT_MAGIC "MUSICSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ALIGN 8
+
+// The catalog file and its write-ahead log as they were when the snapshot
+// was built
+typedef struct {
+    int64_t db_mtime;
+    int64_t db_size;
+    int64_t wal_mtime;
+    int64_t wal_size;
+} snapshot_stamp_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t max_track_id;
+    snapshot_stamp_t stamp;
+    uint64_t num_tracks;
+    uint64_t num_cids;
+    uint64_t tracks_offset;
+    uint64_t cids_offset;
+    uint64_t sizes_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t cid_text_offset;
+    uint64_t cid_text_size;
+    uint64_t file_size;
+} snapshot_header_t;
+
+// Offset 0 of the string arena is an empty string standing for NULL
+typedef struct {
+    uint32_t name;
+    uint32_t album;
+    uint32_t first_cid;
+    uint16_t num_cids;
+    uint16_t sized;
+} snapshot_track_t;
+
+struct snapshot {
+    void *map;
+    size_t size;
+    const snapshot_header_t *header;
+    const snapshot_track_t *tracks;
+    const uint64_t *cids;
+    const int64_t *sizes;
+    const char *strings;
+    const char *cid_text;
+};
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} arena_t;
+
+#ifdef __APPLE__
+#define MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+// A commit can leave the size of the catalog as it was, so the mtime is
+// kept to the nanosecond
+static void stamp_file(const char *filename, int64_t *mtime, int64_t *size) {
+    struct stat st;
+    *mtime = 0;
+    *size = 0;
+    if (stat(filename, &st) == 0) {
+        *mtime = (int64_t)st.st_mtime * 1000000000 + MTIME_NSEC(st);
+        *size = (int64_t)st.st_size;
+    }
+}
+
+static void stamp_catalog(const char *db_filename, snapshot_stamp_t *stamp) {
+    char wal[4096];
+    snprintf(wal, sizeof(wal), "%s-wal", db_filename);
+    memset(stamp, 0, sizeof(snapshot_stamp_t));
+    stamp_file(db_filename, &stamp->db_mtime, &stamp->db_size);
+    stamp_file(wal, &stamp->wal_mtime, &stamp->wal_size);
+}
+
+static size_t arena_append(arena_t *arena, const void *data, size_t len) {
+    if (arena->len + len > arena->cap) {
+        size_t cap = arena->cap ? arena->cap : 4096;
+        while (cap < arena->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(arena->data, cap);
+        if (!grown) {
+            log_trace("snapshot_build: Memory allocation failed");
+            exit(-1);
+        }
+        arena->data = grown;
+        arena->cap = cap;
+    }
+    size_t offset = arena->len;
+    memcpy(arena->data + offset, data, len);
+    arena->len += len;
+    return offset;
+}
+
+static size_t arena_string(arena_t *arena, const unsigned char *text) {
+    if (!text) {
+        return 0;
+    }
+    return arena_append(arena, text, strlen((const char *)text) + 1);
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *query) {
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+        return NULL;
+    }
+    return stmt;
+}
+
+typedef struct {
+    int64_t *ids;
+    uint32_t *paths;
+    int count;
+} albums_t;
+
+static uint32_t album_path(albums_t *albums, int64_t album_id) {
+    int lo = 0;
+    int hi = albums->count - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (albums->ids[mid] == album_id) {
+            return albums->paths[mid];
+        }
+        if (albums->ids[mid] < album_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return 0;
+}
+
+// Each album path is stored once and shared by all of its tracks
+static int load_albums(sqlite3 *db, arena_t *strings, albums_t *albums) {
+    sqlite3_stmt *stmt =
+        prepare(db, "SELECT album_id, path FROM albums ORDER BY album_id");
+    if (!stmt) {
+        return -1;
+    }
+    int cap = 0;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (albums->count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            albums->ids = realloc(albums->ids, cap * sizeof(int64_t));
+            albums->paths = realloc(albums->paths, cap * sizeof(uint32_t));
+            if (!albums->ids || !albums->paths) {
+                log_trace("snapshot_build: Memory allocation failed");
+                exit(-1);
+            }
+        }
+        albums->ids[albums->count] = sqlite3_column_int64(stmt, 0);
+        albums->paths[albums->count] =
+            (uint32_t)arena_string(strings, sqlite3_column_text(stmt, 1));
+        albums->count++;
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static int load_tracks(sqlite3 *db, arena_t *strings, albums_t *albums,
+                       snapshot_track_t *tracks, int max_track_id,
+                       uint64_t *num_tracks) {
+    sqlite3_stmt *stmt =
+        prepare(db, "SELECT track_id, track_name, album_id FROM tracks");
+    if (!stmt) {
+        return -1;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int track_id = sqlite3_column_int(stmt, 0);
+        (*num_tracks)++;
+        if (track_id < 0 || track_id > max_track_id) {
+            continue;
+        }
+        tracks[track_id].name =
+            (uint32_t)arena_string(strings, sqlite3_column_text(stmt, 1));
+        tracks[track_id].album =
+            album_path(albums, sqlite3_column_int64(stmt, 2));
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+// Rows arrive grouped by track, in the order catalog_resolve() returns
+// them, so the CIDs of a track end up next to each other
+static int load_content(sqlite3 *db, arena_t *cids, arena_t *sizes,
+                        arena_t *cid_text, snapshot_track_t *tracks,
+                        int max_track_id) {
+    sqlite3_stmt *stmt = prepare(db, "SELECT track_id, cid, size FROM content "
+                                     "ORDER BY track_id, rowid");
+    int has_sizes = stmt != NULL;
+    if (!stmt) {
+        stmt = prepare(db, "SELECT track_id, cid FROM content "
+                           "ORDER BY track_id, rowid");
+    }
+    if (!stmt) {
+        return -1;
+    }
+
+    for (int i = 0; i <= max_track_id; ++i) {
+        tracks[i].sized = has_sizes;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        int track_id = sqlite3_column_int(stmt, 0);
+        const unsigned char *cid = sqlite3_column_text(stmt, 1);
+        if (track_id < 0 || track_id > max_track_id || !cid ||
+            !tracks[track_id].name) {
+            continue;
+        }
+        snapshot_track_t *track = &tracks[track_id];
+        uint64_t index = cids->len / sizeof(uint64_t);
+        if (track->num_cids == UINT16_MAX || index >= UINT32_MAX) {
+            log_trace("snapshot_build: Too many CIDs for track %d", track_id);
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+        if (track->num_cids == 0) {
+            track->first_cid = (uint32_t)index;
+        }
+        track->num_cids++;
+
+        uint64_t offset = arena_string(cid_text, cid);
+        arena_append(cids, &offset, sizeof(offset));
+        int64_t size = 0;
+        if (has_sizes && sqlite3_column_type(stmt, 2) == SQLITE_INTEGER) {
+            size = sqlite3_column_int64(stmt, 2);
+        } else {
+            track->sized = 0;
+        }
+        arena_append(sizes, &size, sizeof(size));
+    }
+    sqlite3_finalize(stmt);
+    return 0;
+}
+
+static uint64_t align(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+}
+
+static int write_section(FILE *fp, const void *data, size_t len,
+                         uint64_t offset) {
+    static const char padding[SNAPSHOT_ALIGN];
+    long pos = ftell(fp);
+    if (pos < 0 || (uint64_t)pos > offset ||
+        fwrite(padding, 1, offset - pos, fp) != offset - pos) {
+        return -1;
+    }
+    return len == 0 || fwrite(data, 1, len, fp) == len ? 0 : -1;
+}
+
+// Written to a temporary file and renamed into place, so readers only
+// ever map a complete snapshot
+static int write_snapshot(const char *filename, snapshot_header_t *header,
+                          snapshot_track_t *tracks, arena_t *cids,
+                          arena_t *sizes, arena_t *strings,
+                          arena_t *cid_text) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", filename, (int)getpid());
+
+    size_t tracks_len =
+        ((size_t)header->max_track_id + 1) * sizeof(snapshot_track_t);
+    header->tracks_offset = align(sizeof(snapshot_header_t));
+    header->cids_offset = align(header->tracks_offset + tracks_len);
+    header->sizes_offset = align(header->cids_offset + cids->len);
+    header->strings_offset = align(header->sizes_offset + sizes->len);
+    header->strings_size = strings->len;
+    header->cid_text_offset = align(header->strings_offset + strings->len);
+    header->cid_text_size = cid_text->len;
+    header->file_size = header->cid_text_offset + cid_text->len;
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        log_trace("snapshot_build: Failed to create %s", tmp);
+        return -1;
+    }
+    int rc = 0;
+    rc |= write_section(fp, header, sizeof(snapshot_header_t), 0);
+    rc |= write_section(fp, tracks, tracks_len, header->tracks_offset);
+    rc |= write_section(fp, cids->data, cids->len, header->cids_offset);
+    rc |= write_section(fp, sizes->data, sizes->len, header->sizes_offset);
+    rc |= write_section(fp, strings->data, strings->len,
+                        header->strings_offset);
+    rc |= write_section(fp, cid_text->data, cid_text->len,
+                        header->cid_text_offset);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        rc = -1;
+    }
+    if (fclose(fp) != 0) {
+        rc = -1;
+    }
+    if (rc != 0 || rename(tmp, filename) != 0) {
+        log_trace("snapshot_build: Failed to write %s", filename);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0 once `filename` holds a snapshot of the catalog at
+// `db_filename`
+int snapshot_build(const char *db_filename, const char *filename) {
+    snapshot_header_t header;
+    sqlite3 *db;
+    int rc = -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    // Stamped before reading, so a change made during the build leaves
+    // the snapshot stale rather than looking current
+    stamp_catalog(db_filename, &header.stamp);
+
+    database_open_readonly(db_filename, &db);
+    // One read transaction, so all tables are read from the same state
+    sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+
+    int max_track_id = -1;
+    sqlite3_stmt *stmt = prepare(db, "SELECT max(track_id) FROM tracks");
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW &&
+        sqlite3_column_type(stmt, 0) == SQLITE_INTEGER) {
+        max_track_id = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if (max_track_id < 0) {
+        log_trace("snapshot_build: No tracks in %s", db_filename);
+        sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        database_close(db);
+        return -1;
+    }
+    header.max_track_id = (uint32_t)max_track_id;
+
+    snapshot_track_t *tracks =
+        calloc((size_t)max_track_id + 1, sizeof(snapshot_track_t));
+    if (!tracks) {
+        log_trace("snapshot_build: Memory allocation failed");
+        exit(-1);
+    }
+    arena_t strings = {0};
+    arena_t cid_text = {0};
+    arena_t cids = {0};
+    arena_t sizes = {0};
+    albums_t albums = {0};
+    arena_append(&strings, "", 1);
+
+    if (load_albums(db, &strings, &albums) == 0 &&
+        load_tracks(db, &strings, &albums, tracks, max_track_id,
+                    &header.num_tracks) == 0 &&
+        load_content(db, &cids, &sizes, &cid_text, tracks, max_track_id) ==
+            0) {
+        header.num_cids = cids.len / sizeof(uint64_t);
+        if (strings.len > UINT32_MAX) {
+            log_trace("snapshot_build: Names do not fit in a snapshot");
+        } else {
+            rc = write_snapshot(filename, &header, tracks, &cids, &sizes,
+                                &strings, &cid_text);
+        }
+    } else {
+        log_trace("snapshot_build: Failed to read %s: %s", db_filename,
+                  sqlite3_errmsg(db));
+    }
+    sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+    database_close(db);
+
+    if (rc == 0) {
+        log_trace("snapshot_build: %s: %llu tracks, %llu CIDs, %llu bytes",
+                  filename, (unsigned long long)header.num_tracks,
+                  (unsigned long long)header.num_cids,
+                  (unsigned long long)header.file_size);
+    }
+    free(tracks);
+    free(albums.ids);
+    free(albums.paths);
+    free(strings.data);
+    free(cid_text.data);
+    free(cids.data);
+    free(sizes.data);
+    return rc;
+}
+
+// Offsets are checked against the file size before any sum, so a damaged
+// header cannot wrap around
+static int is_well_formed(const snapshot_header_t *header, size_t size) {
+    uint64_t tracks_len =
+        ((uint64_t)header->max_track_id + 1) * sizeof(snapshot_track_t);
+    uint64_t cids_len = header->num_cids * sizeof(uint64_t);
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ==
+               0 &&
+           header->version == SNAPSHOT_VERSION && header->file_size == size &&
+           header->tracks_offset <= size && header->cids_offset <= size &&
+           header->sizes_offset <= size && header->strings_offset <= size &&
+           header->cid_text_offset <= size && header->strings_size <= size &&
+           header->cid_text_size <= size &&
+           header->num_cids <= size / sizeof(uint64_t) &&
+           header->tracks_offset % SNAPSHOT_ALIGN == 0 &&
+           header->cids_offset % SNAPSHOT_ALIGN == 0 &&
+           header->sizes_offset % SNAPSHOT_ALIGN == 0 &&
+           header->tracks_offset + tracks_len <= header->cids_offset &&
+           header->cids_offset + cids_len <= header->sizes_offset &&
+           header->sizes_offset + cids_len <= header->strings_offset &&
+           header->strings_offset + header->strings_size <=
+               header->cid_text_offset &&
+           header->cid_text_offset + header->cid_text_size <= size;
+}
+
+// An arena ends in a NUL, so every offset inside it starts a terminated
+// string. The string arena also holds the empty string at offset 0.
+static int is_terminated(const char *arena, uint64_t size) {
+    return size == 0 || arena[size - 1] == '\0';
+}
+
+// Every offset a lookup follows is checked once here, so lookups can use
+// the entries as they are
+static int has_valid_entries(snapshot_t *snapshot) {
+    const snapshot_header_t *header = snapshot->header;
+    if (header->strings_size == 0 ||
+        !is_terminated(snapshot->strings, header->strings_size) ||
+        !is_terminated(snapshot->cid_text, header->cid_text_size)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i <= header->max_track_id; ++i) {
+        const snapshot_track_t *entry = &snapshot->tracks[i];
+        if (entry->name >= header->strings_size ||
+            entry->album >= header->strings_size ||
+            (uint64_t)entry->first_cid + entry->num_cids > header->num_cids) {
+            return 0;
+        }
+    }
+    for (uint64_t i = 0; i < header->num_cids; ++i) {
+        if (snapshot->cids[i] >= header->cid_text_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns NULL when the snapshot is missing, damaged or, given
+// `db_filename`, older than the catalog
+snapshot_t *snapshot_open(const char *filename, const char *db_filename) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    snapshot_t *snapshot = calloc(1, sizeof(snapshot_t));
+    if (!snapshot) {
+        log_trace("snapshot_open: Memory allocation failed");
+        exit(-1);
+    }
+    snapshot->map = map;
+    snapshot->size = st.st_size;
+    snapshot->header = (const snapshot_header_t *)map;
+    if (!is_well_formed(snapshot->header, snapshot->size) ||
+        (db_filename && !snapshot_is_current(snapshot, db_filename))) {
+        snapshot_close(snapshot);
+        return NULL;
+    }
+
+    const char *base = (const char *)map;
+    const snapshot_header_t *header = snapshot->header;
+    snapshot->tracks =
+        (const snapshot_track_t *)(base + header->tracks_offset);
+    snapshot->cids = (const uint64_t *)(base + header->cids_offset);
+    snapshot->sizes = (const int64_t *)(base + header->sizes_offset);
+    snapshot->strings = base + header->strings_offset;
+    snapshot->cid_text = base + header->cid_text_offset;
+    if (!has_valid_entries(snapshot)) {
+        log_trace("snapshot_open: Ignoring damaged %s", filename);
+        snapshot_close(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
+
+apr_status_t snapshot_close(void *data) {
+    snapshot_t *snapshot = (snapshot_t *)data;
+    munmap(snapshot->map, snapshot->size);
+    free(snapshot);
+    return APR_SUCCESS;
+}
+
+int snapshot_is_current(snapshot_t *snapshot, const char *db_filename) {
+    snapshot_stamp_t stamp;
+    stamp_catalog(db_filename, &stamp);
+    return memcmp(&stamp, &snapshot->header->stamp, sizeof(stamp)) == 0;
+}
+
+int snapshot_count_tracks(snapshot_t *snapshot) {
+    return (int)snapshot->header->num_tracks;
+}
+
+static const snapshot_track_t *find_track(snapshot_t *snapshot,
+                                          int track_id) {
+    if (track_id < 0 || (uint32_t)track_id > snapshot->header->max_track_id) {
+        return NULL;
+    }
+    const snapshot_track_t *entry = &snapshot->tracks[track_id];
+    return entry->name ? entry : NULL;
+}
+
+int snapshot_count_cids(snapshot_t *snapshot, int track_id) {
+    const snapshot_track_t *entry = find_track(snapshot, track_id);
+    return entry ? entry->num_cids : 0;
+}
+
+// Fills `track` with pointers into the mapping, which stays valid until
+// snapshot_close(). `cids` must have room for snapshot_count_cids().
+void snapshot_lookup(snapshot_t *snapshot, int track_id,
+                     catalog_track_t *track, char **cids) {
+    memset(track, 0, sizeof(catalog_track_t));
+    track->track_id = track_id;
+    const snapshot_track_t *entry = find_track(snapshot, track_id);
+    if (!entry) {
+        return;
+    }
+
+    track->track_name = (char *)snapshot->strings + entry->name;
+    track->album_path =
+        entry->album ? (char *)snapshot->strings + entry->album : NULL;
+    for (int i = 0; i < entry->num_cids; ++i) {
+        cids[i] =
+            (char *)snapshot->cid_text + snapshot->cids[entry->first_cid + i];
+    }
+    track->cids = cids;
+    track->num_cids = entry->num_cids;
+    track->sizes =
+        entry->sized ? (int64_t *)snapshot->sizes + entry->first_cid : NULL;
+}
@@ -0,0 +1,72 @@
+#include "sniff.h"
+#include <string.h>
+#include <strings.h>
+
+// Cheap checks on the first bytes of a response body. Gateways, CDNs and
+// captive portals answer with HTML pages and a 200 often enough that the
+// first write of every body is checked before anything reaches disk.
+
+static const char *html_prefixes[] = {"<!doctype", "<html", "<head", "<body",
+                                      "<?xml", "<title"};
+
+// SNIFF_MATCH means the body looks like markup
+enum sniff_result sniff_html(const void *data, size_t len) {
+    const char *text = (const char *)data;
+    size_t pos = 0;
+
+    // UTF-8 byte order mark and leading whitespace
+    if (len >= 3 && memcmp(text, "\xef\xbb\xbf", 3) == 0) {
+        pos = 3;
+    }
+    while (pos < len && (text[pos] == ' ' || text[pos] == '\t' ||
+                         text[pos] == '\r' || text[pos] == '\n')) {
+        pos++;
+    }
+
+    for (size_t i = 0; i < sizeof(html_prefixes) / sizeof(html_prefixes[0]);
+         ++i) {
+        size_t prefix_len = strlen(html_prefixes[i]);
+        if (len - pos < prefix_len) {
+            continue;
+        }
+        if (strncasecmp(text + pos, html_prefixes[i], prefix_len) == 0) {
+            return SNIFF_MATCH;
+        }
+    }
+    return SNIFF_MISMATCH;
+}
+
+// Checks the start of a track against the container its extension names
+enum sniff_result sniff_magic(const char *extension, const void *data,
+                              size_t len) {
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    if (!extension) {
+        return SNIFF_UNKNOWN;
+    }
+    if (strcmp(extension, "opus") == 0) {
+        if (len < 4) {
+            return SNIFF_UNKNOWN;
+        }
+        return memcmp(bytes, "OggS", 4) == 0 ? SNIFF_MATCH : SNIFF_MISMATCH;
+    }
+    if (strcmp(extension, "m4a") == 0) {
+        if (len < 8) {
+            return SNIFF_UNKNOWN;
+        }
+        return memcmp(bytes + 4, "ftyp", 4) == 0 ? SNIFF_MATCH
+                                                 : SNIFF_MISMATCH;
+    }
+    if (strcmp(extension, "mp3") == 0) {
+        // An ID3v2 tag, or straight into an MPEG audio frame sync
+        if (len < 3) {
+            return SNIFF_UNKNOWN;
+        }
+        if (memcmp(bytes, "ID3", 3) == 0 ||
+            (bytes[0] == 0xff && (bytes[1] & 0xe0) == 0xe0)) {
+            return SNIFF_MATCH;
+        }
+        return SNIFF_MISMATCH;
+    }
+    return SNIFF_UNKNOWN;
+}
@@ -0,0 +1,160 @@
+#include "source.h"
+#include <apr_strings.h>
+#include <stdio.h>
+#include <string.h>
+
+// Download sources. Public gateways are picked from the scoreboard,
+// 59 character CIDv1s go to a subdomain gateway, and a local IPFS node is
+// asked first when one is configured. The local gateway is only allowed
+// to answer from its own blockstore, so a miss costs a loopback round trip
+// and the CID moves on to the public sources.
+
+#define LOCAL_CONNECT_TIMEOUT_MS 500L
+#define SUBDOMAIN_CID_LENGTH 59
+
+typedef struct {
+    const char *name;
+    int uses_gateways;
+    int falls_through;
+    int (*accepts)(source_t *source, const char *cid);
+    void (*url)(source_t *source, const char *cid, const char *host,
+                char *url, size_t size);
+    long (*timeout)(source_t *source, long timeout);
+    void (*prepare)(source_t *source, CURL *curl);
+} source_ops_t;
+
+struct source {
+    const source_ops_t *ops;
+    const char *host;
+    struct curl_slist *headers;
+};
+
+static int accepts_any(source_t *source, const char *cid) {
+    return 1;
+}
+
+static long same_timeout(source_t *source, long timeout) {
+    return timeout;
+}
+
+// A transfer that fell through from the local node keeps its handle, so
+// drop the local request headers
+static void prepare_public(source_t *source, CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+}
+
+static void local_url(source_t *source, const char *cid, const char *host,
+                      char *url, size_t size) {
+    snprintf(url, size, "http://%s/ipfs/%s", source->host, cid);
+}
+
+// Trustless gateways answer 412 to only-if-cached when the blocks are not
+// local, instead of fetching them from the network
+static void local_prepare(source_t *source, CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, source->headers);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     LOCAL_CONNECT_TIMEOUT_MS);
+}
+
+static const source_ops_t local_ops = {
+    .name = "local",
+    .falls_through = 1,
+    .accepts = accepts_any,
+    .url = local_url,
+    .timeout = same_timeout,
+    .prepare = local_prepare,
+};
+
+static int subdomain_accepts(source_t *source, const char *cid) {
+    return strlen(cid) == SUBDOMAIN_CID_LENGTH;
+}
+
+static void subdomain_url(source_t *source, const char *cid,
+                          const char *host, char *url, size_t size) {
+    snprintf(url, size, "https://%s.%s", cid, source->host);
+}
+
+// A single gateway with no alternative gets more time before giving up
+static long subdomain_timeout(source_t *source, long timeout) {
+    return 2 * timeout;
+}
+
+static const source_ops_t subdomain_ops = {
+    .name = "subdomain",
+    .accepts = subdomain_accepts,
+    .url = subdomain_url,
+    .timeout = subdomain_timeout,
+    .prepare = prepare_public,
+};
+
+static void gateway_url(source_t *source, const char *cid, const char *host,
+                        char *url, size_t size) {
+    snprintf(url, size, "https://%s/%s", host, cid);
+}
+
+static const source_ops_t gateway_ops = {
+    .name = "gateway",
+    .uses_gateways = 1,
+    .accepts = accepts_any,
+    .url = gateway_url,
+    .timeout = same_timeout,
+    .prepare = prepare_public,
+};
+
+static source_t *source_create(apr_pool_t *pool, const source_ops_t *ops,
+                               const char *host) {
+    source_t *source = apr_pcalloc(pool, sizeof(source_t));
+    source->ops = ops;
+    source->host = host ? apr_pstrdup(pool, host) : NULL;
+    return source;
+}
+
+source_t *source_local_create(apr_pool_t *pool, const char *host) {
+    source_t *source = source_create(pool, &local_ops, host);
+    source->headers =
+        curl_slist_append(NULL, "Cache-Control: only-if-cached");
+    return source;
+}
+
+source_t *source_subdomain_create(apr_pool_t *pool, const char *domain) {
+    return source_create(pool, &subdomain_ops, domain);
+}
+
+source_t *source_gateway_create(apr_pool_t *pool) {
+    return source_create(pool, &gateway_ops, NULL);
+}
+
+apr_status_t source_destroy(void *data) {
+    source_t *source = (source_t *)data;
+    curl_slist_free_all(source->headers);
+    return APR_SUCCESS;
+}
+
+const char *source_name(source_t *source) {
+    return source->ops->name;
+}
+
+int source_uses_gateways(source_t *source) {
+    return source->ops->uses_gateways;
+}
+
+int source_falls_through(source_t *source) {
+    return source->ops->falls_through;
+}
+
+int source_accepts(source_t *source, const char *cid) {
+    return source->ops->accepts(source, cid);
+}
+
+void source_url(source_t *source, const char *cid, const char *host,
+                char *url, size_t size) {
+    source->ops->url(source, cid, host, url, size);
+}
+
+long source_timeout(source_t *source, long timeout) {
+    return source->ops->timeout(source, timeout);
+}
+
+void source_prepare(source_t *source, CURL *curl) {
+    source->ops->prepare(source, curl);
+}
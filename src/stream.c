@@ -0,0 +1,317 @@
+#include "stream.h"
+#include "log.h"
+#include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// A stream serves the bytes of a track in chunk order while its CIDs are
+// still being downloaded. Each chunk is read from its CID file in the output
+// directory up to the number of bytes the download side reports as written.
+
+enum chunk_state { CHUNK_PENDING, CHUNK_DONE, CHUNK_FAILED };
+
+struct stream {
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    int num_chunks;
+    char **paths;
+    int *fds;
+    int64_t *written;
+    int *replaced;
+    enum chunk_state *states;
+    int64_t max_ahead;
+    int attached;
+    int seeking;
+    int throttled;
+    int chunk;
+    int64_t offset;
+    int64_t position;
+    long stalls;
+    apr_time_t stalled;
+    stream_notify_fn notify;
+    void *notify_data;
+};
+
+static apr_status_t stream_cleanup(void *data) {
+    stream_t *stream = (stream_t *)data;
+    for (int i = 0; i < stream->num_chunks; ++i) {
+        if (stream->fds[i] >= 0) {
+            close(stream->fds[i]);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+stream_t *stream_create(apr_pool_t *pool, const char *dir, char **cids,
+                        int num_cids, int64_t max_ahead) {
+    stream_t *stream = apr_pcalloc(pool, sizeof(stream_t));
+    apr_thread_mutex_create(&stream->mutex, APR_THREAD_MUTEX_DEFAULT, pool);
+    apr_thread_cond_create(&stream->cond, pool);
+
+    stream->num_chunks = num_cids;
+    stream->max_ahead = max_ahead;
+    stream->paths = apr_palloc(pool, num_cids * sizeof(char *));
+    stream->fds = apr_palloc(pool, num_cids * sizeof(int));
+    stream->written = apr_pcalloc(pool, num_cids * sizeof(int64_t));
+    stream->replaced = apr_pcalloc(pool, num_cids * sizeof(int));
+    stream->states = apr_pcalloc(pool, num_cids * sizeof(enum chunk_state));
+
+    for (int i = 0; i < num_cids; ++i) {
+        stream->paths[i] = apr_pstrcat(pool, dir, "/", cids[i], NULL);
+        stream->fds[i] = -1;
+        stream->states[i] = CHUNK_PENDING;
+    }
+
+    apr_pool_cleanup_register(pool, stream, stream_cleanup,
+                              apr_pool_cleanup_null);
+    return stream;
+}
+
+void stream_set_notify(stream_t *stream, stream_notify_fn notify, void *data) {
+    stream->notify = notify;
+    stream->notify_data = data;
+}
+
+static void stream_notify(stream_t *stream) {
+    if (stream->notify) {
+        stream->notify(stream->notify_data);
+    }
+}
+
+void stream_write(stream_t *stream, int chunk, size_t size) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->written[chunk] += size;
+    apr_thread_cond_broadcast(stream->cond);
+    apr_thread_mutex_unlock(stream->mutex);
+}
+
+void stream_reset(stream_t *stream, int chunk) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->written[chunk] = 0;
+    apr_thread_mutex_unlock(stream->mutex);
+}
+
+// The CID file was swapped for another copy of the same bytes, e.g. by a
+// hedged download. Only the reader touches fds, so it reopens the chunk.
+void stream_replace(stream_t *stream, int chunk, int64_t size) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->written[chunk] = size;
+    stream->replaced[chunk] = 1;
+    apr_thread_cond_broadcast(stream->cond);
+    apr_thread_mutex_unlock(stream->mutex);
+}
+
+void stream_finish(stream_t *stream, int chunk, int succeeded) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->states[chunk] = succeeded ? CHUNK_DONE : CHUNK_FAILED;
+    apr_thread_cond_broadcast(stream->cond);
+    apr_thread_mutex_unlock(stream->mutex);
+}
+
+int stream_should_pause(stream_t *stream, int chunk) {
+    int pause = 0;
+
+    apr_thread_mutex_lock(stream->mutex);
+    if (stream->attached && !stream->seeking && chunk >= stream->chunk) {
+        if (chunk == stream->chunk) {
+            // Never starve the chunk the reader is waiting on
+            pause = stream->written[chunk] - stream->offset > stream->max_ahead;
+        } else {
+            int64_t ahead = -stream->offset;
+            for (int i = stream->chunk; i < stream->num_chunks; ++i) {
+                ahead += stream->written[i];
+            }
+            pause = ahead > stream->max_ahead;
+        }
+        if (pause) {
+            stream->throttled = 1;
+        }
+    }
+    apr_thread_mutex_unlock(stream->mutex);
+
+    return pause;
+}
+
+void stream_attach(stream_t *stream) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->attached = 1;
+    stream->chunk = 0;
+    stream->offset = 0;
+    stream->position = 0;
+    apr_thread_mutex_unlock(stream->mutex);
+}
+
+void stream_detach(stream_t *stream) {
+    apr_thread_mutex_lock(stream->mutex);
+    stream->attached = 0;
+    stream->throttled = 0;
+    apr_thread_mutex_unlock(stream->mutex);
+    stream_notify(stream);
+}
+
+static int stream_fd(stream_t *stream, int chunk) {
+    if (stream->fds[chunk] < 0) {
+        stream->fds[chunk] = open(stream->paths[chunk], O_RDONLY);
+        if (stream->fds[chunk] < 0) {
+            log_trace("stream: Failed to open %s", stream->paths[chunk]);
+        }
+    }
+    return stream->fds[chunk];
+}
+
+int stream_read(stream_t *stream, uint8_t *buf, int size) {
+    int stalled = 0;
+    int retried = 0;
+
+    apr_thread_mutex_lock(stream->mutex);
+    while (stream->chunk < stream->num_chunks) {
+        int chunk = stream->chunk;
+        int64_t avail = stream->written[chunk] - stream->offset;
+
+        if (avail > 0) {
+            int64_t offset = stream->offset;
+            int n = avail < size ? (int)avail : size;
+            if (stream->replaced[chunk] && stream->fds[chunk] >= 0) {
+                close(stream->fds[chunk]);
+                stream->fds[chunk] = -1;
+            }
+            stream->replaced[chunk] = 0;
+            apr_thread_mutex_unlock(stream->mutex);
+
+            int fd = stream_fd(stream, chunk);
+            ssize_t nread = fd < 0 ? -1 : pread(fd, buf, n, offset);
+            // A restarted download truncates the file after resetting the
+            // chunk, so a read that raced it finds nothing and has to look
+            // at the chunk again. Only a second empty read in a row, with
+            // no wait in between, means the file is really short.
+            if (nread == 0 && !retried) {
+                retried = 1;
+                apr_thread_mutex_lock(stream->mutex);
+                continue;
+            }
+            if (nread <= 0) {
+                log_trace("stream: Failed to read %s", stream->paths[chunk]);
+                return -1;
+            }
+
+            apr_thread_mutex_lock(stream->mutex);
+            stream->offset += nread;
+            stream->position += nread;
+            int throttled = stream->throttled;
+            stream->throttled = 0;
+            apr_thread_mutex_unlock(stream->mutex);
+
+            if (throttled) {
+                stream_notify(stream);
+            }
+            return (int)nread;
+        }
+
+        if (stream->states[chunk] == CHUNK_DONE) {
+            stream->chunk++;
+            stream->offset = 0;
+        } else if (stream->states[chunk] == CHUNK_FAILED) {
+            apr_thread_mutex_unlock(stream->mutex);
+            return -1;
+        } else {
+            // The player is starved until the download catches up
+            apr_time_t start = apr_time_now();
+            if (!stalled) {
+                stream->stalls++;
+                stalled = 1;
+            }
+            apr_thread_cond_wait(stream->cond, stream->mutex);
+            stream->stalled += apr_time_now() - start;
+            retried = 0;
+        }
+    }
+    apr_thread_mutex_unlock(stream->mutex);
+    return 0;
+}
+
+static int64_t stream_total(stream_t *stream) {
+    int64_t total = 0;
+    for (int i = 0; i < stream->num_chunks; ++i) {
+        if (stream->states[i] != CHUNK_DONE) {
+            return -1;
+        }
+        total += stream->written[i];
+    }
+    return total;
+}
+
+int64_t stream_size(stream_t *stream) {
+    apr_thread_mutex_lock(stream->mutex);
+    int64_t total = stream_total(stream);
+    apr_thread_mutex_unlock(stream->mutex);
+    return total;
+}
+
+// How often, and for how long, reads had to wait for downloaded bytes
+long stream_stalls(stream_t *stream, apr_time_t *stalled) {
+    apr_thread_mutex_lock(stream->mutex);
+    long stalls = stream->stalls;
+    *stalled = stream->stalled;
+    apr_thread_mutex_unlock(stream->mutex);
+    return stalls;
+}
+
+int64_t stream_seek(stream_t *stream, int64_t offset, int whence) {
+    apr_thread_mutex_lock(stream->mutex);
+
+    int64_t target = offset;
+    if (whence == SEEK_CUR) {
+        target = stream->position + offset;
+    } else if (whence == SEEK_END) {
+        int64_t total = stream_total(stream);
+        target = total < 0 ? -1 : total + offset;
+    }
+    if (target < 0) {
+        apr_thread_mutex_unlock(stream->mutex);
+        return -1;
+    }
+
+    // Downloads must not be held back while we wait for the seek target
+    stream->seeking = 1;
+    if (stream->throttled) {
+        stream->throttled = 0;
+        apr_thread_mutex_unlock(stream->mutex);
+        stream_notify(stream);
+        apr_thread_mutex_lock(stream->mutex);
+    }
+
+    int chunk = 0;
+    int64_t remaining = target;
+    while (chunk < stream->num_chunks) {
+        if (remaining < stream->written[chunk]) {
+            break;
+        }
+        if (stream->states[chunk] == CHUNK_DONE) {
+            remaining -= stream->written[chunk];
+            chunk++;
+        } else if (stream->states[chunk] == CHUNK_FAILED) {
+            target = -1;
+            break;
+        } else {
+            apr_thread_cond_wait(stream->cond, stream->mutex);
+        }
+    }
+    if (chunk == stream->num_chunks && remaining > 0) {
+        target = -1;
+    }
+
+    if (target >= 0) {
+        stream->chunk = chunk;
+        stream->offset = remaining;
+        stream->position = target;
+    }
+    stream->seeking = 0;
+    apr_thread_mutex_unlock(stream->mutex);
+
+    return target;
+}
@@ -0,0 +1,205 @@
+#include "unixfs.h"
+#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Just enough protobuf to walk a UnixFS file: PBNode { Links, Data } with
+// PBLink { Hash } and the UnixFS Data { Type, Data, filesize, blocksizes }
+// message inside it. Anything else, directories included, is rejected.
+
+#define WIRE_VARINT 0
+#define WIRE_FIXED64 1
+#define WIRE_BYTES 2
+#define WIRE_FIXED32 5
+
+#define PBNODE_DATA 1
+#define PBNODE_LINKS 2
+#define PBLINK_HASH 1
+
+#define UNIXFS_TYPE 1
+#define UNIXFS_DATA 2
+#define UNIXFS_FILESIZE 3
+#define UNIXFS_BLOCKSIZES 4
+
+#define UNIXFS_RAW 0
+#define UNIXFS_FILE 2
+
+typedef struct {
+    const uint8_t *bytes;
+    size_t len;
+    size_t pos;
+} reader_t;
+
+static int read_varint(reader_t *reader, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; reader->pos < reader->len && shift < 64; shift += 7) {
+        uint8_t byte = reader->bytes[reader->pos++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads the next field; length-delimited values are returned in `field`
+static int read_field(reader_t *reader, int *number, int *wire,
+                      uint64_t *value, reader_t *field) {
+    uint64_t key;
+    if (read_varint(reader, &key) != 0) {
+        return -1;
+    }
+    *number = (int)(key >> 3);
+    *wire = (int)(key & 7);
+
+    switch (*wire) {
+    case WIRE_VARINT:
+        return read_varint(reader, value);
+    case WIRE_BYTES:
+        if (read_varint(reader, value) != 0 ||
+            *value > reader->len - reader->pos) {
+            return -1;
+        }
+        field->bytes = reader->bytes + reader->pos;
+        field->len = *value;
+        field->pos = 0;
+        reader->pos += *value;
+        return 0;
+    case WIRE_FIXED64:
+    case WIRE_FIXED32: {
+        size_t size = *wire == WIRE_FIXED64 ? 8 : 4;
+        if (size > reader->len - reader->pos) {
+            return -1;
+        }
+        reader->pos += size;
+        return 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+static void *grow(void *array, int count, size_t size) {
+    void *grown = realloc(array, (count + 1) * size);
+    if (!grown) {
+        log_trace("unixfs: Memory allocation failed");
+        exit(-1);
+    }
+    return grown;
+}
+
+static void add_blocksize(unixfs_node_t *node, uint64_t blocksize) {
+    node->blocksizes =
+        grow(node->blocksizes, node->num_blocksizes, sizeof(uint64_t));
+    node->blocksizes[node->num_blocksizes++] = blocksize;
+}
+
+static int decode_blocksizes(unixfs_node_t *node, reader_t *packed) {
+    while (packed->pos < packed->len) {
+        uint64_t blocksize;
+        if (read_varint(packed, &blocksize) != 0) {
+            return -1;
+        }
+        add_blocksize(node, blocksize);
+    }
+    return 0;
+}
+
+static int decode_data(reader_t *reader, unixfs_node_t *node) {
+    uint64_t type = UINT64_MAX;
+
+    while (reader->pos < reader->len) {
+        int number, wire;
+        uint64_t value;
+        reader_t field;
+        if (read_field(reader, &number, &wire, &value, &field) != 0) {
+            return -1;
+        }
+        if (number == UNIXFS_TYPE && wire == WIRE_VARINT) {
+            type = value;
+        } else if (number == UNIXFS_DATA && wire == WIRE_BYTES) {
+            node->data = field.bytes;
+            node->data_len = field.len;
+        } else if (number == UNIXFS_FILESIZE && wire == WIRE_VARINT) {
+            node->filesize = value;
+        } else if (number == UNIXFS_BLOCKSIZES && wire == WIRE_VARINT) {
+            add_blocksize(node, value);
+        } else if (number == UNIXFS_BLOCKSIZES && wire == WIRE_BYTES) {
+            if (decode_blocksizes(node, &field) != 0) {
+                return -1;
+            }
+        }
+    }
+    return type == UNIXFS_FILE || type == UNIXFS_RAW ? 0 : -1;
+}
+
+static int decode_link(reader_t *reader, unixfs_node_t *node) {
+    int found = 0;
+
+    node->links = grow(node->links, node->num_links, sizeof(cid_t));
+    while (reader->pos < reader->len) {
+        int number, wire;
+        uint64_t value;
+        reader_t field;
+        if (read_field(reader, &number, &wire, &value, &field) != 0) {
+            return -1;
+        }
+        if (number == PBLINK_HASH && wire == WIRE_BYTES) {
+            cid_t *cid = &node->links[node->num_links];
+            if (cid_read(field.bytes, field.len, cid) != (int)field.len) {
+                return -1;
+            }
+            found = 1;
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+    node->num_links++;
+    return 0;
+}
+
+// Returns 0 for a well-formed file node. Every link needs a blocksize so
+// that the children can be placed in the file.
+int unixfs_decode(const uint8_t *block, size_t len, unixfs_node_t *node) {
+    reader_t reader = {block, len, 0};
+    int has_data = 0;
+
+    memset(node, 0, sizeof(unixfs_node_t));
+    while (reader.pos < reader.len) {
+        int number, wire;
+        uint64_t value;
+        reader_t field;
+        if (read_field(&reader, &number, &wire, &value, &field) != 0) {
+            unixfs_free(node);
+            return -1;
+        }
+        if (number == PBNODE_LINKS && wire == WIRE_BYTES) {
+            if (decode_link(&field, node) != 0) {
+                unixfs_free(node);
+                return -1;
+            }
+        } else if (number == PBNODE_DATA && wire == WIRE_BYTES) {
+            if (decode_data(&field, node) != 0) {
+                unixfs_free(node);
+                return -1;
+            }
+            has_data = 1;
+        }
+    }
+
+    if (!has_data || node->num_links != node->num_blocksizes) {
+        unixfs_free(node);
+        return -1;
+    }
+    return 0;
+}
+
+void unixfs_free(unixfs_node_t *node) {
+    free(node->links);
+    free(node->blocksizes);
+    node->links = NULL;
+    node->blocksizes = NULL;
+    node->num_links = 0;
+    node->num_blocksizes = 0;
+}
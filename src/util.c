@@ -2,7 +2,6 @@
 #include "log.h"
 #include <apr_lib.h>
 #include <apr_random.h>
-#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -149,42 +148,6 @@ char *util_get_filename_with_extension(char *text) {
     return filename;
 }
 
-int *util_random_ints(int num_samples, int min_value, int max_value) {
-    if (num_samples > (max_value - min_value + 1)) {
-        log_trace(
-            "util_random_ints: Number of samples exceeds the range of unique values");
-        return NULL;
-    }
-
-    int *unique_random_ints = malloc(num_samples * sizeof(int));
-    if (unique_random_ints == NULL) {
-        log_trace("util_random_ints: Memory allocation failed");
-        exit(-1);
-    }
-
-    int count = 0;
-    while (count < num_samples) {
-        unsigned long random_byte;
-        apr_generate_random_bytes((unsigned char *)&random_byte,
-                                  sizeof(random_byte));
-        int rand_int = (random_byte % (max_value - min_value + 1)) + min_value;
-        bool exists = false;
-
-        for (int i = 0; i < count; ++i) {
-            if (unique_random_ints[i] == rand_int) {
-                exists = true;
-                break;
-            }
-        }
-
-        if (!exists) {
-            unique_random_ints[count++] = rand_int;
-        }
-    }
-
-    return unique_random_ints;
-}
-
 char *util_random_string(int length) {
     const char *alphabet =
         "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
@@ -0,0 +1,470 @@
+#define CURL_DISABLE_TYPECHECK
+#include "car.h"
+#include "cid.h"
+#include "dag.h"
+#include "unixfs.h"
+#include <apr_general.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Feeds the trustless path a small UnixFS file through a stub engine and
+// gateway: the raw root, a sub-DAG as a CAR stream and a raw leaf. The
+// gateway can cut CARs short, corrupt a block or serve a node whose
+// blocksizes do not add up. None of that may reach the file: the fetch
+// either fails or gets the missing blocks again. The CAR reader and the
+// UnixFS decoder are also checked on their own.
+
+#define MAX_BLOCKS 16
+#define FEED_CHUNK 7
+
+static int failures = 0;
+
+static void expect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} buf_t;
+
+static void put(buf_t *buf, const void *data, size_t len) {
+    buf->data = realloc(buf->data, buf->len + len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void put_varint(buf_t *buf, uint64_t value) {
+    while (value >= 0x80) {
+        uint8_t byte = (uint8_t)(value | 0x80);
+        put(buf, &byte, 1);
+        value >>= 7;
+    }
+    uint8_t byte = (uint8_t)value;
+    put(buf, &byte, 1);
+}
+
+static void put_bytes_field(buf_t *buf, int field, const void *data,
+                            size_t len) {
+    put_varint(buf, (uint64_t)field << 3 | 2);
+    put_varint(buf, len);
+    put(buf, data, len);
+}
+
+// Blocks the stub gateway serves
+typedef struct {
+    cid_t cid;
+    buf_t block;
+    uint64_t filesize;
+    int children[MAX_BLOCKS];
+    int num_children;
+} stored_t;
+
+static stored_t store[MAX_BLOCKS];
+static int num_stored = 0;
+
+static int add_block(uint64_t codec, buf_t *block, uint64_t filesize) {
+    stored_t *stored = &store[num_stored];
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, block->data, block->len);
+    sha256_final(&ctx, digest);
+
+    uint8_t prefix[] = {0x01, (uint8_t)codec, 0x12, SHA256_DIGEST_LENGTH};
+    memcpy(stored->cid.bytes, prefix, sizeof(prefix));
+    memcpy(stored->cid.bytes + sizeof(prefix), digest, sizeof(digest));
+    stored->cid.len = sizeof(prefix) + sizeof(digest);
+    stored->block = *block;
+    stored->filesize = filesize;
+    return num_stored++;
+}
+
+static int add_leaf(const char *text) {
+    buf_t block = {0};
+    put(&block, text, strlen(text));
+    return add_block(CID_CODEC_RAW, &block, block.len);
+}
+
+// A UnixFS file node over `children`. `skew` is added to the filesize the
+// node claims, so a non-zero one makes the blocksizes not add up to it.
+static int add_node(const int *children, int num_children, int skew) {
+    buf_t block = {0};
+    buf_t data = {0};
+    uint64_t filesize = 0;
+
+    for (int i = 0; i < num_children; ++i) {
+        cid_t *cid = &store[children[i]].cid;
+        buf_t link = {0};
+        put_bytes_field(&link, 1, cid->bytes, cid->len);
+        put_bytes_field(&block, 2, link.data, link.len);
+        free(link.data);
+        filesize += store[children[i]].filesize;
+    }
+    put_varint(&data, 1 << 3);
+    put_varint(&data, 2);
+    put_varint(&data, 3 << 3);
+    put_varint(&data, filesize + skew);
+    for (int i = 0; i < num_children; ++i) {
+        put_varint(&data, 4 << 3);
+        put_varint(&data, store[children[i]].filesize);
+    }
+    put_bytes_field(&block, 1, data.data, data.len);
+    free(data.data);
+
+    int index = add_block(CID_CODEC_DAG_PB, &block, filesize);
+    memcpy(store[index].children, children, num_children * sizeof(int));
+    store[index].num_children = num_children;
+    return index;
+}
+
+static int find_stored(const cid_t *cid) {
+    for (int i = 0; i < num_stored; ++i) {
+        if (store[i].cid.len == cid->len &&
+            memcmp(store[i].cid.bytes, cid->bytes, cid->len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// What the stub gateway does wrong: the next `cut_cars` CARs lose their
+// last `car_cut` bytes
+static int cut_cars = 0;
+static size_t car_cut = 0;
+static int corrupt_block = -1;
+
+static void put_section(buf_t *car, int index) {
+    stored_t *stored = &store[index];
+    put_varint(car, stored->cid.len + stored->block.len);
+    put(car, stored->cid.bytes, stored->cid.len);
+    size_t start = car->len;
+    put(car, stored->block.data, stored->block.len);
+    if (index == corrupt_block) {
+        car->data[start] ^= 0xff;
+    }
+    for (int i = 0; i < stored->num_children; ++i) {
+        put_section(car, stored->children[i]);
+    }
+}
+
+static void build_car(buf_t *car, int root) {
+    static const uint8_t header[] = {0xa2, 0x65, 'r', 'o', 'o', 't', 's'};
+    put_varint(car, sizeof(header));
+    put(car, header, sizeof(header));
+    put_section(car, root);
+}
+
+// Stub easy handles and engine. Transfers run one at a time, in the order
+// they were added, like on the engine thread.
+typedef struct {
+    char url[512];
+    curl_write_callback write;
+    void *data;
+} stub_curl_t;
+
+typedef struct {
+    CURL *curl;
+    engine_done_fn done;
+    void *data;
+} transfer_t;
+
+static transfer_t transfers[64];
+static int num_transfers = 0;
+
+CURLcode curl_easy_setopt(CURL *curl, CURLoption option, ...) {
+    stub_curl_t *stub = (stub_curl_t *)curl;
+    va_list ap;
+    va_start(ap, option);
+    if (option == CURLOPT_URL) {
+        snprintf(stub->url, sizeof(stub->url), "%s", va_arg(ap, char *));
+    } else if (option == CURLOPT_WRITEFUNCTION) {
+        stub->write = va_arg(ap, curl_write_callback);
+    } else if (option == CURLOPT_WRITEDATA) {
+        stub->data = va_arg(ap, void *);
+    }
+    va_end(ap);
+    return CURLE_OK;
+}
+
+CURLcode curl_easy_getinfo(CURL *curl, CURLINFO info, ...) {
+    va_list ap;
+    va_start(ap, info);
+    if (info == CURLINFO_RESPONSE_CODE) {
+        *va_arg(ap, long *) = 200;
+    } else {
+        *va_arg(ap, curl_off_t *) = 0;
+    }
+    va_end(ap);
+    return CURLE_OK;
+}
+
+CURLcode curl_easy_pause(CURL *curl, int bitmask) {
+    return CURLE_OK;
+}
+
+const char *curl_easy_strerror(CURLcode code) {
+    return "stub error";
+}
+
+struct curl_slist *curl_slist_append(struct curl_slist *list,
+                                     const char *data) {
+    return list;
+}
+
+void curl_slist_free_all(struct curl_slist *list) {}
+
+CURL *conn_acquire(conn_t *conn) {
+    return (CURL *)calloc(1, sizeof(stub_curl_t));
+}
+
+void conn_release(conn_t *conn, CURL *curl) {
+    free(curl);
+}
+
+void conn_record(conn_t *conn, CURL *curl) {}
+
+int gateway_pick(gateways_t *gateways, int exclude,
+                 const unsigned char *blocked) {
+    return blocked[0] ? -1 : 0;
+}
+
+const char *gateway_host(gateways_t *gateways, int index) {
+    return "stub.example";
+}
+
+void gateway_record(gateways_t *gateways, int index, int succeeded,
+                    double ttfb, double throughput) {}
+
+void engine_add(engine_t *engine, CURL *curl, engine_done_fn done,
+                void *data) {
+    transfers[num_transfers++] = (transfer_t){curl, done, data};
+}
+
+void engine_remove(engine_t *engine, CURL *curl) {
+    for (int i = 0; i < num_transfers; ++i) {
+        if (transfers[i].curl == curl) {
+            memmove(&transfers[i], &transfers[i + 1],
+                    (num_transfers - i - 1) * sizeof(transfer_t));
+            num_transfers--;
+            return;
+        }
+    }
+}
+
+void engine_hold(engine_t *engine) {}
+
+void engine_unhold(engine_t *engine) {}
+
+// Answers `https://stub.example/<cid>?format=raw|car`
+static CURLcode serve(stub_curl_t *stub) {
+    char *slash = strrchr(stub->url, '/');
+    char *query = strchr(stub->url, '?');
+    char text[CID_MAX_TEXT];
+    cid_t cid;
+
+    snprintf(text, sizeof(text), "%.*s", (int)(query - slash - 1), slash + 1);
+    int index = cid_decode(text, &cid) == 0 ? find_stored(&cid) : -1;
+    if (index < 0) {
+        return CURLE_HTTP_RETURNED_ERROR;
+    }
+
+    buf_t body = {0};
+    if (strcmp(query, "?format=car") == 0) {
+        build_car(&body, index);
+        if (cut_cars > 0) {
+            cut_cars--;
+            body.len -= car_cut;
+        }
+    } else {
+        put(&body, store[index].block.data, store[index].block.len);
+        if (index == corrupt_block) {
+            body.data[0] ^= 0xff;
+        }
+    }
+
+    CURLcode res = CURLE_OK;
+    for (size_t pos = 0; pos < body.len; pos += FEED_CHUNK) {
+        size_t len = body.len - pos < FEED_CHUNK ? body.len - pos : FEED_CHUNK;
+        if (stub->write((char *)body.data + pos, 1, len, stub->data) != len) {
+            res = CURLE_WRITE_ERROR;
+            break;
+        }
+    }
+    free(body.data);
+    return res;
+}
+
+static void run_engine(void) {
+    while (num_transfers > 0) {
+        transfer_t transfer = transfers[0];
+        memmove(&transfers[0], &transfers[1],
+                (num_transfers - 1) * sizeof(transfer_t));
+        num_transfers--;
+        CURLcode res = serve((stub_curl_t *)transfer.curl);
+        transfer.done(NULL, transfer.curl, res, transfer.data);
+    }
+}
+
+// Every fetch is as urgent as the track playing
+static int64_t fetch_rank(void *data) {
+    return 0;
+}
+
+static void fetch_done(dag_fetch_t *fetch, int succeeded, void *data) {
+    *(int *)data = succeeded;
+}
+
+// Returns what the fetch of `root` reported to its callback, and whether
+// the file holds `expected` in `intact`
+static int fetch(dag_t *dag, int root, const char *expected, int *intact) {
+    char text[CID_MAX_TEXT];
+    char path[] = "/tmp/dag_test.XXXXXX";
+    int fd = mkstemp(path);
+    int succeeded = -1;
+
+    unlink(path);
+    cid_encode(&store[root].cid, text, sizeof(text));
+    dag_fetch_start(dag, text, fd, 0, -1, fetch_done, &succeeded);
+    run_engine();
+
+    char written[256] = {0};
+    ssize_t len = pread(fd, written, sizeof(written) - 1, 0);
+    close(fd);
+    *intact = len == (ssize_t)strlen(expected) &&
+              strcmp(written, expected) == 0;
+    return succeeded;
+}
+
+static int count_block(const cid_t *cid, const uint8_t *data, size_t len,
+                       void *userdata) {
+    (*(int *)userdata)++;
+    return 0;
+}
+
+static void test_car_reader(int root) {
+    buf_t car = {0};
+    build_car(&car, root);
+
+    int blocks = 0;
+    car_reader_t reader;
+    car_reader_init(&reader, count_block, &blocks);
+    for (size_t pos = 0; pos < car.len; ++pos) {
+        expect(car_reader_feed(&reader, car.data + pos, 1) == 0,
+               "CAR fed a byte at a time");
+    }
+    expect(car_reader_finish(&reader) == 0, "whole CAR finishes");
+    expect(blocks == 3, "CAR hands out every block");
+    car_reader_free(&reader);
+
+    blocks = 0;
+    car_reader_init(&reader, count_block, &blocks);
+    expect(car_reader_feed(&reader, car.data, car.len - 3) == 0,
+           "truncated CAR feeds");
+    expect(car_reader_finish(&reader) != 0, "truncated CAR fails to finish");
+    car_reader_free(&reader);
+    free(car.data);
+}
+
+static void test_unixfs(int node, int skewed) {
+    unixfs_node_t decoded;
+    buf_t *block = &store[node].block;
+    expect(unixfs_decode(block->data, block->len, &decoded) == 0 &&
+               decoded.num_links == 2 &&
+               decoded.filesize == store[node].filesize,
+           "file node decodes");
+    unixfs_free(&decoded);
+    expect(unixfs_decode(block->data, block->len - 1, &decoded) != 0,
+           "truncated node is rejected");
+
+    block = &store[skewed].block;
+    expect(unixfs_decode(block->data, block->len, &decoded) == 0 &&
+               decoded.blocksizes[0] + decoded.blocksizes[1] !=
+                   decoded.filesize,
+           "skewed node decodes with blocksizes off its filesize");
+    unixfs_free(&decoded);
+}
+
+int main(void) {
+    apr_initialize();
+    apr_pool_t *pool;
+    apr_pool_create(&pool, NULL);
+
+    char *gateways[] = {"stub.example"};
+    config_t config;
+    memset(&config, 0, sizeof(config_t));
+    config.gateways = gateways;
+    config.num_gateways = 1;
+    config.min_concurrency = 4;
+    config.max_concurrency = 4;
+    config.max_retries = 1;
+
+    context_t context;
+    memset(&context, 0, sizeof(context_t));
+    context.sched = sched_create(pool);
+    sched_sync(context.sched, &config);
+    dag_t *dag = dag_create(pool, NULL, &context, &config, fetch_rank);
+
+    // root -> (middle -> (first, second), third)
+    int first = add_leaf("first leaf, ");
+    int second = add_leaf("second leaf, ");
+    int third = add_leaf("third leaf");
+    int middle = add_node((int[]){first, second}, 2, 0);
+    int root = add_node((int[]){middle, third}, 2, 0);
+    int skewed = add_node((int[]){middle, third}, 2, 1);
+    const char *expected = "first leaf, second leaf, third leaf";
+
+    test_car_reader(middle);
+    test_unixfs(root, skewed);
+
+    int intact;
+    expect(fetch(dag, root, expected, &intact) == 1 && intact,
+           "DAG fetch writes the file");
+
+    // A CAR cut short in a leaf still delivers the blocks before it, and
+    // the leaf is fetched on its own
+    cut_cars = 1;
+    car_cut = 3;
+    expect(fetch(dag, root, expected, &intact) == 1 && intact,
+           "CAR cut short in a leaf recovers");
+
+    // Cut short in its own block, it counts as a failed try of that block
+    buf_t car = {0};
+    build_car(&car, middle);
+    cut_cars = 1;
+    car_cut = car.len - 20;
+    free(car.data);
+    expect(fetch(dag, root, expected, &intact) == 0,
+           "truncated CAR fails the fetch");
+
+    corrupt_block = second;
+    expect(fetch(dag, root, expected, &intact) == 0,
+           "bad block in a CAR fails the fetch");
+    corrupt_block = third;
+    expect(fetch(dag, root, expected, &intact) == 0,
+           "bad raw block fails the fetch");
+    corrupt_block = -1;
+
+    expect(fetch(dag, skewed, expected, &intact) == 0,
+           "blocksizes that do not add up fail the fetch");
+
+    config.max_retries = 2;
+    cut_cars = 1;
+    expect(fetch(dag, root, expected, &intact) == 1 && intact,
+           "retry recovers from a truncated CAR");
+
+    dag_destroy(dag);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    if (failures > 0) {
+        return 1;
+    }
+    printf("dag_test: all passed\n");
+    return 0;
+}
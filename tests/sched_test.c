@@ -0,0 +1,161 @@
+#include "sched.h"
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_time.h>
+#include <stdio.h>
+#include <string.h>
+
+// Checks that the scheduler shared by every batch keeps its state from one
+// batch to the next: the concurrency window, the end of slow start, the
+// backoff interval and the gateway budgets.
+
+#define MIN_CONCURRENCY 2
+#define MAX_CONCURRENCY 32
+#define MAX_CONNECTIONS 2
+// Just over the scheduler's adapt interval
+#define INTERVAL apr_time_from_msec(1100)
+
+static int failures = 0;
+// The clock the test hands to sched_tick(), stepped instead of slept
+static apr_time_t now;
+
+static void expect(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// What download_start() syncs for every batch
+static void batch_config(config_t *config, char **gateways) {
+    memset(config, 0, sizeof(config_t));
+    config->gateways = gateways;
+    config->num_gateways = 2;
+    config->min_concurrency = MIN_CONCURRENCY;
+    config->max_concurrency = MAX_CONCURRENCY;
+    config->gateway_max_connections = MAX_CONNECTIONS;
+}
+
+// Fills the window and reports an interval of throughput, so the next tick
+// sees the window as the limit and throughput improving as long as every
+// call passes more bytes than the last
+static void fill_window(sched_t *sched, int *in_flight, size_t bytes) {
+    while (sched_admit(sched, 0)) {
+        sched_acquire(sched, -1, 0);
+        (*in_flight)++;
+    }
+    sched_consume(sched, 0, bytes);
+    now += INTERVAL;
+    sched_tick(sched, now);
+}
+
+static void drain(sched_t *sched, int *in_flight) {
+    for (; *in_flight > 0; --*in_flight) {
+        sched_release(sched, -1);
+    }
+}
+
+int main(void) {
+    apr_initialize();
+    apr_pool_t *pool;
+    apr_pool_create(&pool, NULL);
+
+    char *gateways[] = {"a.example", "b.example"};
+    char *swapped[] = {"b.example", "a.example"};
+    config_t config;
+    int in_flight = 0;
+
+    sched_t *sched = sched_create(pool);
+    now = apr_time_now();
+    batch_config(&config, gateways);
+    sched_sync(sched, &config);
+    expect(sched_window(sched) == MIN_CONCURRENCY, "starts at the minimum");
+
+    // Slow start doubles
+    fill_window(sched, &in_flight, 1000000);
+    drain(sched, &in_flight);
+    expect(sched_window(sched) == 2 * MIN_CONCURRENCY, "slow start doubles");
+
+    // The next batch keeps the window
+    batch_config(&config, gateways);
+    sched_sync(sched, &config);
+    expect(sched_window(sched) == 2 * MIN_CONCURRENCY,
+           "window carries over to the next batch");
+
+    // A backoff ends slow start, and a second one within the interval is
+    // the same signal, even when it comes from the next batch
+    sched_congested(sched, "test");
+    expect(sched_window(sched) == MIN_CONCURRENCY, "backoff halves");
+    sched_sync(sched, &config);
+    sched_congested(sched, "test");
+    expect(sched_window(sched) == MIN_CONCURRENCY,
+           "backoff interval carries over to the next batch");
+
+    batch_config(&config, gateways);
+    sched_sync(sched, &config);
+    fill_window(sched, &in_flight, 4000000);
+    drain(sched, &in_flight);
+    expect(sched_window(sched) == MIN_CONCURRENCY + 1,
+           "additive increase after slow start carries over");
+
+    // Tighter limits clamp the window without resetting it
+    config.max_concurrency = MIN_CONCURRENCY;
+    sched_sync(sched, &config);
+    expect(sched_window(sched) == MIN_CONCURRENCY, "clamped to the maximum");
+
+    // Connections held by one batch count against the next, whatever
+    // order its config lists the gateways in
+    unsigned char blocked[2];
+    batch_config(&config, gateways);
+    sched_sync(sched, &config);
+    for (int i = 0; i < MAX_CONNECTIONS; ++i) {
+        sched_acquire(sched, 0, 0);
+    }
+    batch_config(&config, swapped);
+    sched_sync(sched, &config);
+    sched_blocked(sched, blocked, config.num_gateways);
+    expect(!blocked[0] && blocked[1], "gateway budgets are shared by host");
+    for (int i = 0; i < MAX_CONNECTIONS; ++i) {
+        sched_release(sched, 1);
+    }
+    sched_blocked(sched, blocked, config.num_gateways);
+    expect(!blocked[0] && !blocked[1], "released connections free up");
+
+    // A prefetch batch only gets the room the playing batch leaves unused
+    batch_config(&config, gateways);
+    config.min_concurrency = 4;
+    config.max_concurrency = 4;
+    sched_sync(sched, &config);
+    int playing = sched_join(sched);
+    int prefetch = sched_join(sched);
+    expect(sched_admit(sched, 10), "admitted while nothing waits");
+    sched_wait_window(sched, playing, 5);
+    sched_wait_window(sched, prefetch, 20);
+    expect(sched_window_waiter(sched) == 5, "most urgent waiter wins");
+    expect(!sched_admit(sched, 10), "stands aside for a more urgent rank");
+    expect(sched_admit(sched, 5), "the waiting rank is admitted");
+    sched_leave(sched, playing);
+    expect(sched_admit(sched, 10), "a batch that left no longer waits");
+    sched_leave(sched, prefetch);
+    expect(sched_window_waiter(sched) == SCHED_IDLE, "all slots left");
+
+    // Tokens go to the most urgent paused transfer of any batch
+    playing = sched_join(sched);
+    prefetch = sched_join(sched);
+    sched_wait_bandwidth(sched, playing, 5);
+    expect(!sched_consume(sched, 10, 1), "stands aside for a paused rank");
+    expect(!sched_bandwidth_available(sched, 10), "no tokens for it either");
+    expect(sched_consume(sched, 5, 1), "the paused rank gets tokens");
+    sched_wait_bandwidth(sched, playing, SCHED_IDLE);
+    expect(sched_consume(sched, 10, 1), "writes once nothing is paused");
+    sched_leave(sched, playing);
+    sched_leave(sched, prefetch);
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    if (failures > 0) {
+        return 1;
+    }
+    printf("sched_test: all passed\n");
+    return 0;
+}
@@ -0,0 +1,40 @@
+#include "log.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// Compiles a catalog into the snapshot that `catalog_snapshot` in the
+// config points at, so the player does not have to on its first run.
+//
+//   catalog_snapshot <db> <snapshot>
+
+int main(int argc, const char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <db> <snapshot>\n", argv[0]);
+        return -1;
+    }
+    log_set_quiet(true);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    if (snapshot_build(argv[1], argv[2]) != 0) {
+        fprintf(stderr, "%s: Failed to build %s\n", argv[0], argv[2]);
+        return -1;
+    }
+    gettimeofday(&end, NULL);
+
+    snapshot_t *snapshot = snapshot_open(argv[2], argv[1]);
+    if (!snapshot) {
+        fprintf(stderr, "%s: %s changed while building\n", argv[0], argv[1]);
+        return -1;
+    }
+    struct stat st;
+    stat(argv[2], &st);
+    fprintf(stdout, "Snapshot: %d tracks, %.1f MB in %.2f s\n",
+            snapshot_count_tracks(snapshot), st.st_size / 1048576.0,
+            (end.tv_sec - start.tv_sec) +
+                (end.tv_usec - start.tv_usec) / 1000000.0);
+    snapshot_close(snapshot);
+    return 0;
+}